@@ -37,6 +37,12 @@ typedef struct CPUBreakpoint {
     QTAILQ_ENTRY(CPUBreakpoint) entry;
 } CPUBreakpoint;
 
+/* Breakpoints set at a given pc. BP_CPU ones are ignored when RF is set. */
+typedef struct CPUBreakpointSet {
+    unsigned cpu;
+    unsigned other;
+} CPUBreakpointSet;
+
 typedef struct CPUWatchpoint {
     target_ulong vaddr;
     target_ulong len_mask;
@@ -66,7 +72,7 @@ typedef struct CPUWatchpoint {
     CPU_COMMON_TLB                                                                                    \
     CPU_COMMON_PHYSRAM_TLB                                                                            \
     CPUTLBEntry *se_tlb_current;                                                                      \
-    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];                                         \
+    CPU_COMMON_TB_JMP_CACHE                                                                           \
     /* buffer for temporaries in the code generator */                                                \
     long temp_buf[CPU_TEMP_BUF_NLONGS];                                                               \
     /* Used to handle self-modifying code */                                                          \
@@ -75,10 +81,13 @@ typedef struct CPUWatchpoint {
     /* from this point: preserved by CPU reset */                                                     \
     /* ice debug support */                                                                           \
     QTAILQ_HEAD(breakpoints_head, CPUBreakpoint) breakpoints;                                         \
+    struct _GHashTable *breakpoint_index; /* pc -> CPUBreakpointSet, see cpu_breakpoint_check */     \
     int singlestep_enabled;                                                                           \
                                                                                                       \
     QTAILQ_HEAD(watchpoints_head, CPUWatchpoint) watchpoints;                                         \
     CPUWatchpoint *watchpoint_hit;                                                                    \
+    struct _GHashTable *watchpoint_index; /* page -> watchpoints, see cpu_watchpoint_traps */         \
+    target_ulong watchpoint_flagged_page; /* page of the watchpoints with BP_WATCHPOINT_HIT */        \
                                                                                                       \
     /* Core interrupt code */                                                                         \
     jmp_buf jmp_env;                                                                                  \
@@ -88,6 +97,19 @@ typedef struct CPUWatchpoint {
     int cpu_index;          /* CPU index (informative) */                                             \
     int numa_node;          /* NUMA node this cpu is belonging to  */                                 \
     int running;            /* Nonzero if cpu is currently running(usermode).  */                                \
+    struct qemu_work_item *queued_work_first, *queued_work_last; /* see run_on_cpu */                 \
+    int32_t wait_kicks;    /* bumped by cpu_exit and cpu_interrupt, see cpu_wait_for_work */          \
+    int32_t wait_sleeping; /* nonzero while the thread may block in cpu_wait_for_work */              \
+    int64_t kick_time;     /* get_clock of the oldest pending cpu_kick, 0 if none */                  \
+    /* return address prediction, see tb_ras_invalidate */                                            \
+    struct tb_ras_entry ras[TB_RAS_SIZE];                                                             \
+    struct tb_ras_slot ras_slots[TB_RAS_SLOTS];                                                       \
+    uint32_t ras_top;                                                                                 \
+    uint32_t ras_gen;                                                                                 \
+    uint32_t ras_fill; /* set by returns that missed, the next lookup fills the slot */               \
+    uint64_t ras_hits; /* predicted returns, added to g_cpu_stats when leaving cpu_exec */            \
+    int32_t icount_budget; /* instructions left before cpu_exec returns, see cpu_set_budget */        \
+    CPU_COMMON_TLB_DESC                                                                               \
     /* user data */                                                                                   \
     void *opaque;                                                                                     \
     unsigned size; /* Size of this structure */                                                       \
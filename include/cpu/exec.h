@@ -67,15 +67,144 @@ extern void *tci_tb_ptr;
 #include "precise-pc.h"
 
 void cpu_exit(CPUArchState *s);
+
+/* Blocks the thread of a halted CPU until the CPU has work, cpu_exit or cpu_interrupt is called,
+   the next timer expires or the deadline passes (in ns of get_clock, -1 for none). Returns true
+   if the CPU has work, otherwise the caller runs the timers that are due. */
+bool cpu_wait_for_work(CPUArchState *env, int64_t deadline);
+
+/* Makes the CPU leave the generated code, even from a self-chained loop, and go through the
+   execution loop after at most one more TB. Pending interrupts are then delivered, otherwise
+   cpu_exec returns EXCP_INTERRUPT. Safe to call from any thread and from signal handlers.
+   To deliver a device interrupt from another thread, call cpu_interrupt and then cpu_kick. */
+void cpu_kick(CPUArchState *env);
+
+/* Histogram of the time between cpu_kick and the CPU reaching the execution loop */
+void cpu_kick_dump_stats(FILE *f);
 void cpu_exec_init_all(void);
 void tcg_exec_init(unsigned long tb_size);
 
 void tlb_flush(CPUArchState *env, int flush_global);
 void tlb_flush_page(CPUArchState *env, target_ulong addr);
+/* Cross-vCPU shootdowns, must not be called with the translation lock held */
+void tlb_flush_all_cpus(int flush_global);
+void tlb_flush_page_all_cpus(target_ulong addr);
+
+/* Selects the address space of the TLB and jump cache. The entries of the
+   last few address spaces are kept across switches, unless flush is set. */
+void tlb_switch_asid(CPUArchState *env, unsigned asid, int flush);
+/* Drops the entries cached for an address space */
+void tlb_flush_asid(CPUArchState *env, unsigned asid);
+/* Drops the entries cached for all the address spaces but the current one */
+void tlb_flush_other_asids(CPUArchState *env);
+/* Drops a page from the TLB and jump cache of one address space only */
+void tlb_flush_page_asid(CPUArchState *env, unsigned asid, target_ulong addr);
 void tlb_fill(CPUArchState *env1, target_ulong addr, target_ulong page_addr, int is_write, int mmu_idx, void *retaddr);
 
 void tb_flush(CPUArchState *env);
 
+/* What to do when the translation buffer is full */
+typedef enum TBEvictMode {
+    /* discard all the translated code (default) */
+    TB_EVICT_FLUSH,
+    /* discard only the oldest code, see exec-tb.c */
+    TB_EVICT_GENERATIONAL
+} TBEvictMode;
+
+/* Must be called after tcg_exec_init, flushes the translation cache */
+void tb_set_evict_mode(TBEvictMode mode);
+TBEvictMode tb_get_evict_mode(void);
+
+/* Translation of new code ahead of its execution */
+typedef enum TBSpecMode {
+    /* translate on the vCPU thread only (default) */
+    TB_SPEC_OFF,
+    /* worker threads translate the static successors of new TBs, see exec-tbspec.c */
+    TB_SPEC_SUCCESSORS
+} TBSpecMode;
+
+/* Must be called after tcg_exec_init, while no vCPU is running */
+void tb_spec_set_mode(TBSpecMode mode, unsigned workers);
+TBSpecMode tb_spec_get_mode(void);
+
+/* Retranslation of hot code */
+typedef enum TBTierMode {
+    /* one guest block per TB (default) */
+    TB_TIER_OFF,
+    /* TBs executed more than a threshold are retranslated together with their hot successors */
+    TB_TIER_TRACES
+} TBTierMode;
+
+/* Flushes the translation cache. A threshold of 0 selects the default one. */
+void tb_tier_set_mode(TBTierMode mode, unsigned threshold);
+TBTierMode tb_tier_get_mode(void);
+
+/* Handling of writes to translated code */
+typedef enum TBSmcMode {
+    /* invalidate the overwritten TBs right away (default) */
+    TB_SMC_INVALIDATE,
+    /* pages repeatedly written and executed are checked for changes before execution, see exec-tbsmc.c */
+    TB_SMC_ADAPTIVE
+} TBSmcMode;
+
+/* Flushes the translation cache. A threshold of 0 selects the default number of write/execute cycles. */
+void tb_smc_set_mode(TBSmcMode mode, unsigned threshold);
+TBSmcMode tb_smc_get_mode(void);
+
+/* Reuse of translations across physical pages */
+typedef enum TBShareMode {
+    /* TBs are only used for the physical page they were translated from (default) */
+    TB_SHARE_OFF,
+    /* pages with the same contents as a translated page use its TBs, see exec-tbshare.c */
+    TB_SHARE_PAGES
+} TBShareMode;
+
+/* Flushes the translation cache */
+void tb_share_set_mode(TBShareMode mode);
+TBShareMode tb_share_get_mode(void);
+
+/* Instruction budget of cpu_exec */
+typedef enum CPUBudgetMode {
+    /* cpu_exec runs until an exception or an exit request (default) */
+    CPU_BUDGET_OFF,
+    /* cpu_exec also returns EXCP_BUDGET once the budget of the CPU is spent */
+    CPU_BUDGET_INSNS
+} CPUBudgetMode;
+
+/* Flushes the translation cache, the budget is checked by the generated code */
+void cpu_set_budget_mode(CPUBudgetMode mode);
+CPUBudgetMode cpu_get_budget_mode(void);
+
+/* Number of guest instructions the CPU may execute before cpu_exec returns EXCP_BUDGET */
+void cpu_set_budget(CPUArchState *env, int32_t insns);
+int32_t cpu_get_budget(CPUArchState *env);
+
+/* Record and replay of the inputs of the guest */
+typedef enum CPUReplayMode {
+    /* inputs come from the devices (default) */
+    CPU_REPLAY_OFF,
+    /* inputs are also written to a log, see replay.c */
+    CPU_REPLAY_RECORD,
+    /* inputs come from a log, the devices are not accessed */
+    CPU_REPLAY_PLAY
+} CPUReplayMode;
+
+/* Must be called while the CPU is stopped. Replay uses the instruction budget, which the
+   caller must not change until cpu_replay_stop. When playing, cpu_exec returns EXCP_BUDGET
+   at the end of the log. Only supports a single vCPU. Returns 0 on success. */
+int cpu_replay_start(CPUReplayMode mode, const char *path);
+void cpu_replay_stop(void);
+CPUReplayMode cpu_replay_get_mode(void);
+
+/* Persistent translation cache. tb_cache_init must be called before
+   tcg_exec_init, tb_cache_save writes the current translations back.
+   Cached code is not relocated: it is only reused when libcpu, libtcg and
+   the code buffer are at the same addresses as when it was saved, so
+   address space randomization must be disabled for the process (e.g. with
+   setarch -R). Otherwise the cache is ignored and the reason is printed. */
+void tb_cache_init(const char *path);
+int tb_cache_save(void);
+
 /* page related stuff */
 
 #define TARGET_PAGE_SIZE (1 << TARGET_PAGE_BITS)
@@ -98,7 +227,8 @@ void cpu_dump_statistics(CPUArchState *env, FILE *f, fprintf_function cpu_fprint
 target_phys_addr_t cpu_get_phys_page_debug(CPUArchState *env, target_ulong addr);
 
 void LIBCPU_NORETURN cpu_abort(CPUArchState *env, const char *fmt, ...) GCC_FMT_ATTR(2, 3);
-extern CPUArchState *first_cpu, *cpu_single_env;
+extern CPUArchState *first_cpu;
+extern LIBCPU_VCPU_LOCAL CPUArchState *cpu_single_env;
 
 typedef void (*CPUInterruptHandler)(CPUArchState *, int);
 extern CPUInterruptHandler cpu_interrupt_handler;
@@ -169,6 +169,16 @@ typedef struct CPUX86State {
     uint32_t smbase;
     int old_exception; /* exception in flight */
 
+    /* LOCK-prefixed read-modify-write being committed, see helper_lock */
+    target_ulong lock_addr;
+    target_ulong lock_old;
+    target_ulong lock_val;
+    int32_t lock_op;   /* size and memory index of the access, as for gen_op_st_v */
+    int32_t lock_step; /* execute the next instruction with the other vCPUs stopped */
+
+    /* Descriptor address of the INVPCID being executed, see helper_invpcid */
+    target_ulong invpcid_desc;
+
     uint8_t timer_interrupt_disabled;
     uint8_t all_apic_interrupts_disabled;
 
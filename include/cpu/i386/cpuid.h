@@ -42,6 +42,8 @@ typedef struct cpuid_t {
     /* Store the results of Centaur's CPUID instructions */
     uint32_t cpuid_xlevel2;
     uint32_t cpuid_ext4_features;
+    /* EBX of leaf 7, subleaf 0 */
+    uint32_t cpuid_7_0_ebx_features;
 
     /* For KVM */
     uint32_t cpuid_kvm_features;
@@ -109,6 +111,7 @@ static const uint32_t CPUID_EXT_CX16 = (1 << 13);
 static const uint32_t CPUID_EXT_XTPR = (1 << 14);
 static const uint32_t CPUID_EXT_PDCM = (1 << 15);
 static const uint32_t CPUID_EXT_S2E = (1 << 16);
+static const uint32_t CPUID_EXT_PCID = (1 << 17);
 static const uint32_t CPUID_EXT_DCA = (1 << 18);
 static const uint32_t CPUID_EXT_SSE41 = (1 << 19);
 static const uint32_t CPUID_EXT_SSE42 = (1 << 20);
@@ -143,6 +146,8 @@ static const uint32_t CPUID_EXT3_OSVW = (1 << 9);
 static const uint32_t CPUID_EXT3_IBS = (1 << 10);
 static const uint32_t CPUID_EXT3_SKINIT = (1 << 12);
 
+static const uint32_t CPUID_7_0_EBX_INVPCID = (1 << 10);
+
 static const uint32_t CPUID_SVM_NPT = (1 << 0);
 static const uint32_t CPUID_SVM_LBRV = (1 << 1);
 static const uint32_t CPUID_SVM_SVMLOCK = (1 << 2);
@@ -151,6 +151,7 @@ extern "C" {
 #define HF_SVME_SHIFT       20 /* SVME enabled (copy of EFER.SVME) */
 #define HF_SVMI_SHIFT       21 /* SVM intercepts are active */
 #define HF_OSFXSR_SHIFT     22 /* CR4.OSFXSR */
+#define HF_SSTEP_SHIFT      23 /* TB flag only: translated for debugger single stepping */
 
 #define HF_CPL_MASK          (3 << HF_CPL_SHIFT)
 #define HF_SOFTMMU_MASK      (1 << HF_SOFTMMU_SHIFT)
@@ -172,6 +173,7 @@ extern "C" {
 #define HF_SVME_MASK         (1 << HF_SVME_SHIFT)
 #define HF_SVMI_MASK         (1 << HF_SVMI_SHIFT)
 #define HF_OSFXSR_MASK       (1 << HF_OSFXSR_SHIFT)
+#define HF_SSTEP_MASK        (1 << HF_SSTEP_SHIFT)
 
 /* hflags2 */
 
@@ -210,6 +212,10 @@ extern "C" {
 #define CR4_OSFXSR_SHIFT 9
 #define CR4_OSFXSR_MASK (1 << CR4_OSFXSR_SHIFT)
 #define CR4_OSXMMEXCPT_MASK  (1 << 10)
+#define CR4_PCIDE_MASK  (1 << 17)
+
+/* Not a control register: helper_write_crN executes INVPCID when given it */
+#define CR_INVPCID 16
 
 #define DR6_BD          (1 << 13)
 #define DR6_BS          (1 << 14)
@@ -77,6 +77,7 @@ extern "C" {
 #ifdef CONFIG_SYMBEX
 #define EXCP_SE 0x10004 /* Symbex engine requested exiting cpu loop */
 #endif
+#define EXCP_BUDGET 0x10005 /* cpu executed all the instructions of its budget */
 
 #ifdef __cplusplus
 }
@@ -46,6 +46,25 @@ typedef struct TranslationBlock TranslationBlock;
 #define TB_JMP_ADDR_MASK (TB_JMP_PAGE_SIZE - 1)
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
+/* Return address prediction. Calls push the return address together with
+   the slot caching the TB found at that address, returns pop it and jump
+   to the cached code when the prediction holds. */
+#define TB_RAS_SIZE 16
+#define TB_RAS_SLOTS 256
+
+struct tb_ras_entry {
+    target_ulong eip;
+    uint32_t slot;
+};
+
+struct tb_ras_slot {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint32_t flags;
+    uint32_t gen; /* valid if equal to the ras_gen of the CPU */
+    void *tc_ptr;
+};
+
 ///
 /// \brief tb_get_instruction_size returns the size of the guest machine
 /// instruction starting at the given address and belonging to the given
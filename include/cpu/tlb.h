@@ -27,9 +27,14 @@
 extern "C" {
 #endif
 
+/* Initial size of the TLB of each MMU mode. Outside symbolic execution, the
+   size then follows the use of the TLB, see tlb_flush. */
 #define CPU_TLB_BITS 10
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
+#define CPU_TLB_DYN_MIN_BITS 8
+#define CPU_TLB_DYN_MAX_BITS 16
+
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 6
 #else
@@ -46,7 +51,9 @@ typedef struct CPUTLBEntry {
     target_ulong addr_read;
     target_ulong addr_write;
     target_ulong addr_code;
-    target_ulong pad1;
+    /* virtual page if the mapping is the same in all address spaces,
+       -1 otherwise. Such entries survive non-global flushes. */
+    target_ulong addr_global;
 
     /* Addend to virtual address to get host address.  IO accesses
        use the corresponding iotlb value.  */
@@ -71,6 +78,21 @@ typedef struct CPUTLBEntry {
 
 extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BITS) ? 1 : -1];
 
+/* Large pages mapped since the last flush. The TLB holds their small pages,
+   which tlb_flush_page must all drop when one of them is invalidated.
+   tlb_large_page_ctxs has a bit for each address space in tlb_ctx whose TLB
+   may still hold some of them. */
+#define CPU_TLB_LARGE_PAGES 8
+
+#define CPU_COMMON_TLB_LARGE_PAGES                                    \
+    target_ulong tlb_large_page_addr[CPU_TLB_LARGE_PAGES];            \
+    target_ulong tlb_large_page_mask[CPU_TLB_LARGE_PAGES];            \
+    unsigned tlb_large_page_ctxs[CPU_TLB_LARGE_PAGES];                \
+    uint8_t tlb_large_page_global[CPU_TLB_LARGE_PAGES];               \
+    unsigned tlb_large_page_count;
+
+#ifdef CONFIG_SYMBEX
+/* The engine relies on the fixed size of the TLB */
 #define CPU_COMMON_TLB                                                \
     /* The meaning of the MMU modes is defined in the target code. */ \
     CPUTLBEntry *tlb_table[NB_MMU_MODES];                             \
@@ -78,8 +100,64 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];             \
     uintptr_t tlb_mask[NB_MMU_MODES];                                 \
     CPU_IOTLB_CHECK                                                   \
-    target_ulong tlb_flush_addr;                                      \
-    target_ulong tlb_flush_mask;
+    CPU_COMMON_TLB_LARGE_PAGES
+
+#define CPU_COMMON_TB_JMP_CACHE struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+
+/* A single address space is cached at a time, see tlb_switch_asid */
+#define CPU_COMMON_TLB_DESC unsigned tlb_asid;
+#else
+/* Entries evicted from the TLB of one MMU mode that are kept around */
+#define CPU_VTLB_SIZE 8
+
+/* Storage and use of the TLB of one MMU mode, see tlb_flush */
+typedef struct CPUTLBDesc {
+    CPUTLBEntry *table;
+    target_phys_addr_t *iotlb;
+    /* Fully associative victim TLB, see tlb_victim_hit */
+    CPUTLBEntry vtable[CPU_VTLB_SIZE];
+    target_phys_addr_t viotlb[CPU_VTLB_SIZE];
+    unsigned vindex; /* next victim slot to replace */
+    unsigned bits;
+    unsigned used;            /* valid entries */
+    unsigned globals;         /* at most that many global entries, see tlb_flush */
+    unsigned evictions;       /* valid entries replaced since the last flush */
+    unsigned window_max_used; /* most entries used at a flush since window_begin */
+    int64_t window_begin;     /* get_clock at the start of the observation window */
+} CPUTLBDesc;
+
+/* Address spaces whose translations are kept, see tlb_switch_asid */
+#define CPU_TLB_ASIDS 8
+#define TLB_ASID_NONE ((unsigned) -1)
+
+/* TLB and jump cache of one address space */
+typedef struct CPUTLBContext {
+    CPUTLBDesc *desc;                    /* one per MMU mode, NULL until first used */
+    struct TranslationBlock **jmp_cache; /* TB_JMP_CACHE_SIZE entries */
+    unsigned asid;                       /* TLB_ASID_NONE if the entries are stale */
+    unsigned last_use;                   /* tlb_ctx_clock when last switched to */
+} CPUTLBContext;
+
+/* tlb_table and iotlb point to the storage of the current address space in tlb_ctx,
+   which is preserved by CPU reset */
+#define CPU_COMMON_TLB                                                \
+    /* The meaning of the MMU modes is defined in the target code. */ \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                             \
+    target_phys_addr_t *iotlb[NB_MMU_MODES];                          \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                 \
+    CPU_COMMON_TLB_LARGE_PAGES
+
+#define CPU_COMMON_TB_JMP_CACHE
+
+#define CPU_COMMON_TLB_DESC                                           \
+    CPUTLBContext tlb_ctx[CPU_TLB_ASIDS];                             \
+    unsigned tlb_ctx_clock;                                           \
+    /* The address space in use */                                   \
+    CPUTLBContext *tlb_ctx_cur;                                       \
+    CPUTLBDesc *tlb_desc;                                             \
+    struct TranslationBlock **tb_jmp_cache;                           \
+    int tlb_resize_lock; /* spinlock_t, held while resizing or moving entries */
+#endif
 
 typedef struct CPUTLBRAMEntry {
     uintptr_t host_page;
@@ -21,6 +21,14 @@ extern "C" {
 
 #define LIBCPU_NORETURN __attribute__((__noreturn__))
 
+/* State of the vCPU executing on the current thread. The symbolic execution
+   engine runs a single vCPU and refers to it by address from generated code. */
+#ifdef CONFIG_SYMBEX
+#define LIBCPU_VCPU_LOCAL
+#else
+#define LIBCPU_VCPU_LOCAL __thread
+#endif
+
 #if defined(_WIN32)
 #define LIBCPU_PACKED __attribute__((gcc_struct, packed))
 #else
@@ -61,6 +61,8 @@ int libcpu_timer_expired(CPUTimer *timer_head, int64_t current_time);
 
 void libcpu_run_timers(CPUClock *clock);
 void libcpu_run_all_timers(void);
+/* Nanoseconds before the next timer of any clock expires, INT64_MAX if none */
+int64_t libcpu_timers_deadline_ns(void);
 void init_clocks(void);
 
 int64_t cpu_get_ticks(void);
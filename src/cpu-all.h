@@ -166,7 +166,7 @@ static inline int _se_check_concrete(void *objectState, target_ulong offset, int
 
 static inline void *_se_check_translate_ram_access(const void *p, unsigned size) {
 #if defined(SE_ENABLE_PHYSRAM_TLB)
-    extern CPUArchState *env;
+    extern LIBCPU_VCPU_LOCAL CPUArchState *env;
     uintptr_t tlb_index = ((uintptr_t) p >> 12) & (CPU_TLB_SIZE - 1);
     CPUTLBRAMEntry *re = &env->se_ram_tlb[tlb_index];
     if (re->host_page == (((uintptr_t) p) & (~(uintptr_t) 0xfff | (size - 1)))) {
@@ -300,11 +300,33 @@ _symbex_define_st_raw_le(float64,  fq, 8)
 /* original state of the write flag (used when tracking self-modifying
    code */
 #define PAGE_WRITE_ORG 0x0010
+/* the mapping does not depend on the address space, for tlb_set_page */
+#define PAGE_GLOBAL 0x0020
+
+/* The size of the TLB of each MMU mode may change at each tlb_flush */
+static inline unsigned tlb_index(const CPUArchState *env, int mmu_idx, target_ulong addr) {
+    return (addr >> TARGET_PAGE_BITS) & (env->tlb_mask[mmu_idx] >> CPU_TLB_ENTRY_BITS);
+}
+
+static inline CPUTLBEntry *tlb_entry(CPUArchState *env, int mmu_idx, target_ulong addr) {
+    return &env->tlb_table[mmu_idx][tlb_index(env, mmu_idx, addr)];
+}
+
+#ifndef CONFIG_SYMBEX
+/* Looks for the page in the victim TLB, using the address field at elt_ofs
+   in the entries. On a hit, swaps the entry with the one at index in the
+   main TLB. */
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, unsigned index, size_t elt_ofs, target_ulong page);
+#endif
 
 #define CPU_DUMP_CODE 0x00010000
 
+/* Wakes up the thread of the vCPU if it waits in cpu_wait_for_work */
+void cpu_wait_kick(CPUArchState *env);
+
 static inline void cpu_interrupt(CPUArchState *s, int mask) {
     cpu_interrupt_handler(s, mask);
+    cpu_wait_kick(s);
 }
 
 void cpu_reset_interrupt(CPUArchState *env, int mask);
@@ -322,11 +344,14 @@ int cpu_breakpoint_insert(CPUArchState *env, target_ulong pc, int flags, CPUBrea
 int cpu_breakpoint_remove(CPUArchState *env, target_ulong pc, int flags);
 void cpu_breakpoint_remove_by_ref(CPUArchState *env, CPUBreakpoint *breakpoint);
 void cpu_breakpoint_remove_all(CPUArchState *env, int mask);
+const CPUBreakpointSet *cpu_breakpoint_lookup(CPUArchState *env, target_ulong pc);
+int cpu_breakpoint_check(CPUArchState *env, target_ulong pc, int resume);
 int cpu_watchpoint_insert(CPUArchState *env, target_ulong addr, target_ulong len, int flags,
                           CPUWatchpoint **watchpoint);
 int cpu_watchpoint_remove(CPUArchState *env, target_ulong addr, target_ulong len, int flags);
 void cpu_watchpoint_remove_by_ref(CPUArchState *env, CPUWatchpoint *watchpoint);
 void cpu_watchpoint_remove_all(CPUArchState *env, int mask);
+int cpu_watchpoint_traps(CPUArchState *env, target_ulong vaddr, int prot);
 
 #define SSTEP_ENABLE 0x1  /* Enable simulated HW single stepping */
 #define SSTEP_NOIRQ 0x2   /* Do not use IRQ while single stepping */
@@ -334,7 +359,18 @@ void cpu_watchpoint_remove_all(CPUArchState *env, int mask);
 
 void cpu_single_step(CPUArchState *env, int enabled);
 void cpu_state_reset(CPUArchState *s);
-void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data);
+
+/* Multiple vCPU threads, see cpus.c */
+typedef void (*run_on_cpu_func)(void *data);
+void run_on_cpu(CPUArchState *env, run_on_cpu_func func, void *data);
+void async_safe_run_on_cpu(CPUArchState *env, run_on_cpu_func func, void *data);
+void process_queued_cpu_work(CPUArchState *env);
+void cpu_exec_start(CPUArchState *env);
+void cpu_exec_end(CPUArchState *env);
+void start_exclusive(void);
+void end_exclusive(void);
+/* True if the vCPU must leave cpu_exec for queued work or an exclusive section */
+bool cpu_work_pending(CPUArchState *env);
 
 #define CPU_LOG_TB_OUT_ASM (1 << 0)
 #define CPU_LOG_TB_IN_ASM (1 << 1)
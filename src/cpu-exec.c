@@ -21,6 +21,14 @@
 #include <tcg/tcg.h>
 #include "cpu.h"
 #include "exec-tb.h"
+#include "exec-tbcache.h"
+#include "exec-tbhash.h"
+#include "exec-tbshare.h"
+#include "exec-tbsmc.h"
+#include "exec-tbspec.h"
+#include "exec-tbtier.h"
+#include "replay.h"
+#include "timer.h"
 
 #ifdef CONFIG_SYMBEX
 #include <cpu/se_libcpu.h>
@@ -41,7 +49,7 @@
 #include "tcg/tcg-llvm.h"
 #endif
 
-int tb_invalidated_flag;
+LIBCPU_VCPU_LOCAL int tb_invalidated_flag;
 
 struct cpu_stats_t g_cpu_stats;
 
@@ -80,63 +88,87 @@ void cpu_resume_from_signal(CPUArchState *env, void *puc) {
 }
 #endif
 
-static TranslationBlock *tb_find_slow(CPUArchState *env, target_ulong pc, target_ulong cs_base, uint64_t flags) {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+struct tb_desc {
+    CPUArchState *env;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    tb_page_addr_t phys_page1;
+};
 
-    tb_invalidated_flag = 0;
+static bool tb_lookup_cmp(const TranslationBlock *tb, const void *opaque) {
+    const struct tb_desc *desc = opaque;
 
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for (;;) {
-        tb = *ptb1;
-        if (!tb) {
-            goto not_found;
-        }
+    if (tb->pc != desc->pc || tb->page_addr[0] != desc->phys_page1 || tb->cs_base != desc->cs_base ||
+        tb->flags != desc->flags || (atomic_read(&tb->cflags) & CF_INVALID)) {
+        return false;
+    }
 
-        int llvm_nok = 0;
 #if defined(CONFIG_SYMBEX_MP)
-        if (env->generate_llvm && !tb->llvm_function) {
-            llvm_nok = 1;
-        }
+    if (desc->env->generate_llvm && !tb->llvm_function) {
+        return false;
+    }
 #endif
 
-        if (tb->pc == pc && tb->page_addr[0] == phys_page1 && tb->cs_base == cs_base && tb->flags == flags &&
-            !llvm_nok) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
+    /* check next page if needed */
+    if (tb->page_addr[1] != -1) {
+        target_ulong virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+        return tb->page_addr[1] == tb_share_resolve(get_page_addr_code(desc->env, virt_page2));
+    }
 
-                virt_page2 = (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2) {
-                    ++g_cpu_stats.tb_misses;
-                }
-                goto found;
-            } else {
-                ++g_cpu_stats.tb_misses;
-                goto found;
-            }
+    return true;
+}
+
+static TranslationBlock *tb_find_slow(CPUArchState *env, target_ulong pc, target_ulong cs_base, uint64_t flags) {
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
+    struct tb_desc desc;
+
+    tb_invalidated_flag = 0;
+
+    /* the lookups below are not safe against concurrent translations, unlike the hash table */
+    tb_translate_lock();
+
+    /* find translated block using physical mappings */
+    phys_pc = get_page_addr_code(env, pc);
+    tb_smc_validate_page(phys_pc);
+    phys_pc = tb_share_resolve(phys_pc);
+
+    desc.env = env;
+    desc.pc = pc;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+
+    tb = tb_hash_lookup(tb_hash_func(phys_pc, pc, cs_base, flags), tb_lookup_cmp, &desc);
+    if (!tb) {
+        /* the same code may have been translated at another physical address */
+        tb_page_addr_t shared_pc = tb_share_find(phys_pc);
+        if (shared_pc != phys_pc) {
+            phys_pc = shared_pc;
+            desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+            tb = tb_hash_lookup(tb_hash_func(phys_pc, pc, cs_base, flags), tb_lookup_cmp, &desc);
         }
-        ptb1 = &tb->phys_hash_next;
     }
-not_found:
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-    ++g_cpu_stats.tb_regens;
+    if (!tb) {
+        /* the code may have been translated by a previous run */
+        tb = tb_cache_lookup(env, phys_pc, pc, cs_base, flags);
+    }
+    if (!tb) {
+        /* or by a translation worker */
+        tb = tb_spec_lookup(env, phys_pc, pc, cs_base, flags);
+    }
 
-found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
+    if (tb) {
+        ++g_cpu_stats.tb_misses;
+    } else {
+        /* if no translated code available, then translate it now */
+        tb = tb_gen_code(env, pc, cs_base, flags, 0);
+        ++g_cpu_stats.tb_regens;
     }
+
+    tb_translate_unlock();
+
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -171,7 +203,9 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env) {
     int llvm_nok = 0;
 #endif
 
-    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base || tb->flags != flags || llvm_nok)) {
+    /* another vCPU may have invalidated the TB since it was cached */
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base || tb->flags != flags || llvm_nok ||
+                 (atomic_read(&tb->cflags) & CF_INVALID))) {
         tb = tb_find_slow(env, pc, cs_base, flags);
     } else {
         ++g_cpu_stats.tb_hits;
@@ -179,6 +213,53 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env) {
     return tb;
 }
 
+/*
+ * Called by the code generated for indirect jumps, calls and returns
+ * to find the next TB without leaving the code cache. Anything but
+ * a jump cache hit goes back to the execution loop, which takes care
+ * of interrupts, exit requests and translation.
+ */
+void *helper_lookup_tb_ptr(CPUArchState *env1) {
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+    uint32_t ras_fill = env1->ras_fill;
+
+    env1->ras_fill = 0;
+    if (ras_fill) {
+        ++g_cpu_stats.ras_misses;
+    }
+
+    if (unlikely(env1->exit_request || env1->interrupt_request || env1->kvm_request_interrupt_window)) {
+        ++g_cpu_stats.tb_ptr_misses;
+        return tcg_ctx->code_gen_epilogue;
+    }
+
+    cpu_get_tb_cpu_state(env1, &pc, &cs_base, &flags);
+    tb = env1->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base || tb->flags != flags ||
+                 (atomic_read(&tb->cflags) & CF_INVALID))) {
+        ++g_cpu_stats.tb_ptr_misses;
+        return tcg_ctx->code_gen_epilogue;
+    }
+
+    ++g_cpu_stats.tb_ptr_hits;
+
+    if (ras_fill) {
+        /* a return missed its prediction, cache the target for the next calls from the same site */
+        struct tb_ras_slot *slot = &env1->ras_slots[tb_ras_slot_hash(pc)];
+        slot->pc = pc;
+        slot->cs_base = cs_base;
+        slot->flags = flags;
+        slot->tc_ptr = tb->tc.ptr;
+        slot->gen = env1->ras_gen;
+    }
+
+    env1->current_tb = tb;
+    return tb->tc.ptr;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler) {
@@ -232,12 +313,54 @@ static void dump_regs(CPUState *env, int isStart) {
 }
 #endif
 
+static CPUBudgetMode s_budget_mode = CPU_BUDGET_OFF;
+
+void cpu_set_budget_mode(CPUBudgetMode mode) {
+    atomic_set(&s_budget_mode, mode);
+
+    /* The budget is checked at the start of each TB */
+    tb_flush(first_cpu);
+}
+
+CPUBudgetMode cpu_get_budget_mode(void) {
+    return atomic_read(&s_budget_mode);
+}
+
+void cpu_set_budget(CPUArchState *env, int32_t insns) {
+    env->icount_budget = insns;
+}
+
+int32_t cpu_get_budget(CPUArchState *env) {
+    return env->icount_budget;
+}
+
+/* The TB does not fit in the remaining budget. Returns a TB for the
+   remaining instructions, which must be invalidated after use. */
+static TranslationBlock *cpu_budget_tail(CPUArchState *env, TranslationBlock *tb) {
+    if (env->icount_budget <= 0) {
+        if (!replay_enabled() || !replay_budget_spent(env)) {
+            env->exception_index = EXCP_BUDGET;
+        }
+        /* the execution loop delivers the interrupts that are due */
+        cpu_loop_exit(env);
+    }
+
+    return tb_gen_code(env, tb->pc, tb->cs_base, tb->flags, env->icount_budget | CF_NOCACHE);
+}
+
 static uintptr_t fetch_and_run_tb(TranslationBlock *prev_tb, int tb_exit_code, CPUArchState *env) {
     uint8_t *tc_ptr;
     uintptr_t last_tb;
+    bool budget_tail = false;
 
     TranslationBlock *tb = tb_find_fast(env);
 
+    if (unlikely(atomic_read(&s_budget_mode) != CPU_BUDGET_OFF && env->icount_budget < tb->icount)) {
+        tb = cpu_budget_tail(env, tb);
+        budget_tail = true;
+        prev_tb = NULL;
+    }
+
     DPRINTF("fetch_and_run_tb cs:eip=%#lx:%#lx e=%#lx fl=%lx riw=%d\n", (uint64_t) env->segs[R_CS].selector,
             (uint64_t) env->eip, (uint64_t) env->eip + tb->size, (uint64_t) env->mflags,
             env->kvm_request_interrupt_window);
@@ -247,15 +370,34 @@ static uintptr_t fetch_and_run_tb(TranslationBlock *prev_tb, int tb_exit_code, C
         tb_invalidated_flag = 0;
     }
 
+    /* a stepping TB must be entered from here to stop after it */
+    if (prev_tb && ((prev_tb->flags ^ tb->flags) & HF_SSTEP_MASK)) {
+        prev_tb = NULL;
+    }
+
 #ifdef CONFIG_DEBUG_EXEC
     libcpu_log_mask(CPU_LOG_EXEC, "Trace 0x%08lx [" TARGET_FMT_lx "] %s\n", (long) tb->tc_ptr, tb->pc,
                     lookup_symbol(tb->pc));
 #endif
+    /*
+     * The second page of a TB is tracked by its virtual address, which
+     * only says when the mapping of the vCPU flushing its TLB changes.
+     * The other vCPUs may map that page differently, so with several of
+     * them such TBs are always entered through the lookup.
+     */
+    if (prev_tb && tb->page_addr[1] != -1 && first_cpu->next_cpu) {
+        prev_tb = NULL;
+    }
+
     /*
      * see if we can patch the calling TB. When the TB
-     * spans two pages, we cannot safely do a direct jump.
+     * spans two pages, the jump must be removed if the
+     * second page gets remapped.
      */
-    if (prev_tb && tb->page_addr[1] == -1) {
+    if (prev_tb) {
+        if (tb->page_addr[1] != -1) {
+            tb_page2_track(tb);
+        }
         tb_add_jump(prev_tb, tb_exit_code, tb);
     }
 
@@ -271,6 +413,10 @@ static uintptr_t fetch_and_run_tb(TranslationBlock *prev_tb, int tb_exit_code, C
     barrier();
     if (unlikely(env->exit_request)) {
         env->current_tb = NULL;
+        if (budget_tail) {
+            tb_phys_invalidate(tb, -1);
+            tcg_tb_remove(tb);
+        }
         return 0;
     }
 
@@ -306,11 +452,23 @@ static uintptr_t fetch_and_run_tb(TranslationBlock *prev_tb, int tb_exit_code, C
 
     env->current_tb = NULL;
 
+    if (budget_tail) {
+        /* the next lookup must find the regular TB */
+        tb_phys_invalidate(tb, -1);
+        tcg_tb_remove(tb);
+    }
+
     return last_tb;
 }
 
 static bool process_interrupt_request(CPUArchState *env) {
-    int interrupt_request = env->interrupt_request;
+    int interrupt_request;
+
+    if (unlikely(replay_enabled())) {
+        replay_sync_interrupts(env);
+    }
+
+    interrupt_request = env->interrupt_request;
 
     if (likely(!interrupt_request)) {
         return false;
@@ -365,6 +523,9 @@ static bool process_interrupt_request(CPUArchState *env) {
 
             libcpu_log_mask(CPU_LOG_INT, "Servicing hardware INT=0x%02x\n", intno);
             if (intno >= 0) {
+                if (unlikely(replay_enabled())) {
+                    replay_interrupt(env, intno);
+                }
 #ifdef SE_KVM_DEBUG_IRQ
                 DPRINTF("Handling interrupt %d\n", intno);
 #endif
@@ -421,6 +582,100 @@ static int process_exceptions(CPUArchState *env) {
     return ret;
 }
 
+#ifndef CONFIG_SYMBEX
+/* Instruction executed by this thread with the other vCPUs stopped */
+static LIBCPU_VCPU_LOCAL TranslationBlock *s_step_tb;
+static LIBCPU_VCPU_LOCAL bool s_step_exclusive;
+
+static void cpu_exec_step_end(CPUArchState *env) {
+    if (s_step_tb) {
+        tb_phys_invalidate(s_step_tb, -1);
+        tcg_tb_remove(s_step_tb);
+        s_step_tb = NULL;
+    }
+
+    if (s_step_exclusive) {
+        s_step_exclusive = false;
+        env->lock_step = 0;
+        end_exclusive();
+        cpu_exec_start(env);
+    }
+}
+
+/* A locked instruction could not be done with a host atomic operation, see helper_lock */
+static void cpu_exec_step_exclusive(CPUArchState *env) {
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_exec_end(env);
+    start_exclusive();
+    s_step_exclusive = true;
+
+    /* translated with plain accesses to memory because env->lock_step is set */
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    s_step_tb = tb_gen_code(env, pc, cs_base, flags, 1 | CF_NOCACHE);
+
+    env->current_tb = s_step_tb;
+    tcg_libcpu_tb_exec(env, s_step_tb->tc.ptr);
+    env->current_tb = NULL;
+
+    cpu_exec_step_end(env);
+}
+#endif
+
+/*
+ * Kicks. The generated code checks env->exit_request at the start of every
+ * TB, chained or not, so a kicked vCPU leaves the generated code after at
+ * most one TB. The latency is measured from cpu_kick until the execution
+ * loop consumes the request.
+ */
+#define CPU_KICK_BUCKETS 40
+
+static uint64_t s_kick_latency[CPU_KICK_BUCKETS]; /* log2 of the latency in ns */
+
+void cpu_kick(CPUArchState *env) {
+    /* several pending kicks are honoured together, time the oldest one */
+    atomic_cmpxchg(&env->kick_time, 0, get_clock());
+    cpu_exit(env);
+}
+
+static void cpu_kick_honoured(CPUArchState *env) {
+    int64_t kick_time = atomic_xchg(&env->kick_time, 0);
+    int64_t latency;
+    unsigned bucket = 0;
+
+    if (!kick_time) {
+        /* a plain cpu_exit */
+        return;
+    }
+
+    latency = get_clock() - kick_time;
+    while (latency > 1 && bucket < CPU_KICK_BUCKETS - 1) {
+        latency >>= 1;
+        ++bucket;
+    }
+
+    atomic_inc(&s_kick_latency[bucket]);
+}
+
+void cpu_kick_dump_stats(FILE *f) {
+    uint64_t total = 0;
+
+    for (unsigned i = 0; i < CPU_KICK_BUCKETS; ++i) {
+        total += atomic_read(&s_kick_latency[i]);
+    }
+
+    fprintf(f, "Kick latency: %" PRIu64 " kicks\n", total);
+    for (unsigned i = 0; i < CPU_KICK_BUCKETS; ++i) {
+        uint64_t count = atomic_read(&s_kick_latency[i]);
+
+        if (count) {
+            fprintf(f, "  < %12" PRIu64 " ns: %" PRIu64 " (%.1f%%)\n", (uint64_t) 2 << i, count,
+                    100.0 * count / total);
+        }
+    }
+}
+
 static bool execution_loop(CPUArchState *env) {
     uintptr_t last_tb = 0;
     int last_tb_exit_code = 0;
@@ -428,6 +683,13 @@ static bool execution_loop(CPUArchState *env) {
 
     for (;;) {
         bool has_interrupt = false;
+        /* consumed before looking at the interrupts, a later kick leaves it set */
+        bool has_exit_request = atomic_xchg(&env->exit_request, 0);
+
+        if (has_exit_request) {
+            cpu_kick_honoured(env);
+        }
+
         if (process_interrupt_request(env)) {
             /*
              * ensure that no TB jump will be modified as
@@ -437,17 +699,16 @@ static bool execution_loop(CPUArchState *env) {
             has_interrupt = true;
         }
 
-        if (unlikely(!has_interrupt && env->exit_request)) {
+        /* Delivering an interrupt does not leave the generated code, which
+           other threads waiting for this vCPU rely on */
+        if (unlikely(has_exit_request && (!has_interrupt || cpu_work_pending(env)))) {
             DPRINTF("  execution_loop: exit_request\n");
-            env->exit_request = 0;
             env->exception_index = EXCP_INTERRUPT;
 
             // XXX: return status code instead
             cpu_loop_exit(env);
         }
 
-        env->exit_request = 0;
-
 #if defined(DEBUG_DISAS) || defined(CONFIG_DEBUG_EXEC)
         if (libcpu_loglevel_mask(CPU_LOG_TB_CPU)) {
 #if defined(TARGET_I386)
@@ -458,6 +719,14 @@ static bool execution_loop(CPUArchState *env) {
         }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
 
+#ifndef CONFIG_SYMBEX
+        if (unlikely(env->lock_step)) {
+            cpu_exec_step_exclusive(env);
+            ltb = NULL;
+            continue;
+        }
+#endif
+
         last_tb = fetch_and_run_tb(ltb, last_tb_exit_code, env);
 
         last_tb_exit_code = last_tb & TB_EXIT_MASK;
@@ -471,6 +740,11 @@ static bool execution_loop(CPUArchState *env) {
 
         if (last_tb_exit_code > TB_EXIT_IDXMAX) {
             env->eip = ltb->pc - ltb->cs_base;
+            /* the TB may also have exited because it became hot */
+            tb_tier_check(env, ltb);
+            ltb = NULL;
+        } else if (ltb && (atomic_read(&ltb->cflags) & CF_INVALID)) {
+            /* e.g. the tail of the instruction budget, it must not be linked */
             ltb = NULL;
         }
 
@@ -483,9 +757,21 @@ static bool execution_loop(CPUArchState *env) {
     return false;
 }
 
+/* The helpers refer to the vCPU of the current thread through the global env */
+static void cpu_set_helper_env(CPUArchState *env1) {
+    env = env1;
+}
+
 int cpu_exec(CPUArchState *env) {
     int ret;
 
+    /* work queued by other threads, also for halted vCPUs */
+    process_queued_cpu_work(env);
+
+    if (unlikely(replay_enabled())) {
+        replay_sync_interrupts(env);
+    }
+
     if (env->halted) {
         if (!cpu_has_work(env)) {
             return EXCP_HALTED;
@@ -508,6 +794,9 @@ int cpu_exec(CPUArchState *env) {
     }
 #endif
 
+    cpu_set_helper_env(env);
+    cpu_exec_start(env);
+
     env->exception_index = -1;
 
     DPRINTF("cpu_loop enter mflags=%#lx hf1=%#x hf2=%#x\n", (uint64_t) env->mflags, env->hflags, env->hflags2);
@@ -529,6 +818,7 @@ int cpu_exec(CPUArchState *env) {
             if (g_sqi.exec.finalize_tb_exec()) {
                 g_sqi.exec.cleanup_tb_exec();
                 if (env->exception_index == EXCP_SE) {
+                    cpu_exec_end(env);
                     cpu_single_env = NULL;
                     env->current_tb = NULL;
                     return EXCP_SE;
@@ -537,8 +827,14 @@ int cpu_exec(CPUArchState *env) {
             }
 #endif
 
+            /* e.g. a flush deferred until the other vCPUs are out of cpu_exec */
+            process_queued_cpu_work(env);
+
             ret = process_exceptions(env);
             if (ret) {
+                if (unlikely(replay_enabled())) {
+                    replay_sync_interrupts(env);
+                }
                 if (ret == EXCP_HLT && env->interrupt_request) {
                     env->exception_index = -1;
                     env->halted = 0;
@@ -554,6 +850,7 @@ int cpu_exec(CPUArchState *env) {
 #ifdef CONFIG_SYMBEX
             g_sqi.exec.cleanup_tb_exec();
             if (!g_sqi.exec.is_runnable()) {
+                cpu_exec_end(cpu_single_env);
                 cpu_single_env = NULL;
                 env->current_tb = NULL;
                 return EXCP_SE;
@@ -563,6 +860,15 @@ int cpu_exec(CPUArchState *env) {
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+
+            /* The exception may have been raised while translating code */
+            tb_translate_unlock_all();
+            tb_tier_end_trace();
+
+#ifndef CONFIG_SYMBEX
+            /* or while executing an instruction with the other vCPUs stopped */
+            cpu_exec_step_end(env);
+#endif
         }
     } /* for(;;) */
     DPRINTF("cpu_loop exit ret=%#x eip=%#lx\n", ret, (uint64_t) env->eip);
@@ -610,6 +916,11 @@ int cpu_exec(CPUArchState *env) {
 
     env->current_tb = NULL;
 
+    atomic_add(&g_cpu_stats.ras_hits, env->ras_hits);
+    env->ras_hits = 0;
+
+    cpu_exec_end(env);
+
     /* fail safe : never use cpu_single_env outside cpu_exec() */
     cpu_single_env = NULL;
     return ret;
@@ -23,6 +23,8 @@
  * THE SOFTWARE.
  */
 
+#include <glib.h>
+#include <limits.h>
 #include <stdbool.h>
 
 /* Needed early for CONFIG_BSD etc. */
@@ -34,7 +36,10 @@
 
 #ifdef CONFIG_LINUX
 
+#include <linux/futex.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #ifndef PR_MCE_KILL
 #define PR_MCE_KILL 33
@@ -167,29 +172,311 @@ void cpu_synchronize_all_post_init(void) {
 void qemu_init_cpu_loop(void) {
 }
 
-void run_on_cpu(CPUArchState *env, void (*func)(void *data), void *data) {
-    assert(false && "Not imlemented");
+/***********************************************************/
+/* vCPU threads */
+
+/*
+ * Each vCPU may run cpu_exec on its own host thread. cpu_exec brackets the
+ * execution of guest code with cpu_exec_start and cpu_exec_end.
+ *
+ * Work that must not run concurrently with guest code, like flushing the
+ * translation cache, is done in an exclusive section: start_exclusive kicks
+ * the running vCPUs out of cpu_exec and waits until they are gone, while
+ * cpu_exec_start holds back the vCPUs until the section ends. The vCPUs may
+ * need the translation lock to leave cpu_exec, so it must not be held by
+ * the caller of start_exclusive.
+ *
+ * Work queued on a vCPU runs on its thread between two TBs, see
+ * process_queued_cpu_work.
+ */
+
+struct qemu_work_item {
+    struct qemu_work_item *next;
+    run_on_cpu_func func;
+    void *data;
+    bool exclusive; /* run in an exclusive section */
+    bool free;      /* nobody waits for the item, free it once done */
+    bool done;
+};
+
+static GMutex s_cpu_lock;
+static GCond s_exclusive_cond; /* the last running vCPU left cpu_exec */
+static GCond s_resume_cond;    /* the exclusive section ended */
+static GCond s_work_cond;      /* work was done or queued */
+
+/* Nonzero during an exclusive section, 1 + the number of vCPUs still running */
+static int s_pending_cpus;
+
+void cpu_exec_start(CPUArchState *env) {
+    g_mutex_lock(&s_cpu_lock);
+    while (s_pending_cpus) {
+        g_cond_wait(&s_resume_cond, &s_cpu_lock);
+    }
+    env->running = 1;
+    g_mutex_unlock(&s_cpu_lock);
+}
+
+void cpu_exec_end(CPUArchState *env) {
+    g_mutex_lock(&s_cpu_lock);
+    if (env->running) {
+        env->running = 0;
+        /* the vCPU was counted by start_exclusive */
+        if (s_pending_cpus > 1 && --s_pending_cpus == 1) {
+            g_cond_signal(&s_exclusive_cond);
+        }
+    }
+    g_mutex_unlock(&s_cpu_lock);
+}
+
+void start_exclusive(void) {
+    CPUArchState *other;
+
+    g_mutex_lock(&s_cpu_lock);
+    while (s_pending_cpus) {
+        g_cond_wait(&s_resume_cond, &s_cpu_lock);
+    }
+
+    s_pending_cpus = 1;
+    for (other = first_cpu; other != NULL; other = other->next_cpu) {
+        if (other->running) {
+            ++s_pending_cpus;
+            cpu_exit(other);
+        }
+    }
+
+    while (s_pending_cpus > 1) {
+        g_cond_wait(&s_exclusive_cond, &s_cpu_lock);
+    }
+    g_mutex_unlock(&s_cpu_lock);
+}
+
+bool cpu_work_pending(CPUArchState *env) {
+    return g_atomic_pointer_get(&env->queued_work_first) != NULL || g_atomic_int_get(&s_pending_cpus) != 0;
+}
+
+void end_exclusive(void) {
+    g_mutex_lock(&s_cpu_lock);
+    s_pending_cpus = 0;
+    g_cond_broadcast(&s_resume_cond);
+    g_mutex_unlock(&s_cpu_lock);
+}
+
+/* Must be called with s_cpu_lock held */
+static void queue_work_on_cpu(CPUArchState *env, struct qemu_work_item *wi) {
+    wi->next = NULL;
+    wi->done = false;
+
+    if (env->queued_work_last) {
+        env->queued_work_last->next = wi;
+    } else {
+        g_atomic_pointer_set(&env->queued_work_first, wi);
+    }
+    env->queued_work_last = wi;
+
+    /* a vCPU waiting in run_on_cpu must process its own queue */
+    g_cond_broadcast(&s_work_cond);
+
+    if (env != cpu_single_env) {
+        cpu_exit(env);
+    }
+}
+
+/*
+ * Runs func on the thread of the vCPU and waits for it. A vCPU that is not
+ * in cpu_exec cannot enter it while func runs, which then happens on the
+ * calling thread. In that case, func must not wait for other vCPUs.
+ */
+void run_on_cpu(CPUArchState *env, run_on_cpu_func func, void *data) {
+    CPUArchState *self = cpu_single_env;
+    struct qemu_work_item wi;
+
+    if (env == self) {
+        func(data);
+        return;
+    }
+
+    g_mutex_lock(&s_cpu_lock);
+    if (!env->running) {
+        func(data);
+        g_mutex_unlock(&s_cpu_lock);
+        return;
+    }
+    g_mutex_unlock(&s_cpu_lock);
+
+    /* exclusive sections must not wait for this vCPU in the meantime */
+    if (self) {
+        cpu_exec_end(self);
+    }
+
+    wi.func = func;
+    wi.data = data;
+    wi.exclusive = false;
+    wi.free = false;
+
+    g_mutex_lock(&s_cpu_lock);
+    queue_work_on_cpu(env, &wi);
+    while (!wi.done) {
+        if (self && self->queued_work_first) {
+            /* the other vCPU may be waiting for us as well */
+            g_mutex_unlock(&s_cpu_lock);
+            process_queued_cpu_work(self);
+            g_mutex_lock(&s_cpu_lock);
+            continue;
+        }
+        g_cond_wait(&s_work_cond, &s_cpu_lock);
+    }
+    g_mutex_unlock(&s_cpu_lock);
+
+    if (self) {
+        cpu_exec_start(self);
+    }
+}
+
+/* Runs func on the thread of the vCPU in an exclusive section, without waiting for it */
+void async_safe_run_on_cpu(CPUArchState *env, run_on_cpu_func func, void *data) {
+    struct qemu_work_item *wi = g_new0(struct qemu_work_item, 1);
+
+    wi->func = func;
+    wi->data = data;
+    wi->exclusive = true;
+    wi->free = true;
+
+    g_mutex_lock(&s_cpu_lock);
+    queue_work_on_cpu(env, wi);
+    g_mutex_unlock(&s_cpu_lock);
+}
+
+/* Called by the vCPU thread, outside of generated code and without the translation lock */
+void process_queued_cpu_work(CPUArchState *env) {
+    struct qemu_work_item *wi;
+
+    if (!g_atomic_pointer_get(&env->queued_work_first)) {
+        return;
+    }
+
+    g_mutex_lock(&s_cpu_lock);
+    while ((wi = env->queued_work_first) != NULL) {
+        env->queued_work_first = wi->next;
+        if (!wi->next) {
+            env->queued_work_last = NULL;
+        }
+        g_mutex_unlock(&s_cpu_lock);
+
+        if (wi->exclusive) {
+            int running = env->running;
+
+            if (running) {
+                cpu_exec_end(env);
+            }
+            start_exclusive();
+            wi->func(wi->data);
+            end_exclusive();
+            if (running) {
+                cpu_exec_start(env);
+            }
+        } else {
+            wi->func(wi->data);
+        }
+
+        g_mutex_lock(&s_cpu_lock);
+        if (wi->free) {
+            g_free(wi);
+        } else {
+            wi->done = true;
+        }
+    }
+    g_cond_broadcast(&s_work_cond);
+    g_mutex_unlock(&s_cpu_lock);
+}
+
+/***********************************************************/
+/* halted vCPUs */
+
+/*
+ * A halted vCPU thread sleeps on env->wait_kicks, which cpu_exit and
+ * cpu_interrupt bump. Both may be called from signal handlers, so the
+ * wakeup is a futex, with a short sleep as a fallback on other hosts.
+ */
+#define CPU_WAIT_POLL_NS 1000000
+
+void cpu_wait_kick(CPUArchState *env) {
+    g_atomic_int_inc(&env->wait_kicks);
+    if (g_atomic_int_get(&env->wait_sleeping)) {
+#ifdef CONFIG_LINUX
+        syscall(SYS_futex, &env->wait_kicks, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+    }
+}
+
+static void cpu_wait_kicks(CPUArchState *env, int32_t kicks, int64_t timeout) {
+#ifdef CONFIG_LINUX
+    struct timespec ts = {.tv_sec = timeout / 1000000000LL, .tv_nsec = timeout % 1000000000LL};
+
+    /* returns right away if a kick came after kicks was read */
+    syscall(SYS_futex, &env->wait_kicks, FUTEX_WAIT_PRIVATE, kicks, &ts, NULL, 0);
+#else
+    if (g_atomic_int_get(&env->wait_kicks) == kicks) {
+        g_usleep(MIN(timeout, CPU_WAIT_POLL_NS) / 1000);
+    }
+#endif
+}
+
+static bool cpu_wait_has_work(CPUArchState *env) {
+    return cpu_has_work(env) || g_atomic_pointer_get(&env->queued_work_first);
+}
+
+bool cpu_wait_for_work(CPUArchState *env, int64_t deadline) {
+    int32_t kicks = g_atomic_int_get(&env->wait_kicks);
+    bool ret = false;
+
+    g_atomic_int_set(&env->wait_sleeping, 1);
+
+    for (;;) {
+        int64_t timeout;
+
+        /* checked after publishing wait_sleeping, so that no kick is missed */
+        if (cpu_wait_has_work(env)) {
+            ret = true;
+            break;
+        }
+
+        timeout = libcpu_timers_deadline_ns();
+        if (deadline >= 0) {
+            timeout = MIN(timeout, deadline - get_clock());
+        }
+
+        if (timeout <= 0 || g_atomic_int_get(&env->wait_kicks) != kicks) {
+            break;
+        }
+
+        cpu_wait_kicks(env, kicks, timeout);
+    }
+
+    g_atomic_int_set(&env->wait_sleeping, 0);
+    return ret;
 }
 
 int qemu_cpu_is_self(void *_env) {
-    assert(false && "Not imlemented");
-    return 0;
+    return _env == cpu_single_env;
 }
 
+static GMutex s_iothread_lock;
+
 void qemu_mutex_lock_iothread(void) {
-    assert(false && "Not imlemented");
+    g_mutex_lock(&s_iothread_lock);
 }
 
 void qemu_mutex_unlock_iothread(void) {
-    assert(false && "Not imlemented");
+    g_mutex_unlock(&s_iothread_lock);
 }
 
+/* Must be called from outside of the vCPU threads */
 void pause_all_vcpus(void) {
-    assert(false && "Not imlemented");
+    start_exclusive();
 }
 
 void resume_all_vcpus(void) {
-    assert(false && "Not imlemented");
+    end_exclusive();
 }
 
 static void qemu_tcg_init_vcpu(void *_env) {
@@ -33,6 +33,10 @@ struct cpu_stats_t {
     uint64_t tb_misses;
     uint64_t tb_regens;
     uint64_t tb_unlinks;
+    uint64_t tb_ptr_hits;   /* indirect branches that found their TB from generated code */
+    uint64_t tb_ptr_misses; /* indirect branches that went back to the execution loop */
+    uint64_t ras_hits;      /* returns that jumped to the predicted TB, updated as vCPUs leave cpu_exec */
+    uint64_t ras_misses;    /* mispredicted returns and returns without a cached TB */
 };
 
 extern struct cpu_stats_t g_cpu_stats;
@@ -80,6 +84,7 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb);
 void LIBCPU_NORETURN cpu_resume_from_signal(CPUArchState *env1, void *puc);
 void LIBCPU_NORETURN cpu_io_recompile(CPUArchState *env, void *retaddr);
 TranslationBlock *tb_gen_code(CPUArchState *env, target_ulong pc, target_ulong cs_base, int flags, int cflags);
+void *helper_lookup_tb_ptr(CPUArchState *env1);
 void cpu_exec_init(CPUArchState *env);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
 void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end, int is_cpu_write_access);
@@ -89,9 +94,6 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr, target_phys_addr_t padd
 
 #define CODE_GEN_ALIGN 16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS 15
-#define CODE_GEN_PHYS_HASH_SIZE (1 << CODE_GEN_PHYS_HASH_BITS)
-
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
    according to the host CPU */
@@ -115,17 +117,24 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc) {
     return (((tmp >> (TARGET_PAGE_BITS - TB_JMP_PAGE_BITS)) & TB_JMP_PAGE_MASK) | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc) {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+static inline unsigned int tb_ras_slot_hash(target_ulong pc) {
+    return (pc ^ (pc >> TB_JMP_CACHE_BITS)) & (TB_RAS_SLOTS - 1);
 }
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+/* Forgets all predicted return targets, whenever jump cache entries are dropped.
+   Generation 0 is never valid. */
+static inline void tb_ras_invalidate(CPUArchState *env) {
+    if (unlikely(++env->ras_gen == 0)) {
+        memset(env->ras_slots, 0, sizeof(env->ras_slots));
+        env->ras_gen = 1;
+    }
+}
 
 #include "qemu-lock.h"
 
 extern spinlock_t tb_lock;
 
-extern int tb_invalidated_flag;
+extern LIBCPU_VCPU_LOCAL int tb_invalidated_flag;
 
 #include <cpu/exec.h>
 
@@ -22,6 +22,9 @@
 #include <cpu/memory.h>
 #include <tcg/tcg.h>
 #include <tcg/utils/osdep.h>
+#include "exec-tb.h"
+#include "exec-tbcache.h"
+#include "exec-tbspec.h"
 #include "exec.h"
 #include "qemu-common.h"
 
@@ -30,6 +33,13 @@ static void breakpoint_invalidate(CPUArchState *env, target_ulong pc) {
     target_phys_addr_t addr;
     ram_addr_t ram_addr;
 
+    /* Restored and speculative TBs are only linked to their pages once used,
+       the invalidation below would miss them */
+    tb_translate_lock();
+    tb_cache_discard();
+    tb_spec_discard();
+    tb_translate_unlock();
+
     addr = cpu_get_phys_page_debug(env, pc);
     const MemoryDesc *sreg = mem_desc_find(addr);
     if (!sreg) {
@@ -39,8 +49,108 @@ static void breakpoint_invalidate(CPUArchState *env, target_ulong pc) {
     ram_addr = (sreg->ram_addr & TARGET_PAGE_MASK) + mem_desc_get_offset(sreg, addr);
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
 }
+
+static void breakpoint_index_add(CPUArchState *env, const CPUBreakpoint *bp) {
+    gpointer key = (gpointer)(uintptr_t) bp->pc;
+    CPUBreakpointSet *set;
+
+    if (!env->breakpoint_index) {
+        env->breakpoint_index = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    }
+
+    set = g_hash_table_lookup(env->breakpoint_index, key);
+    if (!set) {
+        set = g_new0(CPUBreakpointSet, 1);
+        g_hash_table_insert(env->breakpoint_index, key, set);
+    }
+
+    if (bp->flags & BP_CPU) {
+        ++set->cpu;
+    } else {
+        ++set->other;
+    }
+}
+
+static void breakpoint_index_remove(CPUArchState *env, const CPUBreakpoint *bp) {
+    gpointer key = (gpointer)(uintptr_t) bp->pc;
+    CPUBreakpointSet *set = g_hash_table_lookup(env->breakpoint_index, key);
+
+    g_assert(set);
+    if (bp->flags & BP_CPU) {
+        --set->cpu;
+    } else {
+        --set->other;
+    }
+
+    if (!set->cpu && !set->other) {
+        g_hash_table_remove(env->breakpoint_index, key);
+    }
+}
 #endif /* TARGET_HAS_ICE */
 
+/* Watchpoints never cross a page, they are indexed by the page they are on */
+static GPtrArray *watchpoint_index_lookup(CPUArchState *env, target_ulong page) {
+    if (!env->watchpoint_index) {
+        return NULL;
+    }
+
+    return g_hash_table_lookup(env->watchpoint_index, (gpointer)(uintptr_t) page);
+}
+
+static void watchpoint_index_add(CPUArchState *env, CPUWatchpoint *wp) {
+    target_ulong page = wp->vaddr & TARGET_PAGE_MASK;
+    GPtrArray *wps;
+
+    if (!env->watchpoint_index) {
+        env->watchpoint_index = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify) g_ptr_array_unref);
+    }
+
+    wps = watchpoint_index_lookup(env, page);
+    if (!wps) {
+        wps = g_ptr_array_new();
+        g_hash_table_insert(env->watchpoint_index, (gpointer)(uintptr_t) page, wps);
+    }
+
+    /* same order as the list */
+    if (wp->flags & BP_GDB) {
+        g_ptr_array_insert(wps, 0, wp);
+    } else {
+        g_ptr_array_add(wps, wp);
+    }
+}
+
+static void watchpoint_index_remove(CPUArchState *env, CPUWatchpoint *wp) {
+    target_ulong page = wp->vaddr & TARGET_PAGE_MASK;
+    GPtrArray *wps = watchpoint_index_lookup(env, page);
+
+    g_assert(wps);
+    g_ptr_array_remove(wps, wp);
+    if (!wps->len) {
+        g_hash_table_remove(env->watchpoint_index, (gpointer)(uintptr_t) page);
+    }
+}
+
+/* Whether accesses to the page mapped with the given protection must go
+   through the watchpoint trap routines */
+int cpu_watchpoint_traps(CPUArchState *env, target_ulong vaddr, int prot) {
+    GPtrArray *wps = watchpoint_index_lookup(env, vaddr & TARGET_PAGE_MASK);
+
+    if (!wps) {
+        return 0;
+    }
+
+    for (unsigned i = 0; i < wps->len; ++i) {
+        CPUWatchpoint *wp = g_ptr_array_index(wps, i);
+
+        /* Avoid trapping reads of pages with a write breakpoint. */
+        if ((prot & PAGE_WRITE) || (wp->flags & BP_MEM_READ)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 /* Add a watchpoint.  */
 int cpu_watchpoint_insert(CPUArchState *env, target_ulong addr, target_ulong len, int flags,
                           CPUWatchpoint **watchpoint) {
@@ -65,6 +175,7 @@ int cpu_watchpoint_insert(CPUArchState *env, target_ulong addr, target_ulong len
     else
         QTAILQ_INSERT_TAIL(&env->watchpoints, wp, entry);
 
+    watchpoint_index_add(env, wp);
     tlb_flush_page(env, addr);
 
     if (watchpoint)
@@ -75,9 +186,10 @@ int cpu_watchpoint_insert(CPUArchState *env, target_ulong addr, target_ulong len
 /* Remove a specific watchpoint.  */
 int cpu_watchpoint_remove(CPUArchState *env, target_ulong addr, target_ulong len, int flags) {
     target_ulong len_mask = ~(len - 1);
-    CPUWatchpoint *wp;
+    GPtrArray *wps = watchpoint_index_lookup(env, addr & TARGET_PAGE_MASK);
 
-    QTAILQ_FOREACH (wp, &env->watchpoints, entry) {
+    for (unsigned i = 0; wps && i < wps->len; ++i) {
+        CPUWatchpoint *wp = g_ptr_array_index(wps, i);
         if (addr == wp->vaddr && len_mask == wp->len_mask && flags == (wp->flags & ~BP_WATCHPOINT_HIT)) {
             cpu_watchpoint_remove_by_ref(env, wp);
             return 0;
@@ -90,6 +202,7 @@ int cpu_watchpoint_remove(CPUArchState *env, target_ulong addr, target_ulong len
 void cpu_watchpoint_remove_by_ref(CPUArchState *env, CPUWatchpoint *watchpoint) {
     QTAILQ_REMOVE(&env->watchpoints, watchpoint, entry);
 
+    watchpoint_index_remove(env, watchpoint);
     tlb_flush_page(env, watchpoint->vaddr);
 
     g_free(watchpoint);
@@ -121,6 +234,7 @@ int cpu_breakpoint_insert(CPUArchState *env, target_ulong pc, int flags, CPUBrea
     else
         QTAILQ_INSERT_TAIL(&env->breakpoints, bp, entry);
 
+    breakpoint_index_add(env, bp);
     breakpoint_invalidate(env, pc);
 
     if (breakpoint)
@@ -136,6 +250,10 @@ int cpu_breakpoint_remove(CPUArchState *env, target_ulong pc, int flags) {
 #if defined(TARGET_HAS_ICE)
     CPUBreakpoint *bp;
 
+    if (!cpu_breakpoint_lookup(env, pc)) {
+        return -ENOENT;
+    }
+
     QTAILQ_FOREACH (bp, &env->breakpoints, entry) {
         if (bp->pc == pc && bp->flags == flags) {
             cpu_breakpoint_remove_by_ref(env, bp);
@@ -148,11 +266,33 @@ int cpu_breakpoint_remove(CPUArchState *env, target_ulong pc, int flags) {
 #endif
 }
 
+/* Breakpoints set at pc, NULL if there are none */
+const CPUBreakpointSet *cpu_breakpoint_lookup(CPUArchState *env, target_ulong pc) {
+#if defined(TARGET_HAS_ICE)
+    if (!env->breakpoint_index) {
+        return NULL;
+    }
+
+    return g_hash_table_lookup(env->breakpoint_index, (gpointer)(uintptr_t) pc);
+#else
+    return NULL;
+#endif
+}
+
+/* Whether the translator must stop at pc, BP_CPU breakpoints being
+   suppressed when the resume flag is set */
+int cpu_breakpoint_check(CPUArchState *env, target_ulong pc, int resume) {
+    const CPUBreakpointSet *set = cpu_breakpoint_lookup(env, pc);
+
+    return set && (set->other || (set->cpu && !resume));
+}
+
 /* Remove a specific breakpoint by reference.  */
 void cpu_breakpoint_remove_by_ref(CPUArchState *env, CPUBreakpoint *breakpoint) {
 #if defined(TARGET_HAS_ICE)
     QTAILQ_REMOVE(&env->breakpoints, breakpoint, entry);
 
+    breakpoint_index_remove(env, breakpoint);
     breakpoint_invalidate(env, breakpoint->pc);
 
     g_free(breakpoint);
@@ -175,13 +315,10 @@ void cpu_breakpoint_remove_all(CPUArchState *env, int mask) {
    CPU loop after each instruction */
 void cpu_single_step(CPUArchState *env, int enabled) {
 #if defined(TARGET_HAS_ICE)
-    if (env->singlestep_enabled != enabled) {
-        env->singlestep_enabled = enabled;
-
-        /* must flush all the translated code to avoid inconsistencies */
-        /* XXX: only flush what is necessary */
-        tb_flush(env);
-    }
+    /* Single stepping is part of the TB flags, see cpu_get_tb_cpu_state.
+       TBs translated for stepping never chain, and fetch_and_run_tb does
+       not chain into them, so the normal ones can stay. */
+    env->singlestep_enabled = enabled;
 #endif
 }
 
@@ -190,8 +327,8 @@ static void check_watchpoint(int offset, int len_mask, int flags) {
     CPUArchState *env = cpu_single_env;
     target_ulong pc, cs_base;
     TranslationBlock *tb;
-    target_ulong vaddr;
-    CPUWatchpoint *wp;
+    target_ulong vaddr, page;
+    GPtrArray *wps;
     int cpu_flags;
 
     if (env->watchpoint_hit) {
@@ -208,7 +345,19 @@ static void check_watchpoint(int offset, int len_mask, int flags) {
     vaddr = (env->mem_io_vaddr & TARGET_PAGE_MASK) + offset;
 #endif
 
-    QTAILQ_FOREACH (wp, &env->watchpoints, entry) {
+    /* Only the watchpoints of one page can be flagged as hit at a time */
+    page = vaddr & TARGET_PAGE_MASK;
+    if (env->watchpoint_flagged_page != page) {
+        wps = watchpoint_index_lookup(env, env->watchpoint_flagged_page);
+        for (unsigned i = 0; wps && i < wps->len; ++i) {
+            ((CPUWatchpoint *) g_ptr_array_index(wps, i))->flags &= ~BP_WATCHPOINT_HIT;
+        }
+        env->watchpoint_flagged_page = page;
+    }
+
+    wps = watchpoint_index_lookup(env, page);
+    for (unsigned i = 0; wps && i < wps->len; ++i) {
+        CPUWatchpoint *wp = g_ptr_array_index(wps, i);
         if ((vaddr == (wp->vaddr & len_mask) || (vaddr & wp->len_mask) == wp->vaddr) && (wp->flags & flags)) {
             wp->flags |= BP_WATCHPOINT_HIT;
             if (!env->watchpoint_hit) {
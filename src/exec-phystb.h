@@ -20,18 +20,25 @@
 
 #define __EXEC_PHYS_TB__H
 
+#include <glib.h>
 #include <inttypes.h>
 #include "exec.h"
 
 struct TranslationBlock;
+struct tb_smc_page;
+
+/* Self modifying code is looked up in chunks of the page */
+#define TB_PAGE_CHUNK_BITS 6
+#define TB_PAGE_CHUNKS (TARGET_PAGE_SIZE >> TB_PAGE_CHUNK_BITS)
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
     TranslationBlock *first_tb;
-    /* in order to optimize self modifying code, we count the number
-       of lookups we do to a given page to use a bitmap */
-    unsigned int code_write_count;
-    uint8_t *code_bitmap;
+    /* TBs intersecting each chunk of the page, as tagged pointers like
+       first_tb. NULL when the page has no code. */
+    GPtrArray **code_chunks;
+    /* self modifying code state, NULL until the code gets written */
+    struct tb_smc_page *smc;
 } PageDesc;
 
 extern void *l1_map[V_L1_SIZE];
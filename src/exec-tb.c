@@ -37,8 +37,13 @@
 #endif
 
 #include "exec-tb.h"
-
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+#include "exec-tbcache.h"
+#include "exec-tbhash.h"
+#include "exec-tbshare.h"
+#include "exec-tbsmc.h"
+#include "exec-tbspec.h"
+#include "exec-tbtier.h"
+#include "exec-tlb.h"
 
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
@@ -46,10 +51,13 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 int g_tb_flush_count;
 int g_tb_phys_invalidate_count;
 int g_tb_alloc_count;
+int g_tb_evict_count;
+int g_tb_evicted_tb_count;
 
 #define code_gen_section __attribute__((aligned(32)))
 
 static void page_flush_tb(void);
+static void tb_page2_discard(void);
 
 #define mmap_lock() \
     do {            \
@@ -62,6 +70,184 @@ bool tcg_enabled(void) {
     return true;
 }
 
+/*
+ * Code generation, code buffer management (allocation, eviction, flush) and
+ * the page lists may be used by the vCPU threads and the translation workers.
+ * The lock is recursive because tb_gen_code may flush the cache.
+ *
+ * Flushes and evictions reuse code that other vCPUs may be executing. With
+ * more than one vCPU, they are done in an exclusive section, see tb_flush.
+ */
+static GRecMutex s_translate_lock;
+static __thread int s_translate_lock_depth;
+
+void tb_translate_lock(void) {
+    g_rec_mutex_lock(&s_translate_lock);
+    ++s_translate_lock_depth;
+}
+
+void tb_translate_unlock(void) {
+    --s_translate_lock_depth;
+    g_rec_mutex_unlock(&s_translate_lock);
+}
+
+/* The code generator may longjmp out on a code fetch fault, drop what the thread still holds */
+void tb_translate_unlock_all(void) {
+    while (s_translate_lock_depth > 0) {
+        tb_translate_unlock();
+    }
+}
+
+/*
+ * Generational eviction.
+ *
+ * The code buffer is split into TB_GENERATIONS slices that are filled in
+ * FIFO order. When the current slice is full, only the TBs living in the
+ * oldest slice are invalidated and its space is reused for new code. The
+ * rest of the translated code, jump caches and page lists stay intact.
+ */
+#define TB_GENERATIONS 8
+
+/* tcg_gen_code may write a bit past code_gen_highwater before noticing
+   the overflow, keep that much space between slices */
+#define TB_GENERATION_SLACK 4096
+
+static TBEvictMode s_evict_mode = TB_EVICT_FLUSH;
+
+static struct {
+    uint8_t *start;
+    uint8_t *end;
+    size_t size;
+    unsigned current;
+} s_generations;
+
+static void tb_generations_reset(void) {
+    uint8_t *start = tcg_ctx->code_gen_ptr;
+    uint8_t *end = tcg_ctx->code_gen_highwater;
+
+    s_generations.start = start;
+    s_generations.end = end;
+    s_generations.size = ((end - start) / TB_GENERATIONS) & TARGET_PAGE_MASK;
+    s_generations.current = 0;
+
+    atomic_set(&tcg_ctx->code_gen_highwater, start + s_generations.size - TB_GENERATION_SLACK);
+}
+
+void tb_set_evict_mode(TBEvictMode mode) {
+#ifdef CONFIG_SYMBEX
+    /* The symbolic execution engine keeps its own per-TB state and only knows how to drop all of it at once */
+    mode = TB_EVICT_FLUSH;
+#endif
+
+    s_evict_mode = mode;
+
+    /* Start from an empty cache so that the slices match the buffer layout */
+    tb_flush(first_cpu);
+}
+
+TBEvictMode tb_get_evict_mode(void) {
+    return s_evict_mode;
+}
+
+struct tb_evict_range {
+    uintptr_t start;
+    uintptr_t end;
+    GPtrArray *tbs;
+};
+
+static gboolean tb_evict_collect(gpointer key, gpointer value, gpointer data) {
+    struct tb_evict_range *range = data;
+    TranslationBlock *tb = value;
+    uintptr_t ptr = (uintptr_t) tb->tc.ptr;
+
+    if (ptr >= range->start && ptr < range->end) {
+        g_ptr_array_add(range->tbs, tb);
+    }
+
+    return FALSE;
+}
+
+/* Reclaim the oldest slice of the code buffer. Returns false if the whole cache must be flushed instead. */
+static bool tb_evict_oldest_generation(void) {
+    struct tb_evict_range range;
+    unsigned next;
+    uint8_t *start, *end;
+
+    if (s_evict_mode != TB_EVICT_GENERATIONAL || !s_generations.size) {
+        return false;
+    }
+
+    next = (s_generations.current + 1) % TB_GENERATIONS;
+    start = s_generations.start + next * s_generations.size;
+    end = next == TB_GENERATIONS - 1 ? s_generations.end : start + s_generations.size;
+
+    /* TB descriptors are allocated in the code buffer right before their code */
+    range.start = (uintptr_t) start;
+    range.end = (uintptr_t) end;
+    range.tbs = g_ptr_array_new();
+    tcg_tb_foreach(tb_evict_collect, &range);
+
+    for (guint i = 0; i < range.tbs->len; ++i) {
+        TranslationBlock *tb = g_ptr_array_index(range.tbs, i);
+
+        /* TBs invalidated by SMC are already unlinked but still known to tcg_tb_lookup */
+        if (!(atomic_read(&tb->cflags) & CF_INVALID)) {
+            tb_phys_invalidate(tb, -1);
+        }
+        tcg_tb_remove(tb);
+        tb_tier_forget(tb);
+    }
+
+    g_tb_evicted_tb_count += range.tbs->len;
+    g_ptr_array_free(range.tbs, TRUE);
+
+    /* Speculative TBs are not known to tcg_tb_foreach yet and may live in the reclaimed slice */
+    tb_spec_discard();
+
+    s_generations.current = next;
+    atomic_set(&tcg_ctx->code_gen_ptr, start);
+    atomic_set(&tcg_ctx->code_gen_highwater, end - TB_GENERATION_SLACK);
+
+    tb_invalidated_flag = 1;
+    ++g_tb_evict_count;
+
+    return true;
+}
+
+static void do_tb_flush(void);
+
+/* Changes every time code is evicted or flushed */
+static int tb_room_generation(void) {
+    return g_tb_flush_count + g_tb_evict_count;
+}
+
+static void tb_make_room_locked(void) {
+    if (!tb_evict_oldest_generation()) {
+        do_tb_flush();
+    }
+}
+
+static void tb_make_room_safe(void *data) {
+    tb_translate_lock();
+    /* another vCPU may have made room in the meantime */
+    if (tb_room_generation() == (int) (uintptr_t) data) {
+        tb_make_room_locked();
+    }
+    tb_translate_unlock();
+}
+
+/* Make room in the code buffer, either by evicting old code or by flushing everything */
+static void tb_make_room(CPUArchState *env) {
+    if (cpu_single_env && first_cpu->next_cpu) {
+        /* retry the translation once the other vCPUs are out of cpu_exec */
+        async_safe_run_on_cpu(env, tb_make_room_safe, (void *) (uintptr_t) tb_room_generation());
+        tb_translate_unlock_all();
+        cpu_loop_exit(env);
+    }
+
+    tb_make_room_locked();
+}
+
 /* Allocate a new translation block. Flush the translation buffer if
    too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc) {
@@ -86,73 +272,96 @@ static TranslationBlock *tb_alloc(target_ulong pc) {
     return tb;
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env) {
+/* flush all the translation blocks, no vCPU may be executing generated code */
+static void do_tb_flush(void) {
+    CPUArchState *env;
+
+    tb_translate_lock();
+
 #ifdef CONFIG_SYMBEX
     g_sqi.tb.flush_tb_cache();
 #endif
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
+        tlb_jmp_cache_clear(env);
+        tb_ras_invalidate(env);
     }
 
-    memset(tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+    tb_hash_reset();
+    tb_cache_discard();
+    tb_spec_discard();
+    tb_tier_discard();
+    tb_page2_discard();
+    tb_smc_discard();
     page_flush_tb();
 
     tcg_region_reset_all();
 
+    if (s_evict_mode == TB_EVICT_GENERATIONAL) {
+        tb_generations_reset();
+    }
+
     g_tb_flush_count++;
     g_tb_alloc_count = 0;
+
+    tb_translate_unlock();
+}
+
+static void tb_flush_safe(void *data) {
+    /* the cache may have been flushed since the request */
+    if (g_tb_flush_count == (int) (uintptr_t) data) {
+        do_tb_flush();
+    }
+}
+
+void tb_flush(CPUArchState *env) {
+    CPUArchState *self = cpu_single_env;
+
+    if (!self) {
+        start_exclusive();
+        do_tb_flush();
+        end_exclusive();
+    } else if (!first_cpu->next_cpu) {
+        /* the only vCPU, nothing else executes generated code */
+        do_tb_flush();
+    } else {
+        /* done when the vCPU leaves the execution loop */
+        async_safe_run_on_cpu(self, tb_flush_safe, (void *) (uintptr_t) g_tb_flush_count);
+        cpu_exit(self);
+    }
 }
 
 #ifdef DEBUG_TB_CHECK
 
+static void tb_invalidate_check_1(TranslationBlock *tb, void *opaque) {
+    target_ulong address = *(target_ulong *) opaque;
+    if (!(address + TARGET_PAGE_SIZE <= tb->pc || address >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx " PC=%08lx size=%04x\n", address, (long) tb->pc, tb->size);
+    }
+}
+
 static void tb_invalidate_check(target_ulong address) {
-    TranslationBlock *tb;
-    int i;
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc || address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx " PC=%08lx size=%04x\n", address, (long) tb->pc,
-                       tb->size);
-            }
-        }
+    tb_hash_foreach(tb_invalidate_check_1, &address);
+}
+
+static void tb_page_check_1(TranslationBlock *tb, void *opaque) {
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n", (long) tb->pc, tb->size, flags1, flags2);
     }
 }
 
 /* verify that all the pages have correct rights for code */
 static void tb_page_check(void) {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n", (long) tb->pc, tb->size, flags1, flags2);
-            }
-        }
-    }
+    tb_hash_foreach(tb_page_check_1, NULL);
 }
 
 #endif
 
-/* invalidate one TB */
-static inline void tb_remove(TranslationBlock **ptb, TranslationBlock *tb, int next_offset) {
-    TranslationBlock *tb1;
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = *(TranslationBlock **) ((char *) tb1 + next_offset);
-            break;
-        }
-        ptb = (TranslationBlock **) ((char *) tb1 + next_offset);
-    }
-}
-
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb) {
     TranslationBlock *tb1;
     unsigned int n1;
@@ -169,45 +378,143 @@ static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
     }
 }
 
-static inline void invalidate_page_bitmap(PageDesc *p) {
-    if (p->code_bitmap) {
-        g_free(p->code_bitmap);
-        p->code_bitmap = NULL;
+/* byte range [*start, *end[ covered by the TB on its n-th page, as offsets in the page */
+static inline void tb_page_range(const TranslationBlock *tb, int n, unsigned *start, unsigned *end) {
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        *start = tb->pc & ~TARGET_PAGE_MASK;
+        *end = MIN(*start + tb->size, TARGET_PAGE_SIZE);
+    } else {
+        *start = 0;
+        *end = (tb->pc + tb->size) & ~TARGET_PAGE_MASK;
     }
-    p->code_write_count = 0;
 }
 
-void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr) {
+static void tb_page_chunks_add(PageDesc *p, TranslationBlock *tb, int n) {
+    unsigned start, end;
+
+    tb_page_range(tb, n, &start, &end);
+    if (start >= end) {
+        return;
+    }
+
+    if (!p->code_chunks) {
+        p->code_chunks = g_new0(GPtrArray *, TB_PAGE_CHUNKS);
+    }
+
+    for (unsigned c = start >> TB_PAGE_CHUNK_BITS; c <= (end - 1) >> TB_PAGE_CHUNK_BITS; ++c) {
+        if (!p->code_chunks[c]) {
+            p->code_chunks[c] = g_ptr_array_sized_new(4);
+        }
+        g_ptr_array_add(p->code_chunks[c], (gpointer)((uintptr_t) tb | n));
+    }
+}
+
+static void tb_page_chunks_remove(PageDesc *p, TranslationBlock *tb, int n) {
+    unsigned start, end;
+
+    tb_page_range(tb, n, &start, &end);
+    if (!p->code_chunks || start >= end) {
+        return;
+    }
+
+    for (unsigned c = start >> TB_PAGE_CHUNK_BITS; c <= (end - 1) >> TB_PAGE_CHUNK_BITS; ++c) {
+        if (p->code_chunks[c]) {
+            g_ptr_array_remove_fast(p->code_chunks[c], (gpointer)((uintptr_t) tb | n));
+        }
+    }
+}
+
+static void tb_page_chunks_free(PageDesc *p) {
+    if (!p->code_chunks) {
+        return;
+    }
+
+    for (unsigned c = 0; c < TB_PAGE_CHUNKS; ++c) {
+        if (p->code_chunks[c]) {
+            g_ptr_array_free(p->code_chunks[c], TRUE);
+        }
+    }
+    g_free(p->code_chunks);
+    p->code_chunks = NULL;
+}
+
+/* true if a TB overlaps the given byte range of the page */
+static bool tb_page_chunks_overlap(PageDesc *p, unsigned start, unsigned end) {
+    if (!p->code_chunks) {
+        return false;
+    }
+
+    for (unsigned c = start >> TB_PAGE_CHUNK_BITS; c <= (end - 1) >> TB_PAGE_CHUNK_BITS; ++c) {
+        GPtrArray *tbs = p->code_chunks[c];
+        for (guint i = 0; tbs && i < tbs->len; ++i) {
+            uintptr_t tagged = (uintptr_t) g_ptr_array_index(tbs, i);
+            unsigned tb_start, tb_end;
+
+            tb_page_range((TranslationBlock *) (tagged & ~3), tagged & 3, &tb_start, &tb_end);
+            if (tb_start < end && tb_end > start) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* remove the TB from the virtual pc hash tables */
+static void tb_jmp_cache_remove(TranslationBlock *tb) {
     CPUArchState *env;
+    struct tb_ras_slot *slot;
+
+    /* the caches of the other vCPUs may be in use */
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        tlb_jmp_cache_remove(env, tb);
+
+        slot = &env->ras_slots[tb_ras_slot_hash(tb->pc)];
+        if (atomic_read(&slot->tc_ptr) == tb->tc.ptr) {
+            atomic_set(&slot->gen, 0);
+        }
+    }
+}
+
+/* make sure that the TB is only reached through tb_find_slow, without invalidating it */
+void tb_phys_detach(TranslationBlock *tb) {
+    tb_jmp_cache_remove(tb);
+    tb_jmp_unlink(tb);
+}
+
+void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr) {
     PageDesc *p;
-    unsigned int h;
     tb_page_addr_t phys_pc;
 
-    /* remove the TB from the hash list */
-    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb, offsetof(TranslationBlock, phys_hash_next));
+    tb_translate_lock();
+
+    /* make sure no further incoming jumps will be chained to this TB */
+    spin_lock(&tb->jmp_lock);
+    atomic_set(&tb->cflags, tb->cflags | CF_INVALID);
+    spin_unlock(&tb->jmp_lock);
+
+    /* remove the TB from the hash list, one-shot TBs were never added */
+    if (tb->page_addr[0] != -1) {
+        phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+        tb_hash_remove(tb, tb_hash_func(phys_pc, tb->pc, tb->cs_base, tb->flags));
+    }
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
         p = page_find(tb->page_addr[0] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
+        tb_page_chunks_remove(p, tb, 0);
     }
     if (tb->page_addr[1] != -1 && tb->page_addr[1] != page_addr) {
         p = page_find(tb->page_addr[1] >> TARGET_PAGE_BITS);
         tb_page_remove(&p->first_tb, tb);
-        invalidate_page_bitmap(p);
+        tb_page_chunks_remove(p, tb, 1);
     }
 
     tb_invalidated_flag = 1;
 
-    /* remove the TB from the hash list */
-    h = tb_jmp_cache_hash_func(tb->pc);
-    for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        if (env->tb_jmp_cache[h] == tb)
-            env->tb_jmp_cache[h] = NULL;
-    }
+    tb_jmp_cache_remove(tb);
 
     /* suppress this TB from the two jump lists */
     tb_remove_from_jmp_list(tb, 0);
@@ -215,8 +522,13 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr) {
 
     /* suppress any remaining jumps to this TB */
     tb_jmp_unlink(tb);
+    if (tb->page_addr[1] != -1) {
+        tb_page2_forget(tb);
+    }
 
     g_tb_phys_invalidate_count++;
+
+    tb_translate_unlock();
 }
 
 TranslationBlock *tb_gen_code(CPUArchState *env, target_ulong pc, target_ulong cs_base, int flags, int cflags) {
@@ -224,13 +536,16 @@ TranslationBlock *tb_gen_code(CPUArchState *env, target_ulong pc, target_ulong c
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
 
-    phys_pc = get_page_addr_code(env, pc);
+    tb_translate_lock();
+
+    /* identical code translated at another address is reused, see exec-tbshare.c */
+    phys_pc = tb_share_resolve(get_page_addr_code(env, pc));
 
 again:
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* eviction or flush must be done */
+        tb_make_room(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -243,22 +558,62 @@ again:
     tb->flags = flags;
     tb->cflags = cflags | CF_HAS_INTERRUPT_EXIT;
 
+    tb_spec_begin();
     if (cpu_gen_code(env, tb) < 0) {
-        tb_flush(env);
+        tb_make_room(env);
         goto again;
     }
 
+    /* One-shot TBs are executed right away by the caller, which invalidates
+       them afterwards. Only tcg_tb_lookup must find them, for precise faults. */
+    if (cflags & CF_NOCACHE) {
+        tb->page_addr[0] = tb->page_addr[1] = -1;
+        tcg_tb_insert(tb);
+        tb_translate_unlock();
+        return tb;
+    }
+
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
     phys_page2 = -1;
 
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
-        phys_page2 = get_page_addr_code(env, virt_page2);
+        phys_page2 = tb_share_resolve(get_page_addr_code(env, virt_page2));
     }
 
     tb_link_page(tb, phys_pc, phys_page2);
     tcg_tb_insert(tb);
 
+    tb_spec_submit(env, tb);
+
+    tb_translate_unlock();
+
+    return tb;
+}
+
+/* Translate a TB without linking it anywhere. Used by the translation
+   workers, the caller must hold the translation lock. Never flushes,
+   returns NULL if the code buffer is full. */
+TranslationBlock *tb_gen_code_unlinked(CPUArchState *env, target_ulong pc, target_ulong cs_base, int flags,
+                                       int cflags) {
+    TranslationBlock *tb;
+
+    tb = tb_alloc(pc);
+    if (!tb) {
+        return NULL;
+    }
+
+    tb->cflags = 0;
+    tb->pc = pc;
+    tb->cs_base = cs_base;
+    tb->flags = flags;
+    tb->cflags = cflags | CF_HAS_INTERRUPT_EXIT;
+
+    tb_spec_begin();
+    if (cpu_gen_code(env, tb) < 0) {
+        return NULL;
+    }
+
     return tb;
 }
 
@@ -273,7 +628,7 @@ static void page_flush_tb_1(int level, void **lp) {
         PageDesc *pd = *lp;
         for (i = 0; i < L2_SIZE; ++i) {
             pd[i].first_tb = NULL;
-            invalidate_page_bitmap(pd + i);
+            tb_page_chunks_free(pd + i);
         }
     } else {
         void **pp = *lp;
@@ -290,68 +645,17 @@ static void page_flush_tb(void) {
     }
 }
 
-static inline void set_bits(uint8_t *tab, int start, int len) {
-    int end, mask, end1;
-
-    end = start + len;
-    tab += start >> 3;
-    mask = 0xff << (start & 7);
-    if ((start & ~7) == (end & ~7)) {
-        if (start < end) {
-            mask &= ~(0xff << (end & 7));
-            *tab |= mask;
-        }
-    } else {
-        *tab++ |= mask;
-        start = (start + 8) & ~7;
-        end1 = end & ~7;
-        while (start < end1) {
-            *tab++ = 0xff;
-            start += 8;
-        }
-        if (start < end) {
-            mask = ~(0xff << (end & 7));
-            *tab |= mask;
-        }
-    }
-}
-
-static void build_page_bitmap(PageDesc *p) {
-    int n, tb_start, tb_end;
-    TranslationBlock *tb;
-
-    p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
-
-    tb = p->first_tb;
-    while (tb != NULL) {
-        n = (long) tb & 3;
-        tb = (TranslationBlock *) ((long) tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE)
-                tb_end = TARGET_PAGE_SIZE;
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
-        tb = tb->page_next[n];
-    }
-}
-
 /* invalidate all TBs which intersect with the target physical page
    starting in range [start;end[. NOTE: start and end must refer to
    the same physical page. 'is_cpu_write_access' should be true if called
    from a real cpu write access: the virtual CPU will exit the current
-   TB if code is modified inside this TB. */
-void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end, int is_cpu_write_access) {
-    TranslationBlock *tb, *tb_next, *saved_tb;
+   TB if code is modified inside this TB. Only the TBs overlapping the
+   chunks of the range are looked at. */
+static void tb_invalidate_phys_page_range_locked(tb_page_addr_t start, tb_page_addr_t end, int is_cpu_write_access) {
+    TranslationBlock *tb, *saved_tb;
     CPUArchState *env = cpu_single_env;
-    tb_page_addr_t tb_start, tb_end;
+    unsigned offset_start, offset_end, tb_start, tb_end;
+    unsigned c, i, invalidated = 0;
     PageDesc *p;
     int n;
 #ifdef TARGET_HAS_PRECISE_SMC
@@ -363,32 +667,36 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end, int
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tb_share_page_written(start, end, is_cpu_write_access);
+
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
         return;
-    if (!p->code_bitmap && ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD && is_cpu_write_access) {
-        /* build code bitmap */
-        build_page_bitmap(p);
+
+    offset_start = start & ~TARGET_PAGE_MASK;
+    offset_end = offset_start + (end - start);
+
+    if (is_cpu_write_access && tb_smc_defer_write(env, p, start & TARGET_PAGE_MASK)) {
+        /* the TBs are checked again before the page gets executed, let the writes through until then */
+        tlb_unprotect_code_phys(env, start, env->mem_io_vaddr);
+        return;
     }
 
     /* we remove all the TBs in the range [start, end[ */
-    /* XXX: see if in some cases it could be faster to invalidate all the code */
-    tb = p->first_tb;
-    while (tb != NULL) {
-        n = (long) tb & 3;
-        tb = (TranslationBlock *) ((long) tb & ~3);
-        tb_next = tb->page_next[n];
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-            tb_end = tb_start + tb->size;
-        } else {
-            tb_start = tb->page_addr[1];
-            tb_end = tb_start + ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
-        if (!(tb_end <= start || tb_start >= end)) {
+    for (c = offset_start >> TB_PAGE_CHUNK_BITS; p->code_chunks && c <= (offset_end - 1) >> TB_PAGE_CHUNK_BITS; ++c) {
+        i = 0;
+        /* invalidated TBs leave the chunk, the array is reloaded every time */
+        while (p->code_chunks && p->code_chunks[c] && i < p->code_chunks[c]->len) {
+            uintptr_t tagged = (uintptr_t) g_ptr_array_index(p->code_chunks[c], i);
+
+            n = tagged & 3;
+            tb = (TranslationBlock *) (tagged & ~3);
+            tb_page_range(tb, n, &tb_start, &tb_end);
+            if (tb_end <= offset_start || tb_start >= offset_end) {
+                ++i;
+                continue;
+            }
+
 #ifdef TARGET_HAS_PRECISE_SMC
             if (current_tb_not_found) {
                 current_tb_not_found = 0;
@@ -421,6 +729,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end, int
                 env->current_tb = NULL;
             }
             tb_phys_invalidate(tb, -1);
+            ++invalidated;
             if (env) {
                 env->current_tb = saved_tb;
 #if 0
@@ -430,12 +739,15 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end, int
 #endif
             }
         }
-        tb = tb_next;
+    }
+
+    if (is_cpu_write_access && invalidated) {
+        tb_smc_note_write(p, start & TARGET_PAGE_MASK, invalidated);
     }
 
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
-        invalidate_page_bitmap(p);
+        tb_page_chunks_free(p);
         if (is_cpu_write_access) {
 #ifdef CONFIG_SYMBEX_MP
             target_ulong iovaddr = g_sqi.mem.read_mem_io_vaddr(1);
@@ -459,10 +771,16 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end, int
 #endif
 }
 
+void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end, int is_cpu_write_access) {
+    tb_translate_lock();
+    tb_invalidate_phys_page_range_locked(start, end, is_cpu_write_access);
+    tb_translate_unlock();
+}
+
 /* len must be <= 8 and start must be a multiple of len */
 void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len) {
     PageDesc *p;
-    int offset, b;
+    unsigned offset;
 #if 0
     if (1) {
         libcpu_log("modifying code at 0x%x size=%d EIP=%x PC=%08x\n",
@@ -471,18 +789,23 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len) {
                   cpu_single_env->eip + (long)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    /* the chunks may be changed by another vCPU translating code */
+    tb_translate_lock();
+
     p = page_find(start >> TARGET_PAGE_BITS);
-    if (!p)
+    if (!p && !tb_share_is_shared(start)) {
+        tb_translate_unlock();
         return;
-    if (p->code_bitmap) {
-        offset = start & ~TARGET_PAGE_MASK;
-        b = p->code_bitmap[offset >> 3] >> (offset & 7);
-        if (b & ((1 << len) - 1))
-            goto do_invalidate;
-    } else {
-    do_invalidate:
-        tb_invalidate_phys_page_range(start, start + len, 1);
     }
+
+    /* a page without code must still go through the slow path to get unprotected,
+       any write to a page sharing its translations must be seen as well */
+    offset = start & ~TARGET_PAGE_MASK;
+    if (!p || !p->first_tb || tb_share_is_shared(start) || tb_page_chunks_overlap(p, offset, offset + len)) {
+        tb_invalidate_phys_page_range_locked(start, start + len, 1);
+    }
+
+    tb_translate_unlock();
 }
 
 /* add the tb in the target page and protect it if necessary */
@@ -492,10 +815,11 @@ static inline void tb_alloc_page(TranslationBlock *tb, unsigned int n, tb_page_a
 
     tb->page_addr[n] = page_addr;
     p = page_find_alloc(page_addr >> TARGET_PAGE_BITS, 1);
+    tb_smc_note_translation(p, page_addr);
     tb->page_next[n] = p->first_tb;
     page_already_protected = p->first_tb != NULL;
     p->first_tb = (TranslationBlock *) ((long) tb | n);
-    invalidate_page_bitmap(p);
+    tb_page_chunks_add(p, tb, n);
 
 #if defined(TARGET_HAS_SMC) || 1
 
@@ -512,17 +836,9 @@ static inline void tb_alloc_page(TranslationBlock *tb, unsigned int n, tb_page_a
 /* add a new TB and link it to the physical page tables. phys_page2 is
    (-1) to indicate that only one page contains the TB. */
 void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc, tb_page_addr_t phys_page2) {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -531,6 +847,9 @@ void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc, tb_page_addr_t p
     else
         tb->page_addr[1] = -1;
 
+    /* add in the physical hash table, the TB is visible to lock-free lookups from now on */
+    tb_hash_insert(tb, tb_hash_func(phys_pc, tb->pc, tb->cs_base, tb->flags));
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -654,3 +973,108 @@ out_unlock_next:
     spin_unlock(&tb_next->jmp_lock);
     return;
 }
+
+/*
+ * Two-page TBs that may be reached by chained jumps. Only the lookup checks
+ * that the virtual address of their second page still maps to the physical
+ * page they were translated from, so the incoming jumps are removed as soon
+ * as that mapping may change. Writes to either physical page are handled by
+ * tb_phys_invalidate like for any other TB. Only the flushes of the vCPU
+ * that chained the jump are seen, so fetch_and_run_tb does not chain into
+ * these TBs when there are several vCPUs.
+ */
+static GMutex s_page2_lock;
+/* virtual address of the second page -> set of TBs */
+static GHashTable *s_page2_tbs;
+
+static inline target_ulong tb_virt_page2(const TranslationBlock *tb) {
+    return (tb->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+}
+
+void tb_page2_track(TranslationBlock *tb) {
+    gpointer key = GSIZE_TO_POINTER(tb_virt_page2(tb));
+    GHashTable *tbs;
+
+    g_mutex_lock(&s_page2_lock);
+    if (!s_page2_tbs) {
+        s_page2_tbs = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify) g_hash_table_destroy);
+    }
+
+    tbs = g_hash_table_lookup(s_page2_tbs, key);
+    if (!tbs) {
+        tbs = g_hash_table_new(NULL, NULL);
+        g_hash_table_insert(s_page2_tbs, key, tbs);
+    }
+    g_hash_table_add(tbs, tb);
+    g_mutex_unlock(&s_page2_lock);
+}
+
+static void tb_page2_unlink_set(GHashTable *tbs) {
+    GHashTableIter it;
+    gpointer tb;
+
+    g_hash_table_iter_init(&it, tbs);
+    while (g_hash_table_iter_next(&it, &tb, NULL)) {
+        tb_jmp_unlink(tb);
+    }
+}
+
+void tb_page2_flush(target_ulong addr) {
+    gpointer key = GSIZE_TO_POINTER(addr & TARGET_PAGE_MASK);
+    GHashTable *tbs;
+
+    if (!s_page2_tbs) {
+        return;
+    }
+
+    g_mutex_lock(&s_page2_lock);
+    tbs = g_hash_table_lookup(s_page2_tbs, key);
+    if (tbs) {
+        tb_page2_unlink_set(tbs);
+        g_hash_table_remove(s_page2_tbs, key);
+    }
+    g_mutex_unlock(&s_page2_lock);
+}
+
+void tb_page2_flush_all(void) {
+    GHashTableIter it;
+    gpointer tbs;
+
+    if (!s_page2_tbs) {
+        return;
+    }
+
+    g_mutex_lock(&s_page2_lock);
+    g_hash_table_iter_init(&it, s_page2_tbs);
+    while (g_hash_table_iter_next(&it, NULL, &tbs)) {
+        tb_page2_unlink_set(tbs);
+    }
+    g_hash_table_remove_all(s_page2_tbs);
+    g_mutex_unlock(&s_page2_lock);
+}
+
+void tb_page2_forget(TranslationBlock *tb) {
+    GHashTable *tbs;
+
+    if (!s_page2_tbs) {
+        return;
+    }
+
+    g_mutex_lock(&s_page2_lock);
+    tbs = g_hash_table_lookup(s_page2_tbs, GSIZE_TO_POINTER(tb_virt_page2(tb)));
+    if (tbs) {
+        g_hash_table_remove(tbs, tb);
+    }
+    g_mutex_unlock(&s_page2_lock);
+}
+
+static void tb_page2_discard(void) {
+    if (!s_page2_tbs) {
+        return;
+    }
+
+    g_mutex_lock(&s_page2_lock);
+    g_hash_table_remove_all(s_page2_tbs);
+    g_mutex_unlock(&s_page2_lock);
+}
+
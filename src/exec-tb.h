@@ -41,5 +41,19 @@ void tb_reset_jump(TranslationBlock *tb, int n);
 void tb_jmp_unlink(TranslationBlock *dest);
 void tb_add_jump(TranslationBlock *tb, int n, TranslationBlock *tb_next);
 void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr);
+void tb_phys_detach(TranslationBlock *tb);
+
+/* Chaining into TBs spanning two pages, see tb_page2_track */
+void tb_page2_track(TranslationBlock *tb);
+void tb_page2_flush(target_ulong addr);
+void tb_page2_flush_all(void);
+void tb_page2_forget(TranslationBlock *tb);
+
+void tb_translate_lock(void);
+void tb_translate_unlock(void);
+void tb_translate_unlock_all(void);
+
+TranslationBlock *tb_gen_code_unlinked(CPUArchState *env, target_ulong pc, target_ulong cs_base, int flags,
+                                       int cflags);
 
 #endif
@@ -0,0 +1,561 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+/*
+ * Persistent translation cache.
+ *
+ * tb_cache_save() dumps the used part of the code buffer, which contains
+ * both the TB descriptors and their host code and search data, together with
+ * one record per valid TB (physical pages and a hash of the guest bytes).
+ *
+ * On the next start, tb_cache_load() maps the file back at the same address.
+ * Generated code embeds absolute addresses (helpers, env, TB descriptors), so
+ * the file is only used when the code buffer, libcpu and libtcg are loaded at
+ * the same addresses as when it was saved. Those addresses are recorded in
+ * the header, the fingerprint covers the rest of the layout. There is no
+ * relocation step: a mismatch just disables the cache, which means that it
+ * is always ignored when the libraries are loaded at randomized addresses.
+ *
+ * Restored TBs are not linked anywhere until a lookup misses on their key.
+ * They are then revalidated against the current guest memory and linked like
+ * a freshly translated TB.
+ */
+
+#include <cpu/config.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tcg/tcg.h>
+#include "cpu.h"
+#include "exec-ram.h"
+#include "exec-tb.h"
+#include "exec-tbcache.h"
+#include "exec-tbhash.h"
+#include "exec-tbtier.h"
+
+#define TB_CACHE_MAGIC 0x4354424c /* LBTC */
+#define TB_CACHE_VERSION 2
+
+struct tb_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;
+    uint64_t prologue_hash;
+
+    /* where the libraries were loaded, generated code refers to them directly */
+    uint64_t libcpu_data;
+    uint64_t libcpu_code;
+    uint64_t libtcg_code;
+    uint64_t helpers_hash;
+
+    /* page-aligned address and size of the saved part of the code buffer */
+    uint64_t base;
+    uint64_t size;
+    uint64_t code_offset; /* in the file, page-aligned */
+    uint64_t code_gen_ptr;
+
+    uint64_t record_count;
+};
+
+struct tb_cache_record {
+    uint64_t tb; /* address of the TB descriptor */
+    uint64_t phys_pc;
+    uint64_t phys_page2;
+    uint64_t guest_hash;
+};
+
+struct tb_cache_entry {
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
+    tb_page_addr_t phys_page2;
+    uint64_t guest_hash;
+};
+
+static char *s_path;
+static struct tb_cache_header s_header;
+static bool s_header_valid;
+
+/* hash of the tb key -> list of tb_cache_entry */
+static GHashTable *s_pending;
+
+static struct tb_cache_stats s_stats;
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+    const uint8_t *p = data;
+
+    /* FNV-1a */
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+
+    return h;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ull
+
+static uint64_t hash_u64(uint64_t h, uint64_t v) {
+    return hash_bytes(h, &v, sizeof(v));
+}
+
+/* Layout assumptions of generated code, the absolute addresses are checked separately */
+static uint64_t compute_fingerprint(void) {
+    uint64_t h = HASH_SEED;
+
+    h = hash_u64(h, TB_CACHE_VERSION);
+    h = hash_u64(h, sizeof(TranslationBlock));
+    h = hash_u64(h, sizeof(CPUArchState));
+    h = hash_u64(h, TARGET_PAGE_BITS);
+    /* both change the code generated at the start of each TB */
+    h = hash_u64(h, cpu_get_budget_mode());
+    h = hash_u64(h, tb_tier_get_mode());
+
+    return h;
+}
+
+static void get_load_addresses(struct tb_cache_header *header) {
+    uint64_t h = HASH_SEED;
+
+    /* where the data of the library was loaded, the helper env may be thread-local */
+    header->libcpu_data = (uintptr_t) &first_cpu;
+    header->libcpu_code = (uintptr_t) &tb_gen_code;
+    header->libtcg_code = (uintptr_t) &tcg_gen_code;
+    for (unsigned i = 0; i < ARRAY_SIZE(tcg_ctx->qemu_ld_helpers); ++i) {
+        h = hash_u64(h, (uintptr_t) tcg_ctx->qemu_ld_helpers[i]);
+        h = hash_u64(h, (uintptr_t) tcg_ctx->qemu_st_helpers[i]);
+    }
+    header->helpers_hash = h;
+}
+
+static bool tb_cache_check_address(const char *what, uint64_t cached, uint64_t current) {
+    if (cached == current) {
+        return true;
+    }
+
+    fprintf(stderr,
+            "libcpu: translation cache ignored, %s moved from %#" PRIx64 " to %#" PRIx64 " "
+            "(address space randomization must be disabled)\n",
+            what, cached, current);
+    return false;
+}
+
+/* Page-aligned start of the code buffer, the part below the first TB holds the prologue */
+static uint8_t *code_base(void) {
+    return (uint8_t *) ((uintptr_t) tcg_init_ctx.code_gen_buffer & TARGET_PAGE_MASK);
+}
+
+static uint64_t compute_prologue_hash(void) {
+    uint8_t *base = code_base();
+    return hash_bytes(HASH_SEED, base, (uint8_t *) tcg_init_ctx.code_gen_buffer - base);
+}
+
+bool tb_cache_hash_guest_code(tb_page_addr_t phys_pc, tb_page_addr_t phys_page2, unsigned size, uint64_t *hash) {
+    unsigned offset = phys_pc & ~TARGET_PAGE_MASK;
+    unsigned size1 = size;
+    uint8_t *p;
+
+    if (offset + size1 > TARGET_PAGE_SIZE) {
+        size1 = TARGET_PAGE_SIZE - offset;
+    }
+
+    p = get_ram_ptr_internal(phys_pc);
+    if (!p) {
+        return false;
+    }
+    *hash = hash_bytes(HASH_SEED, p, size1);
+
+    if (size1 < size) {
+        if (phys_page2 == -1) {
+            return false;
+        }
+        p = get_ram_ptr_internal(phys_page2);
+        if (!p) {
+            return false;
+        }
+        *hash = hash_bytes(*hash, p, size - size1);
+    }
+
+    return true;
+}
+
+static guint entry_key(tb_page_addr_t phys_pc, target_ulong pc, target_ulong cs_base, uint64_t flags) {
+    return tb_hash_func(phys_pc, pc, cs_base, flags);
+}
+
+static void free_entry_list(gpointer data) {
+    g_slist_free_full(data, g_free);
+}
+
+/*****************************************************************/
+
+void tb_cache_init(const char *path) {
+    struct tb_cache_header header;
+    FILE *fp;
+
+#ifdef CONFIG_SYMBEX
+    /* Translated code also has per-TB state in the symbolic execution engine */
+    fprintf(stderr, "libcpu: persistent translation cache is not supported in symbolic mode\n");
+    return;
+#endif
+
+    g_free(s_path);
+    s_path = g_strdup(path);
+    s_header_valid = false;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        return;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) == 1 && header.magic == TB_CACHE_MAGIC &&
+        header.version == TB_CACHE_VERSION) {
+        s_header = header;
+        s_header_valid = true;
+    }
+
+    fclose(fp);
+}
+
+void *tb_cache_code_gen_hint(void) {
+    if (!s_header_valid) {
+        return NULL;
+    }
+    return (void *) (uintptr_t) s_header.base;
+}
+
+static bool tb_cache_check_header(void) {
+    struct tb_cache_header current;
+    uint8_t *base = code_base();
+    uint8_t *start = tcg_ctx->code_gen_ptr;
+
+    if (s_header.fingerprint != compute_fingerprint()) {
+        fprintf(stderr, "libcpu: translation cache was created by a different build or configuration\n");
+        return false;
+    }
+
+    get_load_addresses(&current);
+    if (!tb_cache_check_address("libcpu data", s_header.libcpu_data, current.libcpu_data) ||
+        !tb_cache_check_address("libcpu code", s_header.libcpu_code, current.libcpu_code) ||
+        !tb_cache_check_address("libtcg code", s_header.libtcg_code, current.libtcg_code)) {
+        return false;
+    }
+
+    if (s_header.helpers_hash != current.helpers_hash) {
+        fprintf(stderr, "libcpu: translation cache was created with different memory access helpers\n");
+        return false;
+    }
+
+    /* tb_cache_code_gen_hint asked for the cached address, something else may be mapped there */
+    if (!tb_cache_check_address("the code buffer", s_header.base, (uintptr_t) base)) {
+        return false;
+    }
+
+    if (s_header.prologue_hash != compute_prologue_hash()) {
+        fprintf(stderr, "libcpu: translation cache has a different prologue\n");
+        return false;
+    }
+
+    if (s_header.code_gen_ptr < (uintptr_t) start || s_header.code_gen_ptr > s_header.base + s_header.size ||
+        s_header.code_gen_ptr >= (uintptr_t) tcg_ctx->code_gen_highwater) {
+        fprintf(stderr, "libcpu: translation cache does not fit in the code buffer\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* Reset the fields that point outside of the saved code */
+static void tb_cache_sanitize(TranslationBlock *tb) {
+    tb->cflags &= ~CF_INVALID;
+    tb->page_addr[0] = tb->page_addr[1] = -1;
+    tb->page_next[0] = tb->page_next[1] = NULL;
+
+    tb->jmp_lock = SPIN_LOCK_UNLOCKED;
+    tb->jmp_list_head = (uintptr_t) NULL;
+    tb->jmp_list_next[0] = (uintptr_t) NULL;
+    tb->jmp_list_next[1] = (uintptr_t) NULL;
+    tb->jmp_dest[0] = (uintptr_t) NULL;
+    tb->jmp_dest[1] = (uintptr_t) NULL;
+
+    /* the saved code may be chained to TBs that will never be activated */
+    if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+        tb_reset_jump(tb, 0);
+    }
+    if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+        tb_reset_jump(tb, 1);
+    }
+}
+
+void tb_cache_load(void) {
+    struct tb_cache_record *records = NULL;
+    uintptr_t start = (uintptr_t) tcg_ctx->code_gen_ptr;
+    size_t records_size;
+    void *map;
+    int fd;
+
+    if (!s_header_valid || !tb_cache_check_header()) {
+        return;
+    }
+
+    fd = open(s_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    records_size = s_header.record_count * sizeof(*records);
+    records = g_malloc(records_size);
+    if (pread(fd, records, records_size, sizeof(s_header)) != (ssize_t) records_size) {
+        goto out;
+    }
+
+    /* the saved bytes become the beginning of the code buffer */
+    map = mmap((void *) (uintptr_t) s_header.base, s_header.size, PROT_READ | PROT_WRITE | PROT_EXEC,
+               MAP_PRIVATE | MAP_FIXED, fd, s_header.code_offset);
+    if (map == MAP_FAILED) {
+        perror("libcpu: could not map translation cache");
+        abort();
+    }
+
+    s_pending = g_hash_table_new_full(NULL, NULL, NULL, free_entry_list);
+
+    for (uint64_t i = 0; i < s_header.record_count; ++i) {
+        struct tb_cache_record *rec = &records[i];
+        TranslationBlock *tb = (TranslationBlock *) (uintptr_t) rec->tb;
+        struct tb_cache_entry *entry;
+        GSList *list;
+        guint key;
+
+        if (rec->tb < start || rec->tb + sizeof(*tb) > s_header.code_gen_ptr) {
+            continue;
+        }
+
+        tb_cache_sanitize(tb);
+
+        entry = g_malloc(sizeof(*entry));
+        entry->tb = tb;
+        entry->phys_pc = rec->phys_pc;
+        entry->phys_page2 = rec->phys_page2;
+        entry->guest_hash = rec->guest_hash;
+
+        key = entry_key(rec->phys_pc, tb->pc, tb->cs_base, tb->flags);
+        list = g_hash_table_lookup(s_pending, GUINT_TO_POINTER(key));
+        g_hash_table_steal(s_pending, GUINT_TO_POINTER(key));
+        g_hash_table_insert(s_pending, GUINT_TO_POINTER(key), g_slist_prepend(list, entry));
+
+        ++s_stats.restored;
+    }
+
+    /* new translations go after the restored code */
+    atomic_set(&tcg_ctx->code_gen_ptr, (void *) (uintptr_t) s_header.code_gen_ptr);
+
+out:
+    g_free(records);
+    close(fd);
+}
+
+TranslationBlock *tb_cache_lookup(CPUArchState *env1, tb_page_addr_t phys_pc, target_ulong pc, target_ulong cs_base,
+                                  uint64_t flags) {
+    struct tb_cache_entry *entry = NULL;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_page2 = -1;
+    uint64_t hash;
+    GSList *list, *it;
+    guint key;
+
+    if (!s_pending) {
+        return NULL;
+    }
+
+    key = entry_key(phys_pc, pc, cs_base, flags);
+    list = g_hash_table_lookup(s_pending, GUINT_TO_POINTER(key));
+
+    for (it = list; it; it = it->next) {
+        struct tb_cache_entry *e = it->data;
+        if (e->phys_pc == phys_pc && e->tb->pc == pc && e->tb->cs_base == cs_base && e->tb->flags == flags) {
+            entry = e;
+            break;
+        }
+    }
+
+    if (!entry) {
+        return NULL;
+    }
+
+    /* a restored TB is either activated or dropped, never checked twice */
+    list = g_slist_delete_link(list, it);
+    g_hash_table_steal(s_pending, GUINT_TO_POINTER(key));
+    if (list) {
+        g_hash_table_insert(s_pending, GUINT_TO_POINTER(key), list);
+    }
+
+    tb = entry->tb;
+
+    if (((pc & TARGET_PAGE_MASK) != ((pc + tb->size - 1) & TARGET_PAGE_MASK))) {
+        phys_page2 = get_page_addr_code(env1, (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE);
+    }
+
+    if (phys_page2 != entry->phys_page2 || !tb_cache_hash_guest_code(phys_pc, phys_page2, tb->size, &hash) ||
+        hash != entry->guest_hash) {
+        ++s_stats.rejected;
+        g_free(entry);
+        return NULL;
+    }
+
+    g_free(entry);
+
+    tb_link_page(tb, phys_pc, phys_page2);
+    tcg_tb_insert(tb);
+
+    ++s_stats.activated;
+    return tb;
+}
+
+void tb_cache_discard(void) {
+    if (s_pending) {
+        g_hash_table_destroy(s_pending);
+        s_pending = NULL;
+    }
+}
+
+/*****************************************************************/
+
+struct tb_cache_save_state {
+    GArray *records;
+    uintptr_t start;
+    uintptr_t end;
+};
+
+static void tb_cache_save_tb(TranslationBlock *tb, void *opaque) {
+    struct tb_cache_save_state *state = opaque;
+    struct tb_cache_record rec;
+    tb_page_addr_t phys_pc;
+
+    if ((uintptr_t) tb < state->start || (uintptr_t) tb->tc.ptr + tb->tc.size > state->end) {
+        return;
+    }
+
+    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+    if (!tb_cache_hash_guest_code(phys_pc, tb->page_addr[1], tb->size, &rec.guest_hash)) {
+        return;
+    }
+
+    rec.tb = (uintptr_t) tb;
+    rec.phys_pc = phys_pc;
+    rec.phys_page2 = tb->page_addr[1];
+    g_array_append_val(state->records, rec);
+}
+
+static bool write_all(int fd, const void *data, size_t size, off_t offset) {
+    const uint8_t *p = data;
+
+    while (size) {
+        ssize_t ret = pwrite(fd, p, size, offset);
+        if (ret <= 0) {
+            return false;
+        }
+        p += ret;
+        size -= ret;
+        offset += ret;
+    }
+
+    return true;
+}
+
+int tb_cache_save(void) {
+    struct tb_cache_save_state state;
+    struct tb_cache_header header;
+    uint8_t *base = code_base();
+    size_t records_size;
+    char *tmp_path;
+    int fd, ret = -1;
+
+    if (!s_path) {
+        return -1;
+    }
+
+    /* with generational eviction live code is not a prefix of the buffer */
+    if (tb_get_evict_mode() != TB_EVICT_FLUSH) {
+        fprintf(stderr, "libcpu: translation cache can only be saved in flush mode\n");
+        return -1;
+    }
+
+    /* tier 1 TBs embed the address of their execution counter */
+    if (tb_tier_get_mode() != TB_TIER_OFF) {
+        fprintf(stderr, "libcpu: translation cache cannot be saved with tiered translation\n");
+        return -1;
+    }
+
+    state.records = g_array_new(FALSE, FALSE, sizeof(struct tb_cache_record));
+    state.start = (uintptr_t) tcg_init_ctx.code_gen_buffer;
+    state.end = (uintptr_t) tcg_ctx->code_gen_ptr;
+    tb_hash_foreach(tb_cache_save_tb, &state);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = TB_CACHE_MAGIC;
+    header.version = TB_CACHE_VERSION;
+    header.fingerprint = compute_fingerprint();
+    get_load_addresses(&header);
+    header.prologue_hash = compute_prologue_hash();
+    header.base = (uintptr_t) base;
+    header.size = TARGET_PAGE_ALIGN(state.end - (uintptr_t) base);
+    header.code_gen_ptr = state.end;
+    header.record_count = state.records->len;
+
+    records_size = state.records->len * sizeof(struct tb_cache_record);
+    header.code_offset = TARGET_PAGE_ALIGN(sizeof(header) + records_size);
+
+    /* write to a temporary file so that a crash never leaves a truncated cache behind */
+    tmp_path = g_strdup_printf("%s.tmp", s_path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(tmp_path);
+        goto out;
+    }
+
+    if (!write_all(fd, &header, sizeof(header), 0) ||
+        !write_all(fd, state.records->data, records_size, sizeof(header)) ||
+        !write_all(fd, base, header.size, header.code_offset)) {
+        perror(tmp_path);
+        close(fd);
+        unlink(tmp_path);
+        goto out;
+    }
+
+    close(fd);
+
+    if (rename(tmp_path, s_path) < 0) {
+        perror(s_path);
+        unlink(tmp_path);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    g_free(tmp_path);
+    g_array_free(state.records, TRUE);
+    return ret;
+}
+
+void tb_cache_get_stats(struct tb_cache_stats *stats) {
+    *stats = s_stats;
+}
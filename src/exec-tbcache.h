@@ -0,0 +1,54 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __EXEC_TBCACHE_H__
+
+#define __EXEC_TBCACHE_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include <cpu/exec.h>
+#include <cpu/tb.h>
+
+struct tb_cache_stats {
+    uint64_t restored;  /* TBs mapped back from the cache file */
+    uint64_t activated; /* TBs revalidated and linked on a lookup miss */
+    uint64_t rejected;  /* TBs whose guest code changed */
+};
+
+/* Preferred address of the code buffer, NULL if the cache is disabled */
+void *tb_cache_code_gen_hint(void);
+
+/* Maps the cache file in the code buffer, called once the prologue is generated */
+void tb_cache_load(void);
+
+/* Returns a restored TB matching the given key whose guest code is unchanged */
+TranslationBlock *tb_cache_lookup(CPUArchState *env, tb_page_addr_t phys_pc, target_ulong pc, target_ulong cs_base,
+                                  uint64_t flags);
+
+/* Forgets all the restored TBs that have not been activated yet */
+void tb_cache_discard(void);
+
+/* Hashes size bytes of guest code starting at phys_pc and continuing on phys_page2 if needed.
+   Returns false if the code is not in RAM. */
+bool tb_cache_hash_guest_code(tb_page_addr_t phys_pc, tb_page_addr_t phys_page2, unsigned size, uint64_t *hash);
+
+void tb_cache_get_stats(struct tb_cache_stats *stats);
+
+#endif
@@ -0,0 +1,441 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+#include <assert.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cpu/config.h>
+#include <cpu/types.h>
+#include "qemu-lock.h"
+
+#include "exec-tbhash.h"
+
+/* 4 entries + seqlock + overflow pointer fill exactly one 64-byte line */
+#define TB_HASH_BUCKET_ENTRIES 4
+#define TB_HASH_BUCKET_ALIGN 64
+
+/* 16K head buckets, i.e. 64K TBs before the first resize */
+#define TB_HASH_INITIAL_BITS 14
+
+/* number of old buckets moved to the new table on each write */
+#define TB_HASH_MIGRATE_STEP 16
+
+struct tb_hash_bucket {
+    /* only meaningful in the head bucket, covers the whole chain */
+    uint32_t seq;
+    uint32_t hashes[TB_HASH_BUCKET_ENTRIES];
+    TranslationBlock *tbs[TB_HASH_BUCKET_ENTRIES];
+    struct tb_hash_bucket *next;
+} __attribute__((aligned(TB_HASH_BUCKET_ALIGN)));
+
+struct tb_hash_table {
+    size_t n_buckets;
+    size_t n_entries;
+    struct tb_hash_bucket *buckets;
+    struct tb_hash_table *retired_next;
+};
+
+/*
+ * Readers load s_cur then s_old. A resize publishes s_old before s_cur and
+ * clears s_old only after every old bucket has been copied, so a reader that
+ * sees the new table either also sees the old one or sees a complete table.
+ */
+static struct tb_hash_table *s_cur;
+static struct tb_hash_table *s_old;
+static size_t s_migrate_pos;
+
+/* tables that readers may still hold, freed on reset */
+static struct tb_hash_table *s_retired;
+
+static spinlock_t s_write_lock = SPIN_LOCK_UNLOCKED;
+
+/* Reader counters are updated without atomics, they are only statistics */
+static struct tb_hash_stats s_stats;
+
+/*****************************************************************/
+
+static inline uint32_t seq_read_begin(const uint32_t *seq) {
+    uint32_t v;
+
+    while ((v = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {
+        /* a writer is modifying this chain */
+    }
+    return v;
+}
+
+static inline bool seq_read_retry(const uint32_t *seq, uint32_t start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+static inline void seq_write_begin(uint32_t *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_write_end(uint32_t *seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/*****************************************************************/
+
+static struct tb_hash_bucket *bucket_alloc(size_t count) {
+    void *ptr;
+    size_t size = count * sizeof(struct tb_hash_bucket);
+
+    if (posix_memalign(&ptr, TB_HASH_BUCKET_ALIGN, size)) {
+        abort();
+    }
+
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+static struct tb_hash_table *table_alloc(size_t n_buckets) {
+    struct tb_hash_table *t = g_malloc0(sizeof(*t));
+
+    assert(!(n_buckets & (n_buckets - 1)));
+    t->n_buckets = n_buckets;
+    t->buckets = bucket_alloc(n_buckets);
+    return t;
+}
+
+static void table_free(struct tb_hash_table *t) {
+    for (size_t i = 0; i < t->n_buckets; ++i) {
+        struct tb_hash_bucket *b = t->buckets[i].next;
+        while (b) {
+            struct tb_hash_bucket *next = b->next;
+            free(b);
+            b = next;
+        }
+    }
+
+    free(t->buckets);
+    g_free(t);
+}
+
+static inline struct tb_hash_bucket *table_head(struct tb_hash_table *t, uint32_t hash) {
+    return &t->buckets[hash & (t->n_buckets - 1)];
+}
+
+/* Occupied slots always form a prefix of the chain, lookups stop at the first hole */
+static TranslationBlock *table_lookup(struct tb_hash_table *t, uint32_t hash, tb_hash_cmp_t cmp, const void *opaque,
+                                      unsigned *probes) {
+    struct tb_hash_bucket *head = table_head(t, hash);
+    TranslationBlock *ret;
+    uint32_t seq;
+
+    do {
+        struct tb_hash_bucket *b = head;
+
+        seq = seq_read_begin(&head->seq);
+        ret = NULL;
+
+        while (b && !ret) {
+            ++*probes;
+            for (int i = 0; i < TB_HASH_BUCKET_ENTRIES; ++i) {
+                TranslationBlock *tb = __atomic_load_n(&b->tbs[i], __ATOMIC_RELAXED);
+                if (!tb) {
+                    b = NULL;
+                    break;
+                }
+                if (__atomic_load_n(&b->hashes[i], __ATOMIC_RELAXED) == hash && cmp(tb, opaque)) {
+                    ret = tb;
+                    break;
+                }
+            }
+            if (b) {
+                b = __atomic_load_n(&b->next, __ATOMIC_ACQUIRE);
+            }
+        }
+    } while (seq_read_retry(&head->seq, seq));
+
+    return ret;
+}
+
+static void table_insert(struct tb_hash_table *t, TranslationBlock *tb, uint32_t hash) {
+    struct tb_hash_bucket *head = table_head(t, hash);
+    struct tb_hash_bucket *b = head, *prev = NULL;
+    int i = 0;
+
+    while (b) {
+        for (i = 0; i < TB_HASH_BUCKET_ENTRIES; ++i) {
+            if (!b->tbs[i]) {
+                goto found;
+            }
+        }
+        prev = b;
+        b = b->next;
+    }
+
+    /* chain is full, append a fully initialized overflow bucket */
+    b = bucket_alloc(1);
+    b->hashes[0] = hash;
+    b->tbs[0] = tb;
+    __atomic_store_n(&prev->next, b, __ATOMIC_RELEASE);
+    ++t->n_entries;
+    return;
+
+found:
+    seq_write_begin(&head->seq);
+    __atomic_store_n(&b->hashes[i], hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->tbs[i], tb, __ATOMIC_RELAXED);
+    seq_write_end(&head->seq);
+    ++t->n_entries;
+}
+
+static bool table_remove(struct tb_hash_table *t, TranslationBlock *tb, uint32_t hash) {
+    struct tb_hash_bucket *head = table_head(t, hash);
+    struct tb_hash_bucket *b, *found_b = NULL, *last_b = NULL;
+    int found_i = 0, last_i = 0;
+
+    for (b = head; b; b = b->next) {
+        for (int i = 0; i < TB_HASH_BUCKET_ENTRIES; ++i) {
+            if (!b->tbs[i]) {
+                goto done;
+            }
+            if (b->tbs[i] == tb) {
+                found_b = b;
+                found_i = i;
+            }
+            last_b = b;
+            last_i = i;
+        }
+    }
+
+done:
+    if (!found_b) {
+        return false;
+    }
+
+    /* move the last entry of the chain into the hole to keep the prefix invariant */
+    seq_write_begin(&head->seq);
+    if (found_b != last_b || found_i != last_i) {
+        __atomic_store_n(&found_b->hashes[found_i], last_b->hashes[last_i], __ATOMIC_RELAXED);
+        __atomic_store_n(&found_b->tbs[found_i], last_b->tbs[last_i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&last_b->tbs[last_i], NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&last_b->hashes[last_i], 0, __ATOMIC_RELAXED);
+    seq_write_end(&head->seq);
+
+    --t->n_entries;
+    return true;
+}
+
+/*****************************************************************/
+
+/* Copy a few buckets of the old table into the current one. Called with the write lock held. */
+static void migrate_step(size_t count) {
+    struct tb_hash_table *old = s_old;
+
+    if (!old) {
+        return;
+    }
+
+    while (count-- && s_migrate_pos < old->n_buckets) {
+        struct tb_hash_bucket *b;
+        for (b = &old->buckets[s_migrate_pos]; b; b = b->next) {
+            for (int i = 0; i < TB_HASH_BUCKET_ENTRIES && b->tbs[i]; ++i) {
+                table_insert(s_cur, b->tbs[i], b->hashes[i]);
+            }
+        }
+        ++s_migrate_pos;
+    }
+
+    if (s_migrate_pos == old->n_buckets) {
+        /* the old table stays readable until the next reset */
+        __atomic_store_n(&s_old, NULL, __ATOMIC_RELEASE);
+        old->retired_next = s_retired;
+        s_retired = old;
+    }
+}
+
+static void maybe_grow(void) {
+    struct tb_hash_table *cur = s_cur, *t;
+
+    /* keep the average chain within the head bucket */
+    if (s_old || cur->n_entries < cur->n_buckets * (TB_HASH_BUCKET_ENTRIES / 2)) {
+        return;
+    }
+
+    t = table_alloc(cur->n_buckets * 2);
+
+    s_migrate_pos = 0;
+    __atomic_store_n(&s_old, cur, __ATOMIC_RELEASE);
+    __atomic_store_n(&s_cur, t, __ATOMIC_RELEASE);
+
+    ++s_stats.resizes;
+}
+
+/*****************************************************************/
+
+void tb_hash_init(void) {
+    assert(!s_cur);
+    s_cur = table_alloc(1 << TB_HASH_INITIAL_BITS);
+}
+
+/* Drops all the entries. Must only be called when no reader can be active (e.g., from tb_flush). */
+void tb_hash_reset(void) {
+    size_t n_buckets;
+
+    spin_lock(&s_write_lock);
+
+    n_buckets = s_cur->n_buckets;
+
+    if (s_old) {
+        table_free(s_old);
+        s_old = NULL;
+    }
+
+    while (s_retired) {
+        struct tb_hash_table *next = s_retired->retired_next;
+        table_free(s_retired);
+        s_retired = next;
+    }
+
+    /* keep the size, the working set after a flush is usually similar */
+    table_free(s_cur);
+    s_cur = table_alloc(n_buckets);
+
+    spin_unlock(&s_write_lock);
+}
+
+void tb_hash_insert(TranslationBlock *tb, uint32_t hash) {
+    spin_lock(&s_write_lock);
+
+    table_insert(s_cur, tb, hash);
+    ++s_stats.inserts;
+
+    migrate_step(TB_HASH_MIGRATE_STEP);
+    maybe_grow();
+
+    spin_unlock(&s_write_lock);
+}
+
+void tb_hash_remove(TranslationBlock *tb, uint32_t hash) {
+    bool removed;
+
+    spin_lock(&s_write_lock);
+
+    removed = table_remove(s_cur, tb, hash);
+    if (s_old) {
+        removed |= table_remove(s_old, tb, hash);
+    }
+
+    if (removed) {
+        ++s_stats.removals;
+    }
+
+    migrate_step(TB_HASH_MIGRATE_STEP);
+
+    spin_unlock(&s_write_lock);
+}
+
+TranslationBlock *tb_hash_lookup(uint32_t hash, tb_hash_cmp_t cmp, const void *opaque) {
+    struct tb_hash_table *cur, *old;
+    TranslationBlock *tb;
+    unsigned probes = 0;
+
+    cur = __atomic_load_n(&s_cur, __ATOMIC_ACQUIRE);
+    old = __atomic_load_n(&s_old, __ATOMIC_ACQUIRE);
+
+    tb = table_lookup(cur, hash, cmp, opaque, &probes);
+    if (!tb && old) {
+        tb = table_lookup(old, hash, cmp, opaque, &probes);
+    }
+
+    ++s_stats.lookups;
+    s_stats.probes += probes;
+    if (probes > s_stats.max_probes) {
+        s_stats.max_probes = probes;
+    }
+    if (tb) {
+        ++s_stats.hits;
+    }
+
+    return tb;
+}
+
+void tb_hash_foreach(void (*fn)(TranslationBlock *tb, void *opaque), void *opaque) {
+    spin_lock(&s_write_lock);
+    migrate_step(SIZE_MAX);
+    spin_unlock(&s_write_lock);
+
+    for (size_t i = 0; i < s_cur->n_buckets; ++i) {
+        for (struct tb_hash_bucket *b = &s_cur->buckets[i]; b; b = b->next) {
+            for (int j = 0; j < TB_HASH_BUCKET_ENTRIES && b->tbs[j]; ++j) {
+                fn(b->tbs[j], opaque);
+            }
+        }
+    }
+}
+
+void tb_hash_get_stats(struct tb_hash_stats *stats) {
+    struct tb_hash_table *t;
+
+    spin_lock(&s_write_lock);
+
+    *stats = s_stats;
+    t = s_cur;
+
+    stats->entries = t->n_entries;
+    stats->head_buckets = t->n_buckets;
+    stats->used_head_buckets = 0;
+    stats->overflow_buckets = 0;
+    stats->max_chain = 0;
+
+    for (size_t i = 0; i < t->n_buckets; ++i) {
+        struct tb_hash_bucket *b = &t->buckets[i];
+        uint64_t chain = 0;
+
+        if (!b->tbs[0]) {
+            continue;
+        }
+
+        ++stats->used_head_buckets;
+        for (; b && b->tbs[0]; b = b->next) {
+            ++chain;
+        }
+
+        stats->overflow_buckets += chain - 1;
+        if (chain > stats->max_chain) {
+            stats->max_chain = chain;
+        }
+    }
+
+    if (s_old) {
+        stats->entries += s_old->n_entries;
+    }
+
+    spin_unlock(&s_write_lock);
+}
+
+void tb_hash_dump_stats(FILE *f) {
+    struct tb_hash_stats st;
+
+    tb_hash_get_stats(&st);
+
+    fprintf(f, "TB hash: %" PRIu64 " entries, %" PRIu64 "/%" PRIu64 " head buckets used, %" PRIu64 " overflow\n",
+            st.entries, st.used_head_buckets, st.head_buckets, st.overflow_buckets);
+    fprintf(f, "TB hash: max chain %" PRIu64 " buckets, %" PRIu64 " resizes\n", st.max_chain, st.resizes);
+    fprintf(f, "TB hash: %" PRIu64 " lookups, %" PRIu64 " hits, avg probes %.2f, max probes %" PRIu64 "\n", st.lookups,
+            st.hits, st.lookups ? (double) st.probes / st.lookups : 0.0, st.max_probes);
+    fprintf(f, "TB hash: %" PRIu64 " inserts, %" PRIu64 " removals\n", st.inserts, st.removals);
+}
@@ -0,0 +1,100 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __EXEC_TBHASH_H__
+
+#define __EXEC_TBHASH_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <cpu/tb.h>
+#include <cpu/types.h>
+
+/*
+ * Physical TB hash table.
+ *
+ * TBs are keyed by (phys_pc, pc, cs_base, flags). The table is an array of
+ * cache-line sized buckets, each holding a few (hash, tb) pairs and an
+ * overflow pointer. Lookups are lock-free: every bucket chain is protected by
+ * a sequence counter in its head bucket and readers simply retry when they
+ * observe a concurrent update. Writers are serialized by an internal lock.
+ *
+ * When the load factor gets too high the table is doubled. The old table is
+ * migrated a few buckets at a time by subsequent writers, so that no single
+ * insertion pays for rehashing the whole cache. Retired tables are freed on
+ * the next tb_flush, when no reader can reference them anymore.
+ */
+
+struct tb_hash_stats {
+    /* lookup counters, updated by readers */
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t probes; /* number of buckets visited by all lookups */
+    uint64_t max_probes;
+
+    /* writer counters */
+    uint64_t inserts;
+    uint64_t removals;
+    uint64_t resizes;
+
+    /* occupancy, computed on demand by tb_hash_get_stats */
+    uint64_t entries;
+    uint64_t head_buckets;
+    uint64_t used_head_buckets;
+    uint64_t overflow_buckets;
+    uint64_t max_chain; /* longest chain, in buckets */
+};
+
+typedef bool (*tb_hash_cmp_t)(const TranslationBlock *tb, const void *opaque);
+
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc, target_ulong cs_base, uint64_t flags) {
+    uint64_t h;
+
+    h = (uint64_t) phys_pc * 0x9e3779b97f4a7c15ull;
+    h ^= (uint64_t) pc + 0x7f4a7c159e3779b9ull + (h << 6) + (h >> 2);
+    h ^= (uint64_t) cs_base + 0x94d049bb133111ebull + (h << 6) + (h >> 2);
+    h ^= flags + 0xbf58476d1ce4e5b9ull + (h << 6) + (h >> 2);
+
+    /* murmur3 finalizer */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return (uint32_t) h;
+}
+
+void tb_hash_init(void);
+void tb_hash_reset(void);
+
+void tb_hash_insert(TranslationBlock *tb, uint32_t hash);
+void tb_hash_remove(TranslationBlock *tb, uint32_t hash);
+
+/* Returns the first TB with the given hash for which cmp returns true */
+TranslationBlock *tb_hash_lookup(uint32_t hash, tb_hash_cmp_t cmp, const void *opaque);
+
+/* Calls fn on every TB in the table. Must not race with writers. */
+void tb_hash_foreach(void (*fn)(TranslationBlock *tb, void *opaque), void *opaque);
+
+void tb_hash_get_stats(struct tb_hash_stats *stats);
+void tb_hash_dump_stats(FILE *f);
+
+#endif
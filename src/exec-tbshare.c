@@ -0,0 +1,261 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+/*
+ * Sharing of translations between identical pages.
+ *
+ * TBs are keyed by the physical address of their code. When the same code
+ * is loaded at several physical addresses, every copy would be translated
+ * on its own. Instead, when a lookup misses, the contents of the page are
+ * hashed and compared with the pages translated so far. If an identical
+ * page is found, the missing page becomes an alias of it: lookups and
+ * translations for the alias use the physical address of the other page,
+ * so that its TBs are reused as they are, chained jumps included.
+ *
+ * Both pages stay write protected while the alias exists. The first write
+ * to either of them removes the aliases of the pair and detaches the TBs of
+ * the translated page from the jump caches and from their callers, so that
+ * a vCPU executing the alias gets back to the lookup.
+ */
+
+#include <cpu/config.h>
+#include <glib.h>
+
+#include <tcg/tcg.h>
+#include "cpu.h"
+#include "exec-phystb.h"
+#include "exec-ram.h"
+#include "exec-tb.h"
+#include "exec-tbcache.h"
+#include "exec-tbshare.h"
+#include "exec-tbsmc.h"
+
+static TBShareMode s_mode = TB_SHARE_OFF;
+
+/* page -> translated page with the same contents */
+static GHashTable *s_aliases;
+/* translated page -> GSList of its aliases */
+static GHashTable *s_targets;
+/* hash of the contents -> page, for pages hashed since their last write */
+static GHashTable *s_index;
+/* page -> hash of its contents, the pages in s_index */
+static GHashTable *s_hashed;
+
+static struct tb_share_stats s_stats;
+
+#define PAGE_KEY(addr) GSIZE_TO_POINTER((addr) & TARGET_PAGE_MASK)
+
+void tb_share_set_mode(TBShareMode mode) {
+#ifdef CONFIG_SYMBEX
+    /* The symbolic execution engine keys its own state on the physical address */
+    mode = TB_SHARE_OFF;
+#endif
+
+    if (!s_aliases) {
+        s_aliases = g_hash_table_new(NULL, NULL);
+        s_targets = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify) g_slist_free);
+        s_index = g_hash_table_new(NULL, NULL);
+        s_hashed = g_hash_table_new(NULL, NULL);
+    }
+
+    g_hash_table_remove_all(s_aliases);
+    g_hash_table_remove_all(s_targets);
+    g_hash_table_remove_all(s_index);
+    g_hash_table_remove_all(s_hashed);
+    s_mode = mode;
+
+    /* Existing TBs may have been reached through an alias */
+    tb_flush(first_cpu);
+}
+
+TBShareMode tb_share_get_mode(void) {
+    return s_mode;
+}
+
+tb_page_addr_t tb_share_resolve(tb_page_addr_t addr) {
+    gpointer target;
+
+    if (addr == -1 || !s_aliases || !g_hash_table_size(s_aliases)) {
+        return addr;
+    }
+
+    if (!g_hash_table_lookup_extended(s_aliases, PAGE_KEY(addr), NULL, &target)) {
+        return addr;
+    }
+
+    ++s_stats.hits;
+    return (tb_page_addr_t) GPOINTER_TO_SIZE(target) | (addr & ~TARGET_PAGE_MASK);
+}
+
+bool tb_share_is_shared(tb_page_addr_t addr) {
+    if (!s_aliases) {
+        return false;
+    }
+
+    return g_hash_table_contains(s_aliases, PAGE_KEY(addr)) || g_hash_table_contains(s_targets, PAGE_KEY(addr)) ||
+           g_hash_table_contains(s_hashed, PAGE_KEY(addr));
+}
+
+/* The translated page must be write protected for as long as it has aliases */
+static bool tb_share_can_alias(tb_page_addr_t target) {
+    PageDesc *p = page_find(target >> TARGET_PAGE_BITS);
+
+    return p && p->first_tb && !(p->smc && p->smc->pending);
+}
+
+tb_page_addr_t tb_share_find(tb_page_addr_t addr) {
+    tb_page_addr_t page = addr & TARGET_PAGE_MASK;
+    tb_page_addr_t other;
+    gpointer value;
+    uint64_t hash;
+    uint8_t *p1, *p2;
+
+    if (s_mode == TB_SHARE_OFF || addr == -1 || g_hash_table_contains(s_hashed, PAGE_KEY(page))) {
+        return addr;
+    }
+
+    if (!tb_cache_hash_guest_code(page, -1, TARGET_PAGE_SIZE, &hash)) {
+        return addr;
+    }
+    ++s_stats.hashed;
+
+    if (g_hash_table_lookup_extended(s_index, GSIZE_TO_POINTER(hash), NULL, &value)) {
+        other = GPOINTER_TO_SIZE(value);
+        p1 = get_ram_ptr_internal(page);
+        p2 = get_ram_ptr_internal(other);
+
+        if (other != page && p1 && p2 && !memcmp(p1, p2, TARGET_PAGE_SIZE) && tb_share_can_alias(other)) {
+            GSList *aliases = g_hash_table_lookup(s_targets, PAGE_KEY(other));
+
+            g_hash_table_insert(s_aliases, PAGE_KEY(page), PAGE_KEY(other));
+            g_hash_table_steal(s_targets, PAGE_KEY(other));
+            g_hash_table_insert(s_targets, PAGE_KEY(other), g_slist_prepend(aliases, PAGE_KEY(page)));
+
+            /* writes to the alias must be seen as well */
+            tlb_protect_code(page);
+
+            ++s_stats.aliased;
+            return other | (addr & ~TARGET_PAGE_MASK);
+        }
+    }
+
+    /* this page is going to be translated, later copies can share it */
+    g_hash_table_insert(s_index, GSIZE_TO_POINTER(hash), PAGE_KEY(page));
+    g_hash_table_insert(s_hashed, PAGE_KEY(page), GSIZE_TO_POINTER(hash));
+    return addr;
+}
+
+/* Makes sure no vCPU keeps running the TBs of the page through a mapping of an alias */
+static void tb_share_detach(tb_page_addr_t target) {
+    PageDesc *p = page_find(target >> TARGET_PAGE_BITS);
+    TranslationBlock *tb;
+    int n;
+
+    if (!p) {
+        return;
+    }
+
+    PAGE_FOR_EACH_TB(p, tb, n) {
+        tb_phys_detach(tb);
+    }
+}
+
+static void tb_share_unprotect(tb_page_addr_t page) {
+    PageDesc *p = page_find(page >> TARGET_PAGE_BITS);
+
+    if (!p || !p->first_tb) {
+        tlb_unprotect_code_phys(cpu_single_env, page, 0);
+    }
+}
+
+static void tb_share_remove_alias(tb_page_addr_t page, tb_page_addr_t target) {
+    GSList *aliases = g_hash_table_lookup(s_targets, PAGE_KEY(target));
+
+    g_hash_table_remove(s_aliases, PAGE_KEY(page));
+
+    aliases = g_slist_remove(aliases, PAGE_KEY(page));
+    g_hash_table_steal(s_targets, PAGE_KEY(target));
+    if (aliases) {
+        g_hash_table_insert(s_targets, PAGE_KEY(target), aliases);
+    }
+
+    ++s_stats.dropped;
+}
+
+void tb_share_page_written(tb_page_addr_t start, tb_page_addr_t end, int is_cpu_write_access) {
+    tb_page_addr_t page = start & TARGET_PAGE_MASK;
+    gpointer value;
+
+    if (!tb_share_is_shared(page)) {
+        return;
+    }
+
+    if (g_hash_table_lookup_extended(s_hashed, PAGE_KEY(page), NULL, &value)) {
+        if (g_hash_table_lookup(s_index, value) == PAGE_KEY(page)) {
+            g_hash_table_remove(s_index, value);
+        }
+        g_hash_table_remove(s_hashed, PAGE_KEY(page));
+    }
+
+    if (g_hash_table_lookup_extended(s_aliases, PAGE_KEY(page), NULL, &value)) {
+        tb_page_addr_t target = GPOINTER_TO_SIZE(value);
+        CPUArchState *env = cpu_single_env;
+        TranslationBlock *current = NULL;
+
+        tb_share_remove_alias(page, target);
+        tb_share_detach(target);
+        tb_share_unprotect(page);
+
+        /* the writing TB may belong to the translated page, let the normal SMC handling stop it */
+        if (is_cpu_write_access && env && env->mem_io_pc) {
+            current = tcg_tb_lookup(env->mem_io_pc);
+        }
+        if (current && current->page_addr[0] == target) {
+            tb_invalidate_phys_page_range(target | (start & ~TARGET_PAGE_MASK), target | (end & ~TARGET_PAGE_MASK),
+                                          is_cpu_write_access);
+        }
+    }
+
+    if (g_hash_table_lookup_extended(s_targets, PAGE_KEY(page), NULL, &value)) {
+        GSList *aliases = g_slist_copy(value);
+
+        for (GSList *it = aliases; it; it = it->next) {
+            tb_page_addr_t alias = GPOINTER_TO_SIZE(it->data);
+            tb_share_remove_alias(alias, page);
+            tb_share_unprotect(alias);
+        }
+        g_slist_free(aliases);
+
+        tb_share_detach(page);
+    }
+}
+
+void tb_share_get_stats(struct tb_share_stats *stats) {
+    *stats = s_stats;
+}
+
+void tb_share_dump_stats(FILE *f) {
+    struct tb_share_stats st;
+
+    tb_share_get_stats(&st);
+
+    fprintf(f, "Translation sharing: %u aliases of %u pages\n", s_aliases ? g_hash_table_size(s_aliases) : 0,
+            s_targets ? g_hash_table_size(s_targets) : 0);
+    fprintf(f, "  pages hashed %" PRIu64 " aliased %" PRIu64 " dropped %" PRIu64 " redirected lookups %" PRIu64 "\n",
+            st.hashed, st.aliased, st.dropped, st.hits);
+}
@@ -0,0 +1,53 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __EXEC_TBSHARE_H__
+
+#define __EXEC_TBSHARE_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <cpu/exec.h>
+#include <cpu/tb.h>
+
+struct tb_share_stats {
+    uint64_t hashed;  /* pages hashed on a lookup miss */
+    uint64_t aliased; /* pages found identical to an already translated page */
+    uint64_t dropped; /* aliases removed because one of the pages was written */
+    uint64_t hits;    /* lookups and translations redirected to another page */
+};
+
+/* Physical address of the translated page with the same contents, or addr itself */
+tb_page_addr_t tb_share_resolve(tb_page_addr_t addr);
+
+/* Called on a lookup miss, looks for a translated page with the same contents.
+   Returns the address to translate the code at. */
+tb_page_addr_t tb_share_find(tb_page_addr_t addr);
+
+/* True if writes to the page must go through tb_invalidate_phys_page_range */
+bool tb_share_is_shared(tb_page_addr_t addr);
+
+/* Called on writes to code protected pages, before invalidating the TBs */
+void tb_share_page_written(tb_page_addr_t start, tb_page_addr_t end, int is_cpu_write_access);
+
+void tb_share_get_stats(struct tb_share_stats *stats);
+void tb_share_dump_stats(FILE *f);
+
+#endif
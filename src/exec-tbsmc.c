@@ -0,0 +1,300 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+/*
+ * Adaptive handling of self modifying code.
+ *
+ * Every write to a page holding translated code invalidates the TBs it
+ * overlaps. JIT compilers keep writing code pages and executing them, so the
+ * same code gets invalidated and translated again and again. Each physical
+ * page that got written records how often this happens: a write that hits
+ * TBs after the page was executed counts as one oscillation.
+ *
+ * Past a threshold, writes to the page no longer invalidate anything.
+ * The first write only detaches the TBs of the page from the jump cache
+ * and from their callers, remembers the hash of their guest code and stops
+ * write-protecting the page, so that the following writes run at full speed.
+ * Before any TB of the page is looked up or added again, the page is
+ * protected again and the TBs whose guest code changed are invalidated.
+ * The others are kept as they are.
+ */
+
+#include <cpu/config.h>
+#include <glib.h>
+
+#include <tcg/tcg.h>
+#include "cpu.h"
+#include "exec-tb.h"
+#include "exec-tbcache.h"
+#include "exec-tbsmc.h"
+
+#define TB_SMC_DEFAULT_THRESHOLD 8
+#define TB_SMC_DUMP_PAGES 16
+
+static TBSmcMode s_mode = TB_SMC_INVALIDATE;
+static unsigned s_threshold = TB_SMC_DEFAULT_THRESHOLD;
+
+/* page address -> struct tb_smc_page, also referenced by the PageDesc */
+static GHashTable *s_pages;
+
+static void tb_smc_page_free(gpointer data) {
+    struct tb_smc_page *page = data;
+
+    g_hash_table_destroy(page->hashes);
+    g_free(page);
+}
+
+void tb_smc_set_mode(TBSmcMode mode, unsigned threshold) {
+#ifdef CONFIG_SYMBEX
+    /* The symbolic execution engine tracks code modifications on its own */
+    mode = TB_SMC_INVALIDATE;
+#endif
+
+    s_threshold = threshold ? threshold : TB_SMC_DEFAULT_THRESHOLD;
+    s_mode = mode;
+
+    /* Start over with all pages protected */
+    tb_flush(first_cpu);
+
+    if (s_pages && mode == TB_SMC_INVALIDATE) {
+        GHashTableIter it;
+        gpointer value;
+
+        g_hash_table_iter_init(&it, s_pages);
+        while (g_hash_table_iter_next(&it, NULL, &value)) {
+            ((struct tb_smc_page *) value)->defer = false;
+        }
+    }
+}
+
+TBSmcMode tb_smc_get_mode(void) {
+    return s_mode;
+}
+
+static struct tb_smc_page *tb_smc_page_get(PageDesc *p, tb_page_addr_t page_addr) {
+    struct tb_smc_page *page = p->smc;
+
+    if (page) {
+        return page;
+    }
+
+    if (!s_pages) {
+        s_pages = g_hash_table_new_full(NULL, NULL, NULL, tb_smc_page_free);
+    }
+
+    page = g_new0(struct tb_smc_page, 1);
+    page->addr = page_addr;
+    page->hashes = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    g_hash_table_insert(s_pages, GSIZE_TO_POINTER(page_addr), page);
+    p->smc = page;
+
+    return page;
+}
+
+void tb_smc_note_write(PageDesc *p, tb_page_addr_t page_addr, unsigned invalidated) {
+    struct tb_smc_page *page = tb_smc_page_get(p, page_addr);
+
+    ++page->writes;
+    page->invalidated += invalidated;
+
+    if (page->executed) {
+        page->executed = false;
+        ++page->oscillations;
+        if (s_mode == TB_SMC_ADAPTIVE && page->oscillations >= s_threshold) {
+            page->defer = true;
+        }
+    }
+}
+
+/* TBs having code on the page, the list cannot be walked while invalidating */
+static GPtrArray *tb_smc_page_tbs(PageDesc *p) {
+    GPtrArray *tbs = g_ptr_array_new();
+    TranslationBlock *tb;
+    int n;
+
+    PAGE_FOR_EACH_TB(p, tb, n) {
+        g_ptr_array_add(tbs, tb);
+    }
+
+    return tbs;
+}
+
+static bool tb_smc_hash(TranslationBlock *tb, uint64_t *hash) {
+    /* TBs spanning two pages are never deferred */
+    if (tb->page_addr[1] != -1) {
+        return false;
+    }
+
+    return tb_cache_hash_guest_code(tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK), -1, tb->size, hash);
+}
+
+bool tb_smc_defer_write(CPUArchState *env, PageDesc *p, tb_page_addr_t page_addr) {
+    struct tb_smc_page *page = p->smc;
+    TranslationBlock *current = NULL;
+    GPtrArray *tbs;
+
+    if (!page || !page->defer) {
+        return false;
+    }
+
+    if (page->pending) {
+        /* through a mapping whose TLB entry still traps writes */
+        ++page->deferred;
+        return true;
+    }
+
+    /* The TB doing the write may have to stop right away, which only the normal path handles */
+    if (env && env->mem_io_pc) {
+        current = tcg_tb_lookup(env->mem_io_pc);
+    }
+    if (current && (current->page_addr[0] == page_addr || current->page_addr[1] == page_addr)) {
+        return false;
+    }
+
+    tbs = tb_smc_page_tbs(p);
+    for (guint i = 0; i < tbs->len; ++i) {
+        TranslationBlock *tb = g_ptr_array_index(tbs, i);
+        uint64_t *hash = g_new(uint64_t, 1);
+
+        if (tb_smc_hash(tb, hash)) {
+            g_hash_table_insert(page->hashes, tb, hash);
+            tb_phys_detach(tb);
+        } else {
+            g_free(hash);
+            tb_phys_invalidate(tb, -1);
+            ++page->invalidated;
+        }
+    }
+    g_ptr_array_free(tbs, TRUE);
+
+    ++page->writes;
+    ++page->deferred;
+    page->pending = true;
+    return true;
+}
+
+static void tb_smc_validate(PageDesc *p, struct tb_smc_page *page) {
+    GPtrArray *tbs;
+
+    page->pending = false;
+
+    /* writes must be seen again before checking the code */
+    tlb_protect_code(page->addr);
+
+    tbs = tb_smc_page_tbs(p);
+    for (guint i = 0; i < tbs->len; ++i) {
+        TranslationBlock *tb = g_ptr_array_index(tbs, i);
+        uint64_t *old_hash = g_hash_table_lookup(page->hashes, tb);
+        uint64_t hash;
+
+        if (old_hash && tb_smc_hash(tb, &hash) && hash == *old_hash) {
+            ++page->revalidated;
+        } else {
+            tb_phys_invalidate(tb, -1);
+            ++page->invalidated;
+        }
+    }
+    g_ptr_array_free(tbs, TRUE);
+
+    g_hash_table_remove_all(page->hashes);
+}
+
+void tb_smc_note_translation(PageDesc *p, tb_page_addr_t page_addr) {
+    struct tb_smc_page *page = p->smc;
+
+    if (!page) {
+        return;
+    }
+
+    if (page->pending) {
+        tb_smc_validate(p, page);
+    }
+    page->executed = true;
+}
+
+void tb_smc_validate_page(tb_page_addr_t addr) {
+    PageDesc *p = page_find(addr >> TARGET_PAGE_BITS);
+
+    if (p && p->smc && p->smc->pending) {
+        tb_smc_validate(p, p->smc);
+        p->smc->executed = true;
+    }
+}
+
+void tb_smc_discard(void) {
+    GHashTableIter it;
+    gpointer value;
+
+    if (!s_pages) {
+        return;
+    }
+
+    g_hash_table_iter_init(&it, s_pages);
+    while (g_hash_table_iter_next(&it, NULL, &value)) {
+        struct tb_smc_page *page = value;
+
+        /* the next TB added to the page protects it again */
+        page->pending = false;
+        g_hash_table_remove_all(page->hashes);
+    }
+}
+
+static gint tb_smc_page_cmp(gconstpointer a, gconstpointer b) {
+    const struct tb_smc_page *pa = *(struct tb_smc_page *const *) a;
+    const struct tb_smc_page *pb = *(struct tb_smc_page *const *) b;
+
+    if (pa->oscillations != pb->oscillations) {
+        return pa->oscillations < pb->oscillations ? 1 : -1;
+    }
+    return pa->writes < pb->writes ? 1 : pa->writes > pb->writes ? -1 : 0;
+}
+
+void tb_smc_dump_stats(FILE *f) {
+    GPtrArray *pages;
+    GHashTableIter it;
+    gpointer value;
+    unsigned deferred = 0;
+
+    fprintf(f, "Self modifying code: %u pages written, oscillation threshold %u\n",
+            s_pages ? g_hash_table_size(s_pages) : 0, s_threshold);
+    if (!s_pages) {
+        return;
+    }
+
+    pages = g_ptr_array_new();
+    g_hash_table_iter_init(&it, s_pages);
+    while (g_hash_table_iter_next(&it, NULL, &value)) {
+        struct tb_smc_page *page = value;
+        g_ptr_array_add(pages, page);
+        deferred += page->defer;
+    }
+    g_ptr_array_sort(pages, tb_smc_page_cmp);
+
+    fprintf(f, "  %u pages with deferred invalidation\n", deferred);
+    for (guint i = 0; i < pages->len && i < TB_SMC_DUMP_PAGES; ++i) {
+        struct tb_smc_page *page = g_ptr_array_index(pages, i);
+
+        fprintf(f,
+                "  page %#" PRIx64 "%s: writes %" PRIu64 " oscillations %" PRIu64 " invalidated %" PRIu64
+                " deferred %" PRIu64 " revalidated %" PRIu64 "\n",
+                (uint64_t) page->addr, page->defer ? " (deferred)" : "", page->writes, page->oscillations,
+                page->invalidated, page->deferred, page->revalidated);
+    }
+
+    g_ptr_array_free(pages, TRUE);
+}
@@ -0,0 +1,66 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __EXEC_TBSMC_H__
+
+#define __EXEC_TBSMC_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <cpu/exec.h>
+#include <cpu/tb.h>
+#include "exec-phystb.h"
+
+/* Self modifying code statistics and state of a physical page */
+struct tb_smc_page {
+    tb_page_addr_t addr;
+    uint64_t writes;       /* writes that hit translated code */
+    uint64_t invalidated;  /* TBs invalidated because of these writes */
+    uint64_t oscillations; /* code translated or executed again after a write */
+    uint64_t deferred;     /* writes that only deferred the invalidation */
+    uint64_t revalidated;  /* TBs kept because their code was left intact */
+
+    bool executed; /* code was translated or executed since the last write */
+    bool defer;    /* the page oscillates, invalidation is deferred */
+    bool pending;  /* written since the last check, TBs are only reachable through the lookup */
+
+    /* TB -> hash of its guest code before the first deferred write */
+    GHashTable *hashes;
+};
+
+/* Accounts for a write that invalidated TBs of the page */
+void tb_smc_note_write(PageDesc *p, tb_page_addr_t page_addr, unsigned invalidated);
+
+/* Handles a write to an oscillating page without invalidating its TBs, returns false
+   if the write must go through the normal invalidation */
+bool tb_smc_defer_write(CPUArchState *env, PageDesc *p, tb_page_addr_t page_addr);
+
+/* Called before adding a TB to the page */
+void tb_smc_note_translation(PageDesc *p, tb_page_addr_t page_addr);
+
+/* Checks the TBs of a written page before any of them is executed again */
+void tb_smc_validate_page(tb_page_addr_t addr);
+
+/* Forgets the deferred state of all pages, on flush */
+void tb_smc_discard(void);
+
+void tb_smc_dump_stats(FILE *f);
+
+#endif
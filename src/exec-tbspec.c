@@ -0,0 +1,500 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+/*
+ * Speculative translation.
+ *
+ * When a TB is translated, the targets of its goto_tb exits are known.
+ * The successors that lie on the same guest page are queued and a pool of
+ * worker threads translates them ahead of time, so that the vCPU usually
+ * finds them ready when it takes the exit.
+ *
+ * The workers share the code generator with the vCPU thread and only run
+ * while holding the translation lock. They translate on a private copy of
+ * the CPU state whose code TLB only maps the page of the successor: any
+ * other code fetch ends up in tlb_fill, which abandons the translation.
+ *
+ * Speculative TBs are not linked to the page lists nor inserted in the TB
+ * hash by the workers, as SMC invalidation and jump patching only happen
+ * on the vCPU thread. Instead, they are published in a side table that
+ * tb_find_slow consults on a miss. The guest bytes are hashed again at
+ * that point, so a TB whose code changed in the meantime is dropped.
+ */
+
+#include <cpu/config.h>
+#include <glib.h>
+#include <setjmp.h>
+
+#include <tcg/tcg.h>
+#include "cpu.h"
+#include "exec-tb.h"
+#include "exec-tbcache.h"
+#include "exec-tbhash.h"
+#include "exec-tbspec.h"
+#include "exec-tlb.h"
+
+/* Bounds the amount of work and memory spent on speculation */
+#define TB_SPEC_MAX_WORKERS 16
+#define TB_SPEC_MAX_QUEUED 64
+#define TB_SPEC_MAX_ENTRIES 4096
+
+struct tb_spec_entry {
+    /* key */
+    tb_page_addr_t phys_pc;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+
+    /* the part of the vCPU state needed to translate the successor */
+    uint32_t hflags;
+    int mmu_idx;
+    CPUTLBEntry tlbe;
+    target_phys_addr_t iotlb;
+    struct cpuid_t cpuid;
+
+    /* set once the translation is done */
+    TranslationBlock *tb;
+    uint64_t guest_hash;
+    target_ulong successors[2];
+    unsigned successor_mask;
+};
+
+struct tb_spec_worker {
+    GThread *thread;
+    CPUArchState *env;
+    sigjmp_buf jmp_env;
+};
+
+static TBSpecMode s_mode = TB_SPEC_OFF;
+
+static struct tb_spec_worker s_workers[TB_SPEC_MAX_WORKERS];
+static unsigned s_worker_count;
+
+/* The context of the thread that initialized the code generator, shared with the workers */
+static TCGContext *s_tcg_ctx;
+
+/* Protects everything below */
+static GMutex s_lock;
+static GCond s_cond;
+static bool s_stop;
+
+/* Bumped by tb_spec_discard, so that workers drop what they were translating */
+static unsigned s_epoch;
+
+/* Pending and finished entries, keyed by themselves */
+static GHashTable *s_entries;
+static GQueue s_queue = G_QUEUE_INIT;
+
+static struct tb_spec_stats s_stats;
+
+static __thread struct tb_spec_worker *s_current_worker;
+
+/* goto_tb targets of the TB being translated by the current thread */
+static __thread target_ulong s_successors[2];
+static __thread unsigned s_successor_mask;
+
+static guint entry_hash(gconstpointer key) {
+    const struct tb_spec_entry *e = key;
+    return tb_hash_func(e->phys_pc, e->pc, e->cs_base, e->flags);
+}
+
+static gboolean entry_equal(gconstpointer a, gconstpointer b) {
+    const struct tb_spec_entry *e1 = a, *e2 = b;
+    return e1->phys_pc == e2->phys_pc && e1->pc == e2->pc && e1->cs_base == e2->cs_base && e1->flags == e2->flags;
+}
+
+static bool tb_spec_lookup_cmp(const TranslationBlock *tb, const void *opaque) {
+    const struct tb_spec_entry *e = opaque;
+
+    return tb->pc == e->pc && tb->page_addr[0] == (e->phys_pc & TARGET_PAGE_MASK) && tb->cs_base == e->cs_base &&
+           tb->flags == e->flags && !(atomic_read(&tb->cflags) & CF_INVALID);
+}
+
+static bool tb_spec_is_translated(const struct tb_spec_entry *e) {
+    uint32_t hash = tb_hash_func(e->phys_pc, e->pc, e->cs_base, e->flags);
+    return tb_hash_lookup(hash, tb_spec_lookup_cmp, e) != NULL;
+}
+
+bool tb_spec_in_worker(void) {
+    return s_current_worker != NULL;
+}
+
+void tb_spec_abort(void) {
+    assert(s_current_worker);
+    siglongjmp(s_current_worker->jmp_env, 1);
+}
+
+void tb_spec_begin(void) {
+    s_successor_mask = 0;
+}
+
+void tb_spec_note_successor(int n, target_ulong pc) {
+    s_successors[n] = pc;
+    s_successor_mask |= 1 << n;
+}
+
+/* Must be called with s_lock held */
+static void tb_spec_queue(CPUArchState *env, TranslationBlock *tb, target_ulong pc) {
+    struct tb_spec_entry *e;
+    unsigned index;
+    int mmu_idx;
+
+    /* The worker only gets a mapping for the page of the parent TB */
+    if ((pc & TARGET_PAGE_MASK) != (tb->pc & TARGET_PAGE_MASK)) {
+        return;
+    }
+
+    e = g_new0(struct tb_spec_entry, 1);
+    e->phys_pc = tb->page_addr[0] + (pc & ~TARGET_PAGE_MASK);
+    e->pc = pc;
+    e->cs_base = tb->cs_base;
+    e->flags = tb->flags;
+
+    if (g_hash_table_contains(s_entries, e) || tb_spec_is_translated(e)) {
+        g_free(e);
+        return;
+    }
+
+    if (g_queue_get_length(&s_queue) >= TB_SPEC_MAX_QUEUED || g_hash_table_size(s_entries) >= TB_SPEC_MAX_ENTRIES) {
+        ++s_stats.dropped;
+        g_free(e);
+        return;
+    }
+
+    /* Code fetches go through the code TLB, skip pages that are not plain RAM */
+    mmu_idx = cpu_mmu_index(env);
+    index = tlb_index(env, mmu_idx, pc);
+    if (env->tlb_table[mmu_idx][index].addr_code != (pc & TARGET_PAGE_MASK)) {
+        g_free(e);
+        return;
+    }
+
+    e->hflags = env->hflags;
+    e->mmu_idx = mmu_idx;
+    e->tlbe = env->tlb_table[mmu_idx][index];
+    e->iotlb = env->iotlb[mmu_idx][index];
+    e->cpuid = env->cpuid;
+
+    g_hash_table_add(s_entries, e);
+    g_queue_push_tail(&s_queue, e);
+    ++s_stats.submitted;
+}
+
+static void tb_spec_submit_successors(CPUArchState *env, TranslationBlock *tb, const target_ulong *successors,
+                                      unsigned mask) {
+    if (!mask || atomic_read(&s_mode) == TB_SPEC_OFF) {
+        return;
+    }
+
+    /* The translator reads these from the CPU state, the workers would not see them */
+    if (!QTAILQ_EMPTY(&env->breakpoints)) {
+        return;
+    }
+
+    g_mutex_lock(&s_lock);
+    for (int n = 0; n < 2; ++n) {
+        if (mask & (1 << n)) {
+            tb_spec_queue(env, tb, successors[n]);
+        }
+    }
+    g_cond_broadcast(&s_cond);
+    g_mutex_unlock(&s_lock);
+}
+
+void tb_spec_submit(CPUArchState *env, TranslationBlock *tb) {
+    if (tb_spec_in_worker()) {
+        return;
+    }
+
+    tb_spec_submit_successors(env, tb, s_successors, s_successor_mask);
+}
+
+TranslationBlock *tb_spec_lookup(CPUArchState *env, tb_page_addr_t phys_pc, target_ulong pc, target_ulong cs_base,
+                                 uint64_t flags) {
+    struct tb_spec_entry key, *e;
+    TranslationBlock *tb;
+    uint64_t hash;
+
+    if (atomic_read(&s_mode) == TB_SPEC_OFF) {
+        return NULL;
+    }
+
+    key.phys_pc = phys_pc;
+    key.pc = pc;
+    key.cs_base = cs_base;
+    key.flags = flags;
+
+    g_mutex_lock(&s_lock);
+    e = g_hash_table_lookup(s_entries, &key);
+    if (!e || !e->tb) {
+        if (e) {
+            ++s_stats.late;
+        }
+        g_mutex_unlock(&s_lock);
+        return NULL;
+    }
+    g_hash_table_steal(s_entries, e);
+    g_mutex_unlock(&s_lock);
+
+    tb = e->tb;
+    if (!tb_cache_hash_guest_code(phys_pc, -1, tb->size, &hash) || hash != e->guest_hash) {
+        /* the guest code changed since it was translated */
+        tb = NULL;
+    }
+
+    g_mutex_lock(&s_lock);
+    if (tb) {
+        ++s_stats.hits;
+    } else {
+        ++s_stats.wasted;
+    }
+    g_mutex_unlock(&s_lock);
+
+    if (!tb) {
+        g_free(e);
+        return NULL;
+    }
+
+    tb_link_page(tb, phys_pc, -1);
+    tcg_tb_insert(tb);
+
+    /* Keep running ahead of the vCPU */
+    tb_spec_submit_successors(env, tb, e->successors, e->successor_mask);
+
+    g_free(e);
+    return tb;
+}
+
+void tb_spec_discard(void) {
+    GHashTableIter it;
+    gpointer key;
+
+    if (!s_entries) {
+        return;
+    }
+
+    g_mutex_lock(&s_lock);
+    ++s_epoch;
+
+    g_hash_table_iter_init(&it, s_entries);
+    while (g_hash_table_iter_next(&it, &key, NULL)) {
+        struct tb_spec_entry *e = key;
+        if (e->tb) {
+            ++s_stats.wasted;
+        }
+    }
+
+    g_queue_clear(&s_queue);
+    g_hash_table_remove_all(s_entries);
+    g_mutex_unlock(&s_lock);
+}
+
+/*****************************************************************/
+
+static CPUArchState *tb_spec_alloc_env(void) {
+    CPUArchState *env = g_malloc0(sizeof(CPUArchState));
+
+    /* all entries invalid */
+    tlb_init(env);
+
+    QTAILQ_INIT(&env->breakpoints);
+    QTAILQ_INIT(&env->watchpoints);
+
+    return env;
+}
+
+static void tb_spec_translate(struct tb_spec_worker *w, const struct tb_spec_entry *job, unsigned epoch) {
+    CPUArchState *env = w->env;
+    TranslationBlock *tb = NULL;
+    struct tb_spec_entry *e;
+    unsigned index, tail;
+    uint64_t before, after, guest_hash;
+    bool aborted = false;
+
+    index = tlb_index(env, job->mmu_idx, job->pc);
+    env->hflags = job->hflags;
+    env->cpuid = job->cpuid;
+    env->tlb_table[job->mmu_idx][index] = job->tlbe;
+    env->iotlb[job->mmu_idx][index] = job->iotlb;
+
+    /* Detect guest writes racing with the translation */
+    tail = TARGET_PAGE_SIZE - (job->pc & ~TARGET_PAGE_MASK);
+    if (tb_cache_hash_guest_code(job->phys_pc, -1, tail, &before)) {
+        tb_translate_lock();
+        if (sigsetjmp(w->jmp_env, 0) == 0) {
+            tb = tb_gen_code_unlinked(env, job->pc, job->cs_base, job->flags, 0);
+        } else {
+            /* The space used by the TB is reclaimed on the next flush */
+            tb = NULL;
+            aborted = true;
+        }
+        tb_translate_unlock();
+    }
+
+    memset(&env->tlb_table[job->mmu_idx][index], -1, sizeof(CPUTLBEntry));
+
+    if (tb && (!tb_cache_hash_guest_code(job->phys_pc, -1, tail, &after) || after != before ||
+               !tb_cache_hash_guest_code(job->phys_pc, -1, tb->size, &guest_hash))) {
+        tb = NULL;
+        aborted = true;
+    }
+
+    g_mutex_lock(&s_lock);
+    e = g_hash_table_lookup(s_entries, job);
+    if (aborted) {
+        ++s_stats.aborted;
+    } else if (tb) {
+        ++s_stats.translated;
+    }
+
+    if (epoch != s_epoch || !e || e->tb) {
+        /* discarded while we were translating */
+        if (tb) {
+            ++s_stats.wasted;
+        }
+    } else if (!tb || tb_spec_is_translated(e)) {
+        /* failed, or the vCPU got there first */
+        if (tb) {
+            ++s_stats.wasted;
+        }
+        g_hash_table_remove(s_entries, e);
+    } else {
+        e->tb = tb;
+        e->guest_hash = guest_hash;
+        e->successors[0] = s_successors[0];
+        e->successors[1] = s_successors[1];
+        e->successor_mask = s_successor_mask;
+    }
+    g_mutex_unlock(&s_lock);
+}
+
+static gpointer tb_spec_worker_main(gpointer opaque) {
+    struct tb_spec_worker *w = opaque;
+    struct tb_spec_entry job;
+    unsigned epoch;
+
+    tcg_ctx = s_tcg_ctx;
+    s_current_worker = w;
+
+    for (;;) {
+        struct tb_spec_entry *e;
+
+        g_mutex_lock(&s_lock);
+        while (!s_stop && g_queue_is_empty(&s_queue)) {
+            g_cond_wait(&s_cond, &s_lock);
+        }
+
+        if (s_stop) {
+            g_mutex_unlock(&s_lock);
+            break;
+        }
+
+        /* The entry may be freed by a discard while we translate, work on a copy */
+        e = g_queue_pop_head(&s_queue);
+        job = *e;
+        epoch = s_epoch;
+        g_mutex_unlock(&s_lock);
+
+        tb_spec_translate(w, &job, epoch);
+    }
+
+    return NULL;
+}
+
+static void tb_spec_stop_workers(void) {
+    g_mutex_lock(&s_lock);
+    s_stop = true;
+    g_cond_broadcast(&s_cond);
+    g_mutex_unlock(&s_lock);
+
+    for (unsigned i = 0; i < s_worker_count; ++i) {
+        g_thread_join(s_workers[i].thread);
+        g_free(s_workers[i].env);
+        s_workers[i].thread = NULL;
+        s_workers[i].env = NULL;
+    }
+
+    s_worker_count = 0;
+    s_stop = false;
+}
+
+void tb_spec_set_mode(TBSpecMode mode, unsigned workers) {
+#ifdef CONFIG_SYMBEX
+    /* The symbolic execution engine attaches its own state to every TB when it is translated */
+    mode = TB_SPEC_OFF;
+#endif
+
+    if (mode == TB_SPEC_OFF) {
+        workers = 0;
+    } else if (workers == 0) {
+        workers = 1;
+    } else if (workers > TB_SPEC_MAX_WORKERS) {
+        workers = TB_SPEC_MAX_WORKERS;
+    }
+
+    if (!s_entries) {
+        s_entries = g_hash_table_new_full(entry_hash, entry_equal, g_free, NULL);
+    }
+
+    atomic_set(&s_mode, TB_SPEC_OFF);
+    tb_spec_stop_workers();
+
+    tb_translate_lock();
+    tb_spec_discard();
+    tb_translate_unlock();
+
+    if (mode == TB_SPEC_OFF) {
+        return;
+    }
+
+    s_tcg_ctx = tcg_ctx;
+
+    for (unsigned i = 0; i < workers; ++i) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "libcpu-tbspec%u", i);
+        s_workers[i].env = tb_spec_alloc_env();
+        s_workers[i].thread = g_thread_new(name, tb_spec_worker_main, &s_workers[i]);
+    }
+    s_worker_count = workers;
+
+    atomic_set(&s_mode, mode);
+}
+
+TBSpecMode tb_spec_get_mode(void) {
+    return s_mode;
+}
+
+void tb_spec_get_stats(struct tb_spec_stats *stats) {
+    g_mutex_lock(&s_lock);
+    *stats = s_stats;
+    g_mutex_unlock(&s_lock);
+}
+
+void tb_spec_dump_stats(FILE *f) {
+    struct tb_spec_stats st;
+
+    tb_spec_get_stats(&st);
+
+    fprintf(f, "Speculative translation: %u worker(s)\n", s_worker_count);
+    fprintf(f, "  submitted %" PRIu64 " dropped %" PRIu64 "\n", st.submitted, st.dropped);
+    fprintf(f, "  translated %" PRIu64 " aborted %" PRIu64 "\n", st.translated, st.aborted);
+    fprintf(f, "  hits %" PRIu64 " (%.1f%% of translated) late %" PRIu64 "\n", st.hits,
+            st.translated ? 100.0 * st.hits / st.translated : 0.0, st.late);
+    fprintf(f, "  wasted %" PRIu64 "\n", st.wasted);
+}
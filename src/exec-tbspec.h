@@ -0,0 +1,65 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __EXEC_TBSPEC_H__
+
+#define __EXEC_TBSPEC_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <cpu/exec.h>
+#include <cpu/tb.h>
+
+struct tb_spec_stats {
+    uint64_t submitted;  /* successors queued for translation */
+    uint64_t dropped;    /* successors not queued because the queue was full */
+    uint64_t translated; /* speculative TBs produced by the workers */
+    uint64_t aborted;    /* translations that needed a page the worker had no mapping for */
+    uint64_t hits;       /* speculative TBs picked up on a lookup miss */
+    uint64_t late;       /* lookup misses on a successor still being translated */
+    uint64_t wasted;     /* speculative TBs that were never used */
+};
+
+/* Called by the code generator before translating a TB */
+void tb_spec_begin(void);
+
+/* Records the static successor of the TB being translated for the given goto_tb slot */
+void tb_spec_note_successor(int n, target_ulong pc);
+
+/* Queues the successors of a freshly translated TB */
+void tb_spec_submit(CPUArchState *env, TranslationBlock *tb);
+
+/* Returns a speculatively translated TB for the given key, linked like a regular TB */
+TranslationBlock *tb_spec_lookup(CPUArchState *env, tb_page_addr_t phys_pc, target_ulong pc, target_ulong cs_base,
+                                 uint64_t flags);
+
+/* Drops all pending and finished speculative translations, with the translation lock held */
+void tb_spec_discard(void);
+
+/* True on a translation worker thread */
+bool tb_spec_in_worker(void);
+
+/* Gives up on the current speculative translation, only valid on a worker thread */
+void LIBCPU_NORETURN tb_spec_abort(void);
+
+void tb_spec_get_stats(struct tb_spec_stats *stats);
+void tb_spec_dump_stats(FILE *f);
+
+#endif
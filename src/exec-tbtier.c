@@ -0,0 +1,264 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+/*
+ * Tiered translation.
+ *
+ * In tier 1, every TB decrements an execution counter right after the exit
+ * request check at its start. When the counter reaches zero, the TB leaves
+ * through the exit request path and the execution loop calls tb_tier_check.
+ *
+ * A trace is then formed by following the chained jumps of the hot TB
+ * towards its hottest successor, as long as the successors are on the same
+ * page, after the head and translated with the same flags. The trace is
+ * translated as a single TB that replaces the head: jumps along the trace
+ * become plain branches, or nothing at all for unconditional jumps, which
+ * also lets the lazy flags state flow from one block to the next. Jumps
+ * leaving the trace become side exits, the first two of them chainable.
+ *
+ * Traces are not profiled again. The counters live outside the TBs and are
+ * freed together with the code, on flush or eviction.
+ */
+
+#include <cpu/config.h>
+#include <glib.h>
+
+#include <tcg/tcg.h>
+#include "cpu.h"
+#include "exec-tb.h"
+#include "exec-tbtier.h"
+
+#define TB_TIER_DEFAULT_THRESHOLD 2000
+
+static TBTierMode s_mode = TB_TIER_OFF;
+static int32_t s_threshold = TB_TIER_DEFAULT_THRESHOLD;
+
+/* TB -> execution counter. Also used by the translation workers. */
+static GMutex s_lock;
+static GHashTable *s_counters;
+
+static struct tb_tier_stats s_stats;
+
+static __thread bool s_trace_active;
+static __thread struct tb_trace s_trace;
+
+void tb_tier_set_mode(TBTierMode mode, unsigned threshold) {
+#ifdef CONFIG_SYMBEX
+    /* The symbolic execution engine expects one guest block per TB */
+    mode = TB_TIER_OFF;
+#endif
+
+    if (!s_counters) {
+        s_counters = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    }
+
+    s_threshold = threshold ? MIN(threshold, INT32_MAX / 2) : TB_TIER_DEFAULT_THRESHOLD;
+    atomic_set(&s_mode, mode);
+
+    /* Start from an empty cache so that all TBs get a counter */
+    tb_flush(first_cpu);
+}
+
+TBTierMode tb_tier_get_mode(void) {
+    return s_mode;
+}
+
+/* A trace charges the instructions of all its blocks on entry, even when it
+   leaves early through a side exit. Instruction budgets must stay exact, so
+   traces are not formed while they are in use. Changing the budget mode
+   flushes the translation cache, which gets rid of the existing traces. */
+static bool tb_tier_active(void) {
+    return atomic_read(&s_mode) != TB_TIER_OFF && cpu_get_budget_mode() == CPU_BUDGET_OFF;
+}
+
+int32_t *tb_tier_get_counter(TranslationBlock *tb) {
+    int32_t *counter;
+
+    if (!tb_tier_active() || s_trace_active || (tb->cflags & CF_NOCACHE)) {
+        return NULL;
+    }
+
+    g_mutex_lock(&s_lock);
+    counter = g_hash_table_lookup(s_counters, tb);
+    if (!counter) {
+        counter = g_new(int32_t, 1);
+        g_hash_table_insert(s_counters, tb, counter);
+    }
+    *counter = s_threshold;
+    g_mutex_unlock(&s_lock);
+
+    return counter;
+}
+
+const struct tb_trace *tb_tier_current_trace(void) {
+    return s_trace_active ? &s_trace : NULL;
+}
+
+void tb_tier_end_trace(void) {
+    s_trace_active = false;
+}
+
+void tb_tier_discard(void) {
+    if (!s_counters) {
+        return;
+    }
+
+    g_mutex_lock(&s_lock);
+    g_hash_table_remove_all(s_counters);
+    g_mutex_unlock(&s_lock);
+}
+
+void tb_tier_forget(TranslationBlock *tb) {
+    if (!s_counters) {
+        return;
+    }
+
+    g_mutex_lock(&s_lock);
+    g_hash_table_remove(s_counters, tb);
+    g_mutex_unlock(&s_lock);
+}
+
+/* How hot the TB is, must be called with s_lock held */
+static int32_t tb_tier_heat(TranslationBlock *tb) {
+    int32_t *counter = g_hash_table_lookup(s_counters, tb);
+    int32_t remaining;
+
+    if (!counter) {
+        return 0;
+    }
+
+    /* the generated code updates the counter without synchronization */
+    remaining = atomic_read(counter);
+    if (remaining <= 0 || remaining > s_threshold) {
+        /* already hot */
+        return s_threshold;
+    }
+
+    return s_threshold - remaining;
+}
+
+static bool tb_tier_can_extend(const TranslationBlock *head, const TranslationBlock *tb,
+                               const struct tb_trace *trace) {
+    if (tb->cs_base != head->cs_base || tb->flags != head->flags || (atomic_read(&tb->cflags) & CF_INVALID) ||
+        (tb->cflags & CF_COUNT_MASK)) {
+        return false;
+    }
+
+    /* The trace is tracked as a single range of guest code starting at the head */
+    if (tb->page_addr[0] != head->page_addr[0] || tb->page_addr[1] != -1 || tb->pc <= head->pc) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < trace->count; ++i) {
+        if (trace->pcs[i] == tb->pc) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void tb_tier_build_trace(TranslationBlock *head, struct tb_trace *trace) {
+    TranslationBlock *tb = head;
+
+    trace->count = 0;
+
+    g_mutex_lock(&s_lock);
+    while (tb && trace->count < TB_TRACE_MAX_BLOCKS) {
+        TranslationBlock *next = NULL;
+        int32_t best = s_threshold / 4;
+
+        trace->pcs[trace->count++] = tb->pc;
+
+        for (int n = 0; n < 2; ++n) {
+            uintptr_t dest = atomic_read(&tb->jmp_dest[n]);
+            TranslationBlock *succ = (TranslationBlock *) (dest & ~1);
+
+            /* the LSB is set while the jump is being reset */
+            if (!succ || (dest & 1) || !tb_tier_can_extend(head, succ, trace)) {
+                continue;
+            }
+
+            int32_t heat = tb_tier_heat(succ);
+            if (heat > best) {
+                best = heat;
+                next = succ;
+            }
+        }
+
+        tb = next;
+    }
+    g_mutex_unlock(&s_lock);
+}
+
+void tb_tier_check(CPUArchState *env, TranslationBlock *tb) {
+    int32_t *counter;
+
+    if (!tb_tier_active()) {
+        return;
+    }
+
+    g_mutex_lock(&s_lock);
+    counter = g_hash_table_lookup(s_counters, tb);
+    g_mutex_unlock(&s_lock);
+
+    if (!counter || atomic_read(counter) != 0) {
+        return;
+    }
+
+    ++s_stats.hot;
+
+    /* Whatever happens below, this TB is not going to exit again for a long time */
+    atomic_set(counter, INT32_MIN);
+
+    if ((atomic_read(&tb->cflags) & CF_INVALID) || tb->page_addr[1] != -1) {
+        ++s_stats.rejected;
+        return;
+    }
+
+    tb_tier_build_trace(tb, &s_trace);
+    if (s_trace.count < 2) {
+        ++s_stats.rejected;
+        return;
+    }
+
+    /* The trace replaces the head TB in the lookup structures */
+    tb_phys_invalidate(tb, -1);
+
+    s_trace_active = true;
+    tb_gen_code(env, tb->pc, tb->cs_base, tb->flags, 0);
+    s_trace_active = false;
+
+    ++s_stats.traces;
+    s_stats.trace_blocks += s_trace.count;
+}
+
+void tb_tier_get_stats(struct tb_tier_stats *stats) {
+    *stats = s_stats;
+}
+
+void tb_tier_dump_stats(FILE *f) {
+    struct tb_tier_stats st;
+
+    tb_tier_get_stats(&st);
+
+    fprintf(f, "Tiered translation: threshold %d\n", s_threshold);
+    fprintf(f, "  hot TBs %" PRIu64 " rejected %" PRIu64 "\n", st.hot, st.rejected);
+    fprintf(f, "  traces %" PRIu64 " (%.1f blocks on average)\n", st.traces,
+            st.traces ? (double) st.trace_blocks / st.traces : 0.0);
+}
@@ -0,0 +1,64 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __EXEC_TBTIER_H__
+
+#define __EXEC_TBTIER_H__
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <cpu/exec.h>
+#include <cpu/tb.h>
+
+#define TB_TRACE_MAX_BLOCKS 8
+
+/* Guest blocks to translate as a single TB, pcs[0] being the TB pc */
+struct tb_trace {
+    unsigned count;
+    target_ulong pcs[TB_TRACE_MAX_BLOCKS];
+};
+
+struct tb_tier_stats {
+    uint64_t hot;          /* TBs that reached the threshold */
+    uint64_t traces;       /* traces translated */
+    uint64_t trace_blocks; /* guest blocks in all traces */
+    uint64_t rejected;     /* hot TBs without a hot successor to form a trace with */
+};
+
+/* Counter decremented by the generated code on each execution of the TB,
+   NULL if the TB must not be profiled */
+int32_t *tb_tier_get_counter(TranslationBlock *tb);
+
+/* Trace being translated by the current thread, if any */
+const struct tb_trace *tb_tier_current_trace(void);
+
+/* Called when the TB exited to the execution loop at its start, forms a trace if it is hot */
+void tb_tier_check(CPUArchState *env, TranslationBlock *tb);
+
+/* Resets the translation state after a longjmp out of the code generator */
+void tb_tier_end_trace(void);
+
+/* Forgets the counters of all TBs, or of an evicted TB */
+void tb_tier_discard(void);
+void tb_tier_forget(TranslationBlock *tb);
+
+void tb_tier_get_stats(struct tb_tier_stats *stats);
+void tb_tier_dump_stats(FILE *f);
+
+#endif
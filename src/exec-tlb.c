@@ -24,28 +24,52 @@
 
 #include "exec-phys.h"
 #include "exec-ram.h"
+#include "exec-tb.h"
 #include "exec-tlb.h"
 #include "exec.h"
+#include "qemu-lock.h"
+#include "timer.h"
 
 /* statistics */
 int g_tlb_flush_count;
+int g_tlb_resize_count;
+int g_tlb_large_page_flush_count;
+int g_tlb_asid_switches;
+int g_tlb_asid_hits;
+int g_tlb_global_keep_count;
 
-static inline void tlb_flush_jmp_cache(CPUArchState *env, target_ulong addr) {
+static inline void tlb_flush_jmp_cache_page(TranslationBlock **jmp_cache, target_ulong addr) {
     unsigned int i;
 
     /* Discard jump cache entries for any tb which might potentially
        overlap the flushed page.  */
     i = tb_jmp_cache_hash_page(addr - TARGET_PAGE_SIZE);
-    memset(&env->tb_jmp_cache[i], 0, TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+    memset(&jmp_cache[i], 0, TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 
     i = tb_jmp_cache_hash_page(addr);
-    memset(&env->tb_jmp_cache[i], 0, TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+    memset(&jmp_cache[i], 0, TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+}
+
+static inline void tlb_flush_jmp_cache(CPUArchState *env, target_ulong addr) {
+#ifdef CONFIG_SYMBEX
+    tlb_flush_jmp_cache_page(env->tb_jmp_cache, addr);
+#else
+    for (int c = 0; c < CPU_TLB_ASIDS; c++) {
+        if (env->tlb_ctx[c].jmp_cache) {
+            tlb_flush_jmp_cache_page(env->tlb_ctx[c].jmp_cache, addr);
+        }
+    }
+#endif
+
+    tb_ras_invalidate(env);
+    tb_page2_flush(addr);
 }
 
 static const CPUTLBEntry s_cputlb_empty_entry = {
     .addr_read = -1,
     .addr_write = -1,
     .addr_code = -1,
+    .addr_global = -1,
     .addend = -1,
 #ifdef CONFIG_SYMBEX
     .objectState = NULL,
@@ -57,21 +81,273 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
  * If flush_global is false, flush (at least) all tlb entries not
  * marked global.
  *
- * Since QEMU doesn't currently implement a global/not-global flag
- * for tlb entries, at the moment tlb_flush() will also flush all
- * tlb entries in the flush_global == false case. This is OK because
- * CPU architectures generally permit an implementation to drop
- * entries from the TLB at any time, so flushing more entries than
- * required is only an efficiency issue, not a correctness issue.
+ * Entries are marked global by tlb_set_page when given PAGE_GLOBAL.
+ * A non-global flush keeps them, along with the jump cache entries of
+ * the TBs whose pages are all global. It still drops them when the TLB
+ * is resized. This is OK because CPU architectures generally permit an
+ * implementation to drop entries from the TLB at any time, so flushing
+ * more entries than required is only an efficiency issue, not a
+ * correctness issue. The symbolic execution engine keeps its own cache
+ * of the TLB, so global entries are flushed as well in that case.
  */
 
+static inline bool tlb_hit_page_anyprot(const CPUTLBEntry *tlb_entry, target_ulong page) {
+    return page == (tlb_entry->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (tlb_entry->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (tlb_entry->addr_code & (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+/* True if the entry maps a page of the large page at base */
+static inline bool tlb_hit_range_anyprot(const CPUTLBEntry *tlb_entry, target_ulong base, target_ulong mask) {
+    mask |= TLB_INVALID_MASK;
+    return base == (tlb_entry->addr_read & mask) || base == (tlb_entry->addr_write & mask) ||
+           base == (tlb_entry->addr_code & mask);
+}
+
+static inline void tlb_drop_entry(CPUArchState *env, int mmu_idx, CPUTLBEntry *table, unsigned index) {
+#if defined(CONFIG_SYMBEX)
+    g_sqi.tlb.flush_tlb_cache_page(table[index].objectState, mmu_idx, index);
+#endif
+    table[index] = s_cputlb_empty_entry;
+}
+
 #ifdef CONFIG_SYMBEX
 int g_se_disable_tlb_flush = 0;
-#endif
 
-void tlb_flush(CPUArchState *env, int flush_global) {
+static void tlb_reset_tables(CPUArchState *env) {
     int i;
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        env->tlb_table[mmu_idx] = &env->_tlb_table[mmu_idx][0];
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+        env->tlb_mask[mmu_idx] = (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS;
+    }
+}
+
+void tlb_init(CPUArchState *env) {
+    tlb_reset_tables(env);
+}
+#else
+/*
+ * The TLB of each MMU mode is resized when it is flushed. It grows if more
+ * than 70% of it was used since the start of the observation window, or if
+ * more valid entries than it holds were evicted since the previous flush. It
+ * shrinks once a whole window went by with less than 30% of it used, so that
+ * the flushes of a short idle phase do not throw away a well sized TLB.
+ */
+#define TLB_DYN_WINDOW_NS (100 * 1000 * 1000)
+
+static void tlb_desc_alloc(CPUTLBDesc *desc, unsigned bits) {
+    desc->bits = bits;
+    desc->table = g_new(CPUTLBEntry, 1 << bits);
+    desc->iotlb = g_new(target_phys_addr_t, 1 << bits);
+}
+
+/* Returns true if the table was reallocated, its content is then undefined */
+static bool tlb_resize(CPUTLBDesc *desc, int64_t now) {
+    unsigned size = 1 << desc->bits;
+    unsigned bits = desc->bits;
+    bool window_expired = now - desc->window_begin > TLB_DYN_WINDOW_NS;
+
+    desc->window_max_used = MAX(desc->window_max_used, desc->used);
+
+    if (desc->window_max_used > size / 10 * 7 || desc->evictions > size) {
+        bits = MIN(bits + 1, CPU_TLB_DYN_MAX_BITS);
+    } else if (window_expired && desc->window_max_used < size / 10 * 3) {
+        bits = MAX(bits - 1, CPU_TLB_DYN_MIN_BITS);
+    }
+
+    if (bits != desc->bits || window_expired) {
+        desc->window_begin = now;
+        desc->window_max_used = 0;
+    }
+
+    if (bits == desc->bits) {
+        return false;
+    }
+
+    g_free(desc->table);
+    g_free(desc->iotlb);
+    tlb_desc_alloc(desc, bits);
+    g_tlb_resize_count++;
+    return true;
+}
+
+/* Invalidates the entries that are not global, returns how many are left */
+static unsigned tlb_keep_global(CPUTLBEntry *table, unsigned size) {
+    unsigned kept = 0;
+
+    for (unsigned i = 0; i < size; i++) {
+        if (table[i].addr_global == -1) {
+            table[i] = s_cputlb_empty_entry;
+        } else {
+            kept++;
+        }
+    }
+
+    return kept;
+}
+
+static void tlb_ctx_alloc(CPUArchState *env, CPUTLBContext *ctx) {
+    CPUTLBDesc *desc = g_new0(CPUTLBDesc, NB_MMU_MODES);
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_desc_alloc(&desc[mmu_idx], CPU_TLB_BITS);
+        memset(desc[mmu_idx].table, -1, sizeof(CPUTLBEntry) << CPU_TLB_BITS);
+        memset(desc[mmu_idx].vtable, -1, sizeof(desc[mmu_idx].vtable));
+        desc[mmu_idx].window_begin = get_clock();
+    }
+
+    /* tlb_reset_dirty_range_all may walk the tables from other threads */
+    spin_lock(&env->tlb_resize_lock);
+    ctx->desc = desc;
+    spin_unlock(&env->tlb_resize_lock);
+
+    /* tlb_jmp_cache_remove may look at it from other threads */
+    atomic_set(&ctx->jmp_cache, g_new0(TranslationBlock *, TB_JMP_CACHE_SIZE));
+}
+
+/* Points the CPU state at the TLB and jump cache of the address space */
+static void tlb_ctx_load(CPUArchState *env, CPUTLBContext *ctx) {
+    int mmu_idx;
+
+    env->tlb_ctx_cur = ctx;
+    env->tlb_desc = ctx->desc;
+    env->tb_jmp_cache = ctx->jmp_cache;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &ctx->desc[mmu_idx];
+
+        env->tlb_table[mmu_idx] = desc->table;
+        env->iotlb[mmu_idx] = desc->iotlb;
+        env->tlb_mask[mmu_idx] = (((uintptr_t) 1 << desc->bits) - 1) << CPU_TLB_ENTRY_BITS;
+    }
+}
+
+/* Flushes the TLB of the current address space, except for the global
+   entries if keep_global is set. Returns true if any of them were kept. */
+static bool tlb_reset_tables(CPUArchState *env, bool resize, bool keep_global) {
+    int64_t now = get_clock();
+    bool kept = false;
+    int mmu_idx;
+
+    spin_lock(&env->tlb_resize_lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+        bool resized = resize && tlb_resize(desc, now);
+
+        desc->evictions = 0;
+
+        if (keep_global && desc->globals && !resized) {
+            desc->used = desc->globals = tlb_keep_global(desc->table, 1 << desc->bits);
+            tlb_keep_global(desc->vtable, CPU_VTLB_SIZE);
+            kept |= desc->globals != 0;
+            continue;
+        }
+
+        desc->used = 0;
+        desc->globals = 0;
+
+        /* all entries invalid */
+        memset(desc->table, -1, sizeof(CPUTLBEntry) << desc->bits);
+        memset(desc->vtable, -1, sizeof(desc->vtable));
+        desc->vindex = 0;
+    }
+    spin_unlock(&env->tlb_resize_lock);
+
+    tlb_ctx_load(env, env->tlb_ctx_cur);
+    return kept;
+}
+
+/* True if the current TLB maps the page with a global entry */
+static bool tlb_page_is_global(CPUArchState *env, target_ulong page) {
+    for (int mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (tlb_entry(env, mmu_idx, page)->addr_global == page) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Drops the jump cache entries of the TBs that are not entirely on global pages */
+static void tlb_jmp_cache_keep_global(CPUArchState *env) {
+    TranslationBlock **jmp_cache = env->tb_jmp_cache;
+
+    for (unsigned i = 0; i < TB_JMP_CACHE_SIZE; i++) {
+        TranslationBlock *tb = atomic_read(&jmp_cache[i]);
+        target_ulong page;
+
+        if (!tb) {
+            continue;
+        }
+
+        page = tb->pc & TARGET_PAGE_MASK;
+        if (!tlb_page_is_global(env, page) ||
+            (tb->page_addr[1] != -1 && !tlb_page_is_global(env, page + TARGET_PAGE_SIZE))) {
+            atomic_set(&jmp_cache[i], NULL);
+        }
+    }
+}
+
+void tlb_init(CPUArchState *env) {
+    int c;
+
+    env->tlb_resize_lock = SPIN_LOCK_UNLOCKED;
+    for (c = 0; c < CPU_TLB_ASIDS; c++) {
+        env->tlb_ctx[c].asid = TLB_ASID_NONE;
+    }
+
+    tlb_ctx_alloc(env, &env->tlb_ctx[0]);
+    env->tlb_ctx[0].asid = 0;
+    tlb_ctx_load(env, &env->tlb_ctx[0]);
+    tlb_reset_tables(env, false, false);
+}
+#endif
+
+/* Index of the current address space in tlb_ctx */
+static inline unsigned tlb_ctx_index(CPUArchState *env) {
+#ifdef CONFIG_SYMBEX
+    return 0;
+#else
+    return env->tlb_ctx_cur - env->tlb_ctx;
+#endif
+}
+
+static void tlb_remove_large_page(CPUArchState *env, unsigned i) {
+    unsigned last = --env->tlb_large_page_count;
+
+    env->tlb_large_page_addr[i] = env->tlb_large_page_addr[last];
+    env->tlb_large_page_mask[i] = env->tlb_large_page_mask[last];
+    env->tlb_large_page_ctxs[i] = env->tlb_large_page_ctxs[last];
+    env->tlb_large_page_global[i] = env->tlb_large_page_global[last];
+}
+
+/* Forgets the large pages whose small pages are no longer in any TLB once
+   the current address space is flushed */
+static void tlb_forget_large_pages(CPUArchState *env, int flush_global) {
+    unsigned ctx = tlb_ctx_index(env);
+    unsigned i = 0;
+
+    while (i < env->tlb_large_page_count) {
+        if (flush_global || !env->tlb_large_page_global[i]) {
+            env->tlb_large_page_ctxs[i] &= ~(1u << ctx);
+        }
 
+        if (env->tlb_large_page_ctxs[i]) {
+            ++i;
+        } else {
+            tlb_remove_large_page(env, i);
+        }
+    }
+}
+
+/* Flushes the TLB and jump cache of the current address space */
+static void tlb_flush_current(CPUArchState *env, int flush_global) {
 #ifdef CONFIG_SYMBEX
     if (g_se_disable_tlb_flush) {
         return;
@@ -85,14 +361,17 @@ void tlb_flush(CPUArchState *env, int flush_global) {
        links while we are modifying them */
     env->current_tb = NULL;
 
-    int mmu_idx;
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        env->tlb_table[mmu_idx] = &env->_tlb_table[mmu_idx][0];
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
-            env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
-        }
-        env->tlb_mask[mmu_idx] = (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS;
+#ifdef CONFIG_SYMBEX
+    tlb_reset_tables(env);
+    memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
+#else
+    if (tlb_reset_tables(env, true, !flush_global)) {
+        tlb_jmp_cache_keep_global(env);
+        g_tlb_global_keep_count++;
+    } else {
+        memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
     }
+#endif
 
 #if defined(CONFIG_SYMBEX) && defined(SE_ENABLE_TLB)
     if (!*g_sqi.mode.single_path_mode) {
@@ -100,49 +379,455 @@ void tlb_flush(CPUArchState *env, int flush_global) {
     }
 #endif
 
+    tb_ras_invalidate(env);
+    tb_page2_flush_all();
+    tlb_forget_large_pages(env, flush_global);
+    g_tlb_flush_count++;
+}
+
+void tlb_flush(CPUArchState *env, int flush_global) {
+    tlb_flush_current(env, flush_global);
+
+#ifdef CONFIG_SYMBEX
+    if (g_se_disable_tlb_flush) {
+        return;
+    }
+#else
+    /* The other address spaces are reset when switched to */
+    if (flush_global) {
+        for (int c = 0; c < CPU_TLB_ASIDS; c++) {
+            if (&env->tlb_ctx[c] != env->tlb_ctx_cur) {
+                env->tlb_ctx[c].asid = TLB_ASID_NONE;
+            }
+        }
+    }
+#endif
+
+    /* The other address spaces are reset before use, none of their large pages are left */
+    if (flush_global) {
+        env->tlb_large_page_count = 0;
+    }
+}
+
+void tlb_switch_asid(CPUArchState *env, unsigned asid, int flush) {
+#ifdef CONFIG_SYMBEX
+    if (asid != env->tlb_asid) {
+        env->tlb_asid = asid;
+        flush = 1;
+    }
+#else
+    CPUTLBContext *ctx = NULL;
+    bool reset = false, stale = false;
+    int c;
+
+    if (asid == env->tlb_ctx_cur->asid) {
+        if (flush) {
+            tlb_flush(env, 0);
+        }
+        return;
+    }
+
+    g_tlb_asid_switches++;
+
+    for (c = 0; c < CPU_TLB_ASIDS; c++) {
+        if (env->tlb_ctx[c].asid == asid) {
+            ctx = &env->tlb_ctx[c];
+            g_tlb_asid_hits++;
+            break;
+        }
+    }
+
+    if (!ctx) {
+        /* Take an unused slot, else a stale one, else the least recently used one */
+        for (c = 0; c < CPU_TLB_ASIDS; c++) {
+            CPUTLBContext *cand = &env->tlb_ctx[c];
+
+            if (cand == env->tlb_ctx_cur) {
+                continue;
+            }
+            if (!cand->desc) {
+                tlb_ctx_alloc(env, cand);
+                ctx = cand;
+                break;
+            }
+            if (!ctx || cand->asid == TLB_ASID_NONE ||
+                (ctx->asid != TLB_ASID_NONE && cand->last_use < ctx->last_use)) {
+                ctx = cand;
+            }
+        }
+
+        /* The global entries of a stale context may predate a global flush */
+        stale = ctx->asid == TLB_ASID_NONE;
+        ctx->asid = asid;
+        reset = true;
+    }
+
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    env->current_tb = NULL;
+
+    ctx->last_use = ++env->tlb_ctx_clock;
+    tlb_ctx_load(env, ctx);
+    tb_ras_invalidate(env);
+    /* The chained jumps into two-page TBs only hold for the address space they were made in */
+    tb_page2_flush_all();
+
+    if (reset) {
+        tlb_flush_current(env, stale);
+        return;
+    }
+#endif
+
+    if (flush) {
+        tlb_flush(env, 0);
+    }
+}
+
+void tlb_flush_asid(CPUArchState *env, unsigned asid) {
+#ifdef CONFIG_SYMBEX
+    if (asid == env->tlb_asid) {
+        tlb_flush(env, 0);
+    }
+#else
+    if (asid == env->tlb_ctx_cur->asid) {
+        tlb_flush(env, 0);
+        return;
+    }
+
+    for (int c = 0; c < CPU_TLB_ASIDS; c++) {
+        if (env->tlb_ctx[c].asid == asid) {
+            env->tlb_ctx[c].asid = TLB_ASID_NONE;
+        }
+    }
+#endif
+}
+
+void tlb_flush_other_asids(CPUArchState *env) {
+#ifndef CONFIG_SYMBEX
+    for (int c = 0; c < CPU_TLB_ASIDS; c++) {
+        if (&env->tlb_ctx[c] != env->tlb_ctx_cur) {
+            env->tlb_ctx[c].asid = TLB_ASID_NONE;
+        }
+    }
+#endif
+}
+
+void tlb_jmp_cache_clear(CPUArchState *env) {
+#ifdef CONFIG_SYMBEX
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
+#else
+    for (int c = 0; c < CPU_TLB_ASIDS; c++) {
+        TranslationBlock **jmp_cache = atomic_read(&env->tlb_ctx[c].jmp_cache);
+        if (jmp_cache) {
+            memset(jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
+        }
+    }
+#endif
+}
 
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
-    g_tlb_flush_count++;
+void tlb_jmp_cache_remove(CPUArchState *env, TranslationBlock *tb) {
+    unsigned int h = tb_jmp_cache_hash_func(tb->pc);
+
+#ifdef CONFIG_SYMBEX
+    if (atomic_read(&env->tb_jmp_cache[h]) == tb) {
+        atomic_set(&env->tb_jmp_cache[h], NULL);
+    }
+#else
+    for (int c = 0; c < CPU_TLB_ASIDS; c++) {
+        TranslationBlock **jmp_cache = atomic_read(&env->tlb_ctx[c].jmp_cache);
+        if (jmp_cache && atomic_read(&jmp_cache[h]) == tb) {
+            atomic_set(&jmp_cache[h], NULL);
+        }
+    }
+#endif
+}
+
+#ifndef CONFIG_SYMBEX
+static void tlb_flush_vtlb_range(CPUTLBDesc *desc, target_ulong base, target_ulong mask) {
+    for (int i = 0; i < CPU_VTLB_SIZE; i++) {
+        if (tlb_hit_range_anyprot(&desc->vtable[i], base, mask)) {
+            desc->vtable[i] = s_cputlb_empty_entry;
+        }
+    }
+}
+
+/* Keeps the entry about to be replaced in the main TLB in the victim TLB */
+static void tlb_evict_to_vtlb(CPUArchState *env, int mmu_idx, unsigned index) {
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+    unsigned vidx = desc->vindex++ % CPU_VTLB_SIZE;
+
+    spin_lock(&env->tlb_resize_lock);
+    desc->vtable[vidx] = env->tlb_table[mmu_idx][index];
+    spin_unlock(&env->tlb_resize_lock);
+    desc->viotlb[vidx] = env->iotlb[mmu_idx][index];
+}
+
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, unsigned index, size_t elt_ofs, target_ulong page) {
+    CPUTLBDesc *desc = &env->tlb_desc[mmu_idx];
+
+    for (int vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *vtlb = &desc->vtable[vidx];
+        target_ulong cmp = *(target_ulong *) ((uintptr_t) vtlb + elt_ofs);
+
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == page) {
+            CPUTLBEntry *tlb = &env->tlb_table[mmu_idx][index];
+            CPUTLBEntry tmp;
+            target_phys_addr_t tmpio;
+
+            /* the dirty tracking of other threads looks at both entries */
+            spin_lock(&env->tlb_resize_lock);
+            tmp = *tlb;
+            *tlb = *vtlb;
+            *vtlb = tmp;
+            spin_unlock(&env->tlb_resize_lock);
+
+            tmpio = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = desc->viotlb[vidx];
+            desc->viotlb[vidx] = tmpio;
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+/* Drops the entries of the TLB of one MMU mode that map pages of the range, returns how many */
+static unsigned tlb_flush_table_range(CPUArchState *env, int mmu_idx, CPUTLBEntry *table, unsigned bits,
+                                      target_ulong base, target_ulong mask) {
+    target_ulong pages = (~mask >> TARGET_PAGE_BITS) + 1;
+    unsigned size = 1 << bits;
+    unsigned dropped = 0;
+
+    if (pages < size) {
+        for (target_ulong page = base; page != base + pages * TARGET_PAGE_SIZE; page += TARGET_PAGE_SIZE) {
+            unsigned i = (page >> TARGET_PAGE_BITS) & (size - 1);
+            if (tlb_hit_page_anyprot(&table[i], page)) {
+                tlb_drop_entry(env, mmu_idx, table, i);
+                dropped++;
+            }
+        }
+    } else {
+        for (unsigned i = 0; i < size; i++) {
+            if (tlb_hit_range_anyprot(&table[i], base, mask)) {
+                tlb_drop_entry(env, mmu_idx, table, i);
+                dropped++;
+            }
+        }
+    }
+
+    return dropped;
+}
+
+#ifndef CONFIG_SYMBEX
+static void tlb_flush_ctx_range(CPUArchState *env, CPUTLBContext *ctx, target_ulong base, target_ulong mask) {
+    for (int mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &ctx->desc[mmu_idx];
+
+        desc->used -= tlb_flush_table_range(env, mmu_idx, desc->table, desc->bits, base, mask);
+        tlb_flush_vtlb_range(desc, base, mask);
+    }
+}
+#endif
+
+static void tlb_flush_range(CPUArchState *env, target_ulong base, target_ulong mask) {
+#ifdef CONFIG_SYMBEX
+    for (int mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_table_range(env, mmu_idx, env->tlb_table[mmu_idx], CPU_TLB_BITS, base, mask);
+    }
+#else
+    /* Global pages are cached in every address space */
+    for (int c = 0; c < CPU_TLB_ASIDS; c++) {
+        if (env->tlb_ctx[c].desc) {
+            tlb_flush_ctx_range(env, &env->tlb_ctx[c], base, mask);
+        }
+    }
+#endif
+}
+
+/* Drops all the small pages of a large page */
+static void tlb_flush_large_page(CPUArchState *env, target_ulong base, target_ulong mask) {
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_large_page: " TARGET_FMT_lx "/" TARGET_FMT_lx "\n", base, mask);
+#endif
+
+    tlb_flush_range(env, base, mask);
+
+    /* The jump cache is hashed by page, clearing it is cheaper than
+       going through all the pages of a large page */
+    tlb_jmp_cache_clear(env);
+    tb_ras_invalidate(env);
+    tb_page2_flush_all();
+
+    g_tlb_large_page_flush_count++;
 }
 
 void tlb_flush_page(CPUArchState *env, target_ulong addr) {
     int i;
-    int mmu_idx;
+    bool large = false;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-#if defined(DEBUG_TLB)
-        printf("tlb_flush_page: forced full flush (" TARGET_FMT_lx "/" TARGET_FMT_lx ")\n", env->tlb_flush_addr,
-               env->tlb_flush_mask);
-#endif
-        tlb_flush(env, 1);
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    env->current_tb = NULL;
+
+    /* Invalidating any part of a large page invalidates all of it */
+    for (i = 0; i < env->tlb_large_page_count;) {
+        target_ulong base = env->tlb_large_page_addr[i];
+        target_ulong mask = env->tlb_large_page_mask[i];
+
+        if ((addr & mask) != base) {
+            ++i;
+            continue;
+        }
+
+        tlb_flush_large_page(env, base, mask);
+        large = true;
+
+        /* forget it, it is no longer in the TLB */
+        tlb_remove_large_page(env, i);
+    }
+
+    if (large) {
         return;
     }
+
+    addr &= TARGET_PAGE_MASK;
+    tlb_flush_range(env, addr, TARGET_PAGE_MASK);
+    tlb_flush_jmp_cache(env, addr);
+}
+
+void tlb_flush_page_asid(CPUArchState *env, unsigned asid, target_ulong addr) {
+#ifdef CONFIG_SYMBEX
+    /* Only the current address space is cached */
+    if (asid == env->tlb_asid) {
+        tlb_flush_page(env, addr);
+    }
+#else
+    CPUTLBContext *ctx = NULL;
+    unsigned c, i;
+
+    for (c = 0; c < CPU_TLB_ASIDS; c++) {
+        if (env->tlb_ctx[c].asid == asid) {
+            ctx = &env->tlb_ctx[c];
+            break;
+        }
+    }
+
+    if (!ctx) {
+        return;
+    }
+
+    /* A large page is dropped as a whole, which is rare enough to not be worth doing for one context */
+    for (i = 0; i < env->tlb_large_page_count; i++) {
+        if ((addr & env->tlb_large_page_mask[i]) == env->tlb_large_page_addr[i] &&
+            (env->tlb_large_page_ctxs[i] & (1u << c))) {
+            if (ctx == env->tlb_ctx_cur) {
+                tlb_flush_page(env, addr);
+            } else {
+                ctx->asid = TLB_ASID_NONE;
+            }
+            return;
+        }
+    }
+
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     env->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        // tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-        CPUTLBEntry *tlb_entry = &env->tlb_table[mmu_idx][i];
-        if (addr == (tlb_entry->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-            addr == (tlb_entry->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-            addr == (tlb_entry->addr_code & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
-#if defined(CONFIG_SYMBEX)
-            g_sqi.tlb.flush_tlb_cache_page(env->tlb_table[mmu_idx][i].objectState, mmu_idx, i);
+    tlb_flush_ctx_range(env, ctx, addr, TARGET_PAGE_MASK);
+    tlb_flush_jmp_cache_page(ctx->jmp_cache, addr);
+
+    /* The predicted returns and two-page jumps of the other contexts were dropped when leaving them */
+    if (ctx == env->tlb_ctx_cur) {
+        tb_ras_invalidate(env);
+        tb_page2_flush(addr);
+    }
+#endif
+}
+
+struct tlb_flush_request {
+    CPUArchState *env;
+    target_ulong addr;
+    int flush_global;
+};
+
+static void tlb_flush_on_cpu(void *data) {
+    struct tlb_flush_request *req = data;
+    tlb_flush(req->env, req->flush_global);
+}
+
+static void tlb_flush_page_on_cpu(void *data) {
+    struct tlb_flush_request *req = data;
+    tlb_flush_page(req->env, req->addr);
+}
+
+/* Flush the TLBs of all vCPUs, each one from its own thread, see run_on_cpu */
+void tlb_flush_all_cpus(int flush_global) {
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        struct tlb_flush_request req = {.env = env, .flush_global = flush_global};
+        run_on_cpu(env, tlb_flush_on_cpu, &req);
+    }
+}
+
+void tlb_flush_page_all_cpus(target_ulong addr) {
+    CPUArchState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        struct tlb_flush_request req = {.env = env, .addr = addr};
+        run_on_cpu(env, tlb_flush_page_on_cpu, &req);
+    }
+}
+
+void tlb_dump_stats(FILE *f) {
+    fprintf(f, "TLB flushes %d resizes %d large page flushes %d\n", g_tlb_flush_count, g_tlb_resize_count,
+            g_tlb_large_page_flush_count);
+    fprintf(f, "  address space switches %d, %d of them to a cached one\n", g_tlb_asid_switches, g_tlb_asid_hits);
+    fprintf(f, "  flushes that kept global pages %d\n", g_tlb_global_keep_count);
+#ifndef CONFIG_SYMBEX
+    for (CPUArchState *env = first_cpu; env != NULL; env = env->next_cpu) {
+        fprintf(f, "  cpu %d:", env->cpu_index);
+        for (int mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            fprintf(f, " %u", 1u << env->tlb_desc[mmu_idx].bits);
+        }
+        fprintf(f, " entries\n");
+    }
 #endif
-            *tlb_entry = s_cputlb_empty_entry;
+}
+
+void tlb_reset_dirty_range_all(CPUArchState *env, unsigned long start, unsigned long length) {
+    int mmu_idx;
+    unsigned i;
+
+#ifdef CONFIG_SYMBEX
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i], start, length);
         }
     }
+#else
+    /* the owner of the TLBs must not resize them under our feet */
+    spin_lock(&env->tlb_resize_lock);
+    for (int c = 0; c < CPU_TLB_ASIDS; c++) {
+        CPUTLBDesc *descs = env->tlb_ctx[c].desc;
 
-    tlb_flush_jmp_cache(env, addr);
+        for (mmu_idx = 0; descs && mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            CPUTLBDesc *desc = &descs[mmu_idx];
+            for (i = 0; i < 1u << desc->bits; i++) {
+                tlb_reset_dirty_range(&desc->table[i], start, length);
+            }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&desc->vtable[i], start, length);
+            }
+        }
+    }
+    spin_unlock(&env->tlb_resize_lock);
+#endif
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -168,8 +853,8 @@ int tlb_is_dirty(CPUArchState *env, target_ulong vaddr) {
     int ret = 1;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = tlb_index(env, mmu_idx, vaddr);
         ret &= tlb_get_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
 
@@ -177,30 +862,47 @@ int tlb_is_dirty(CPUArchState *env, target_ulong vaddr) {
 }
 #endif
 
-/* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
-static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr, target_ulong size) {
+/* The TLB only holds small pages, so remember the large pages they come
+   from in order to drop all of them when one is invalidated */
+static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr, target_ulong size, bool global) {
     target_ulong mask = ~(size - 1);
+    unsigned ctx = 1u << tlb_ctx_index(env);
+    unsigned i;
+
+    for (i = 0; i < env->tlb_large_page_count; i++) {
+        if ((vaddr & env->tlb_large_page_mask[i]) == env->tlb_large_page_addr[i]) {
+            env->tlb_large_page_ctxs[i] |= ctx;
+            env->tlb_large_page_global[i] |= global;
+            return;
+        }
+    }
 
-    if (env->tlb_flush_addr == (target_ulong) -1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
+    if (env->tlb_large_page_count < CPU_TLB_LARGE_PAGES) {
+        i = env->tlb_large_page_count++;
+        env->tlb_large_page_addr[i] = vaddr & mask;
+        env->tlb_large_page_mask[i] = mask;
+        env->tlb_large_page_ctxs[i] = ctx;
+        env->tlb_large_page_global[i] = global;
         return;
     }
-    /* Extend the existing region to include the new page.
-       This is a compromise between unnecessary flushes and the cost
-       of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
+
+    /* No room left, extend the last region to include the new page.
+       Invalidations inside of it drop more pages than needed. */
+    i = CPU_TLB_LARGE_PAGES - 1;
+    mask &= env->tlb_large_page_mask[i];
+    while (((env->tlb_large_page_addr[i] ^ vaddr) & mask) != 0) {
         mask <<= 1;
     }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
+    env->tlb_large_page_addr[i] &= mask;
+    env->tlb_large_page_mask[i] = mask;
+    env->tlb_large_page_ctxs[i] |= ctx;
+    env->tlb_large_page_global[i] |= global;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
    is permitted. Only a single TARGET_PAGE_SIZE region is mapped, the
-   supplied size is only used by tlb_flush_page.  */
+   supplied size is only used by tlb_flush_page. PAGE_GLOBAL in prot
+   keeps the entry across non-global flushes.  */
 void tlb_set_page(CPUArchState *env, target_ulong vaddr, target_phys_addr_t paddr, int prot, int mmu_idx,
                   target_ulong size) {
     unsigned int index;
@@ -208,12 +910,11 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr, target_phys_addr_t padd
     target_ulong code_address;
     unsigned long addend;
     CPUTLBEntry *te;
-    CPUWatchpoint *wp;
     target_phys_addr_t iotlb;
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
-        tlb_add_large_page(env, vaddr, size);
+        tlb_add_large_page(env, vaddr, size, prot & PAGE_GLOBAL);
     }
 
     const MemoryDesc *sreg = mem_desc_find(paddr);
@@ -240,21 +941,37 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr, target_phys_addr_t padd
     code_address = address;
     /* Make accesses to pages with watchpoints go via the
        watchpoint trap routines.  */
-    QTAILQ_FOREACH (wp, &env->watchpoints, entry) {
-        if (vaddr == (wp->vaddr & TARGET_PAGE_MASK)) {
-            /* Avoid trapping reads of pages with a write breakpoint. */
-            if ((prot & PAGE_WRITE) || (wp->flags & BP_MEM_READ)) {
-                iotlb = phys_section_watch + paddr;
-                address |= TLB_MMIO;
-                break;
-            }
+    if (unlikely(!QTAILQ_EMPTY(&env->watchpoints)) && cpu_watchpoint_traps(env, vaddr, prot)) {
+        iotlb = phys_section_watch + paddr;
+        address |= TLB_MMIO;
+    }
+
+    index = tlb_index(env, mmu_idx, vaddr);
+    te = &env->tlb_table[mmu_idx][index];
+#ifndef CONFIG_SYMBEX
+    /* At most one entry for the page, see tlb_victim_hit */
+    tlb_flush_vtlb_range(&env->tlb_desc[mmu_idx], vaddr & TARGET_PAGE_MASK, TARGET_PAGE_MASK);
+
+    if (prot & PAGE_GLOBAL) {
+        /* The jump cache may hold TBs of an earlier mapping of the page,
+           which must not survive the next non-global flush */
+        if (te->addr_global != (vaddr & TARGET_PAGE_MASK)) {
+            tlb_flush_jmp_cache_page(env->tb_jmp_cache, vaddr & TARGET_PAGE_MASK);
         }
+        env->tlb_desc[mmu_idx].globals++;
     }
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    if (te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1) {
+        env->tlb_desc[mmu_idx].used++;
+    } else if (!tlb_hit_page_anyprot(te, vaddr & TARGET_PAGE_MASK)) {
+        env->tlb_desc[mmu_idx].evictions++;
+        tlb_evict_to_vtlb(env, mmu_idx, index);
+    }
+#endif
 
-    te = &env->tlb_table[mmu_idx][index];
+    te->addr_global = (prot & PAGE_GLOBAL) ? vaddr & TARGET_PAGE_MASK : -1;
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
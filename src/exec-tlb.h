@@ -33,29 +33,46 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr) {
 /* update the TLB corresponding to virtual page vaddr
    so that it is no longer dirty */
 static inline void tlb_set_dirty(CPUArchState *env, target_ulong vaddr) {
-    int i;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
-}
-
-static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe) {
-    return (tlbe->addr_write & (TLB_INVALID_MASK | TLB_MMIO | TLB_NOTDIRTY)) == 0;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
+#ifndef CONFIG_SYMBEX
+        for (int i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_set_dirty1(&env->tlb_desc[mmu_idx].vtable[i], vaddr);
+        }
+#endif
+    }
 }
 
+/* The entry may belong to a vCPU running on another thread */
 static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, unsigned long start, unsigned long length) {
+    target_ulong addr_write = atomic_read(&tlb_entry->addr_write);
     unsigned long addr;
-    if (tlb_is_dirty_ram(tlb_entry)) {
-        addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
+
+    if ((addr_write & (TLB_INVALID_MASK | TLB_MMIO | TLB_NOTDIRTY)) == 0) {
+        addr = (addr_write & TARGET_PAGE_MASK) + atomic_read(&tlb_entry->addend);
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            atomic_set(&tlb_entry->addr_write, addr_write | TLB_NOTDIRTY);
         }
     }
 }
 
+/* Sets up the TLB of a new CPU */
+void tlb_init(CPUArchState *env);
+
+/* Marks the entries of the CPU that map the host range as not dirty, from any thread */
+void tlb_reset_dirty_range_all(CPUArchState *env, unsigned long start, unsigned long length);
+
+/* Clear the jump caches of all the address spaces of the CPU, or only drop
+   the TB from them. Other vCPUs may be using the caches. */
+void tlb_jmp_cache_clear(CPUArchState *env);
+void tlb_jmp_cache_remove(CPUArchState *env, TranslationBlock *tb);
+
+/* Flush and resize counts, size of the TLBs of each CPU */
+void tlb_dump_stats(FILE *f);
+
 #ifdef CONFIG_SYMBEX
 int tlb_is_dirty(CPUArchState *env, target_ulong vaddr);
 #endif
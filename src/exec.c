@@ -53,7 +53,8 @@
 /* TB consistency checks only implemented for usermode emulation.  */
 #undef DEBUG_TB_CHECK
 
-CPUArchState *first_cpu, *cpu_single_env;
+CPUArchState *first_cpu;
+LIBCPU_VCPU_LOCAL CPUArchState *cpu_single_env;
 
 #ifdef CONFIG_SYMBEX
 struct se_libcpu_interface_t g_sqi;
@@ -83,8 +84,11 @@ void cpu_exec_init(CPUArchState *env) {
     }
     env->cpu_index = cpu_index;
     env->numa_node = 0;
+    env->ras_gen = 1;
     QTAILQ_INIT(&env->breakpoints);
     QTAILQ_INIT(&env->watchpoints);
+    env->watchpoint_flagged_page = -1;
+    tlb_init(env);
     *penv = env;
 }
 
@@ -103,7 +107,10 @@ void cpu_reset_interrupt(CPUArchState *env, int mask) {
 }
 
 void cpu_exit(CPUArchState *env) {
-    env->exit_request = 1;
+    atomic_set(&env->exit_request, 1);
+    /* the vCPU may be about to check for interrupts */
+    smp_mb();
+    cpu_wait_kick(env);
 }
 
 void cpu_abort(CPUArchState *env, const char *fmt, ...) {
@@ -141,7 +148,6 @@ void cpu_abort(CPUArchState *env, const char *fmt, ...) {
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end, int dirty_flags) {
     CPUArchState *env;
     unsigned long length, start1;
-    int i;
 
     start &= TARGET_PAGE_MASK;
     end = TARGET_PAGE_ALIGN(end);
@@ -161,11 +167,7 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end, int dirty
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        int mmu_idx;
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            for (i = 0; i < CPU_TLB_SIZE; i++)
-                tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i], start1, length);
-        }
+        tlb_reset_dirty_range_all(env, start1, length);
     }
 }
 
@@ -532,8 +534,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr) {
     int mmu_idx, page_index, pd;
     void *p;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code != (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
     }
@@ -14,7 +14,9 @@
 /// You should have received a copy of the GNU Library General Public
 /// License along with this library; if not, see <http://www.gnu.org/licenses/>.
 
+#include <cpu/config.h>
 #include <cpu/ioport.h>
+#include "replay.h"
 
 static struct cpu_io_funcs_t s_io;
 
@@ -24,34 +26,74 @@ void cpu_register_io(const struct cpu_io_funcs_t *f) {
 
 /***********************************************************/
 
+/* The devices do not run when replaying */
+static void io_write(pio_addr_t addr, uint64_t val, unsigned size) {
+    if (unlikely(g_replay_mode == CPU_REPLAY_PLAY)) {
+        return;
+    }
+
+    s_io.io_write(addr, val, size);
+}
+
 void cpu_outb(pio_addr_t addr, uint8_t val) {
-    s_io.io_write(addr, val, 1);
+    io_write(addr, val, 1);
 }
 
 void cpu_outw(pio_addr_t addr, uint16_t val) {
-    s_io.io_write(addr, val, 2);
+    io_write(addr, val, 2);
 }
 
 void cpu_outl(pio_addr_t addr, uint32_t val) {
-    s_io.io_write(addr, val, 4);
+    io_write(addr, val, 4);
+}
+
+/* Reads are inputs of the guest, they come from the log when replaying */
+static uint64_t io_read(pio_addr_t addr, unsigned size) {
+    uint64_t value;
+
+    if (unlikely(replay_enabled()) && replay_play_input(REPLAY_EVENT_PIO, addr, size, &value)) {
+        return value;
+    }
+
+    value = s_io.io_read(addr, size);
+    if (unlikely(replay_enabled())) {
+        replay_record_input(REPLAY_EVENT_PIO, addr, size, value);
+    }
+
+    return value;
 }
 
 uint8_t cpu_inb(pio_addr_t addr) {
-    return s_io.io_read(addr, 1);
+    return io_read(addr, 1);
 }
 
 uint16_t cpu_inw(pio_addr_t addr) {
-    return s_io.io_read(addr, 2);
+    return io_read(addr, 2);
 }
 
 uint32_t cpu_inl(pio_addr_t addr) {
-    return s_io.io_read(addr, 4);
+    return io_read(addr, 4);
 }
 
 uint64_t cpu_mmio_read(target_phys_addr_t addr, unsigned size) {
-    return s_io.mmio_read(addr, size);
+    uint64_t value;
+
+    if (unlikely(replay_enabled()) && replay_play_input(REPLAY_EVENT_MMIO, addr, size, &value)) {
+        return value;
+    }
+
+    value = s_io.mmio_read(addr, size);
+    if (unlikely(replay_enabled())) {
+        replay_record_input(REPLAY_EVENT_MMIO, addr, size, value);
+    }
+
+    return value;
 }
 
 void cpu_mmio_write(target_phys_addr_t addr, uint64_t data, unsigned size) {
+    if (unlikely(g_replay_mode == CPU_REPLAY_PLAY)) {
+        return;
+    }
+
     s_io.mmio_write(addr, data, size);
 }
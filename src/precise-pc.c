@@ -156,25 +156,31 @@ static int tb_find_guest_pc(TranslationBlock *tb, uintptr_t searched_host_pc, ta
         }
         host_pc += decode_sleb128(&p);
         if (host_pc > searched_host_pc) {
-            return 0;
+            return i;
         }
     }
     return -1;
 }
 
 /* The cpu state corresponding to 'searched_pc' is restored.
- * When reset_icount is true, current TB will be interrupted and
- * icount should be recalculated.
+ * The current TB is always abandoned afterwards, so the instructions
+ * that did not execute are given back to the instruction budget.
  */
 static int cpu_restore_state_from_tb(CPUArchState *env, TranslationBlock *tb, uintptr_t searched_pc) {
     target_ulong data[TARGET_INSN_START_WORDS] = {tb->pc};
+    int insn;
 
-    if (tb_find_guest_pc(tb, searched_pc, data) < 0) {
+    insn = tb_find_guest_pc(tb, searched_pc, data);
+    if (insn < 0) {
         return -1;
     }
 
     restore_state_to_opc(env, tb, data);
 
+    if (cpu_get_budget_mode() != CPU_BUDGET_OFF) {
+        env->icount_budget += tb->icount - insn;
+    }
+
     return 0;
 }
 
@@ -0,0 +1,415 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+/*
+ * Record and replay.
+ *
+ * Port and device memory reads, rdtsc and hardware interrupts are the only
+ * inputs of the guest that the CPU does not compute by itself. When recording,
+ * they are appended to a log. When playing, reads and rdtsc take their values
+ * from the log in the same order, without accessing the devices, and the
+ * interrupts are delivered after the same number of instructions.
+ *
+ * Instructions are counted with the instruction budget: when playing, the
+ * budget is set to the distance to the next interrupt of the log, so that the
+ * execution loop gets control back right at that instruction. The whole log
+ * is loaded at once, to know where the next interrupt is while the reads that
+ * precede it are consumed.
+ *
+ * Each entry of the log is its kind followed by its operands, as LEB128.
+ * Interrupts store the number of instructions since the previous interrupt,
+ * rdtsc the difference with the previous value.
+ *
+ * Only the first CPU is recorded. NMIs, SMIs and DMA into guest memory are not
+ * part of the log.
+ */
+
+#include <cpu/config.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "replay.h"
+
+#define REPLAY_MAGIC 0x5252434c /* LCRR */
+#define REPLAY_VERSION 1
+
+/* Largest budget slice, also used while recording */
+#define REPLAY_SLICE (INT32_MAX / 2)
+
+struct replay_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct replay_entry {
+    uint8_t kind;
+    uint8_t size;
+    uint64_t addr;
+    uint64_t value;  /* read value, TSC or interrupt vector */
+    uint64_t icount; /* interrupts and end of the log only */
+};
+
+CPUReplayMode g_replay_mode = CPU_REPLAY_OFF;
+
+static FILE *s_log;
+
+/* Instructions executed before the current budget slice */
+static uint64_t s_icount;
+static int32_t s_slice;
+
+/* The log stores differences with these */
+static uint64_t s_last_icount;
+static uint64_t s_last_tsc;
+
+/* Playing: reads and interrupts of the log, with the next ones to consume */
+static GArray *s_inputs;
+static GArray *s_async;
+static guint s_next_input;
+static guint s_next_async;
+static bool s_stalled;
+
+static uint64_t replay_icount(CPUArchState *env) {
+    return s_icount + (s_slice - env->icount_budget);
+}
+
+static void replay_set_slice(CPUArchState *env, uint64_t insns) {
+    s_icount = replay_icount(env);
+    s_slice = MIN(insns, REPLAY_SLICE);
+    env->icount_budget = s_slice;
+}
+
+static void replay_put(FILE *fp, uint64_t val) {
+    do {
+        int byte = val & 0x7f;
+        val >>= 7;
+        putc(val ? byte | 0x80 : byte, fp);
+    } while (val);
+}
+
+static bool replay_get(FILE *fp, uint64_t *val) {
+    int byte, shift = 0;
+
+    *val = 0;
+    do {
+        byte = getc(fp);
+        if (byte == EOF || shift > 63) {
+            return false;
+        }
+        *val |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return true;
+}
+
+static void replay_write(FILE *fp, const struct replay_entry *e) {
+    int64_t delta;
+
+    putc(e->kind, fp);
+
+    switch (e->kind) {
+        case REPLAY_EVENT_PIO:
+        case REPLAY_EVENT_MMIO:
+            replay_put(fp, e->addr);
+            putc(e->size, fp);
+            replay_put(fp, e->value);
+            break;
+
+        case REPLAY_EVENT_TSC:
+            /* zigzag, the guest may move the TSC backwards */
+            delta = e->value - s_last_tsc;
+            replay_put(fp, ((uint64_t) delta << 1) ^ (uint64_t)(delta >> 63));
+            s_last_tsc = e->value;
+            break;
+
+        case REPLAY_EVENT_INTERRUPT:
+        case REPLAY_EVENT_END:
+            replay_put(fp, e->icount - s_last_icount);
+            replay_put(fp, e->value);
+            s_last_icount = e->icount;
+            break;
+    }
+}
+
+static bool replay_read(FILE *fp, struct replay_entry *e) {
+    uint64_t val;
+    int kind, size;
+
+    memset(e, 0, sizeof(*e));
+
+    kind = getc(fp);
+    if (kind == EOF) {
+        return false;
+    }
+    e->kind = kind;
+
+    switch (kind) {
+        case REPLAY_EVENT_PIO:
+        case REPLAY_EVENT_MMIO:
+            if (!replay_get(fp, &e->addr) || (size = getc(fp)) == EOF || !replay_get(fp, &e->value)) {
+                return false;
+            }
+            e->size = size;
+            return true;
+
+        case REPLAY_EVENT_TSC:
+            if (!replay_get(fp, &val)) {
+                return false;
+            }
+            s_last_tsc += (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+            e->value = s_last_tsc;
+            return true;
+
+        case REPLAY_EVENT_INTERRUPT:
+        case REPLAY_EVENT_END:
+            if (!replay_get(fp, &val) || !replay_get(fp, &e->value)) {
+                return false;
+            }
+            s_last_icount += val;
+            e->icount = s_last_icount;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static int replay_load(const char *path) {
+    struct replay_header header;
+    struct replay_entry e;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != REPLAY_MAGIC ||
+        header.version != REPLAY_VERSION) {
+        fclose(fp);
+        return -1;
+    }
+
+    s_inputs = g_array_new(FALSE, FALSE, sizeof(struct replay_entry));
+    s_async = g_array_new(FALSE, FALSE, sizeof(struct replay_entry));
+
+    while (replay_read(fp, &e)) {
+        if (e.kind == REPLAY_EVENT_INTERRUPT || e.kind == REPLAY_EVENT_END) {
+            g_array_append_val(s_async, e);
+        } else {
+            g_array_append_val(s_inputs, e);
+        }
+
+        if (e.kind == REPLAY_EVENT_END) {
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    /* a truncated log ends after its last interrupt */
+    if (!s_async->len || g_array_index(s_async, struct replay_entry, s_async->len - 1).kind != REPLAY_EVENT_END) {
+        e.kind = REPLAY_EVENT_END;
+        e.icount = s_last_icount;
+        g_array_append_val(s_async, e);
+    }
+
+    return 0;
+}
+
+static const struct replay_entry *replay_next_async(void) {
+    return &g_array_index(s_async, struct replay_entry, s_next_async);
+}
+
+int cpu_replay_start(CPUReplayMode mode, const char *path) {
+    CPUArchState *env = first_cpu;
+
+    if (g_replay_mode != CPU_REPLAY_OFF) {
+        return -1;
+    }
+
+    /* the inputs of several vCPUs would be logged in no particular order */
+    if (env->next_cpu) {
+        return -1;
+    }
+
+    s_last_icount = 0;
+    s_last_tsc = 0;
+
+    if (mode == CPU_REPLAY_RECORD) {
+        struct replay_header header = {.magic = REPLAY_MAGIC, .version = REPLAY_VERSION};
+
+        s_log = fopen(path, "wb");
+        if (!s_log || fwrite(&header, sizeof(header), 1, s_log) != 1) {
+            if (s_log) {
+                fclose(s_log);
+                s_log = NULL;
+            }
+            return -1;
+        }
+    } else if (mode == CPU_REPLAY_PLAY) {
+        if (replay_load(path) < 0) {
+            return -1;
+        }
+        s_next_input = 0;
+        s_next_async = 0;
+        s_stalled = false;
+    } else {
+        return 0;
+    }
+
+    cpu_set_budget_mode(CPU_BUDGET_INSNS);
+
+    s_icount = 0;
+    s_slice = 0;
+    env->icount_budget = 0;
+
+    g_replay_mode = mode;
+    replay_set_slice(env, mode == CPU_REPLAY_PLAY ? replay_next_async()->icount : REPLAY_SLICE);
+
+    return 0;
+}
+
+void cpu_replay_stop(void) {
+    CPUArchState *env = first_cpu;
+
+    if (g_replay_mode == CPU_REPLAY_RECORD) {
+        struct replay_entry e = {.kind = REPLAY_EVENT_END, .icount = replay_icount(env)};
+
+        replay_write(s_log, &e);
+        fclose(s_log);
+        s_log = NULL;
+    } else if (g_replay_mode == CPU_REPLAY_PLAY) {
+        g_array_free(s_inputs, TRUE);
+        g_array_free(s_async, TRUE);
+        s_inputs = NULL;
+        s_async = NULL;
+    } else {
+        return;
+    }
+
+    g_replay_mode = CPU_REPLAY_OFF;
+    cpu_set_budget_mode(CPU_BUDGET_OFF);
+}
+
+CPUReplayMode cpu_replay_get_mode(void) {
+    return g_replay_mode;
+}
+
+bool replay_play_input(enum replay_event kind, uint64_t addr, unsigned size, uint64_t *value) {
+    const struct replay_entry *e;
+
+    if (g_replay_mode != CPU_REPLAY_PLAY) {
+        return false;
+    }
+
+    if (s_next_input >= s_inputs->len) {
+        cpu_abort(first_cpu, "replay: the log has no more inputs\n");
+    }
+
+    e = &g_array_index(s_inputs, struct replay_entry, s_next_input);
+    if (e->kind != kind || e->addr != addr || e->size != size) {
+        cpu_abort(first_cpu, "replay: execution diverged at input %u\n", s_next_input);
+    }
+
+    ++s_next_input;
+    *value = e->value;
+    return true;
+}
+
+void replay_record_input(enum replay_event kind, uint64_t addr, unsigned size, uint64_t value) {
+    struct replay_entry e = {.kind = kind, .size = size, .addr = addr, .value = value};
+
+    if (g_replay_mode != CPU_REPLAY_RECORD) {
+        return;
+    }
+
+    replay_write(s_log, &e);
+}
+
+void replay_sync_interrupts(CPUArchState *env) {
+    const struct replay_entry *next;
+
+    if (g_replay_mode != CPU_REPLAY_PLAY) {
+        return;
+    }
+
+    /* the devices do not run, only the log requests interrupts */
+    env->interrupt_request &= ~CPU_INTERRUPT_HARD;
+
+    next = replay_next_async();
+    if (next->kind == REPLAY_EVENT_INTERRUPT && next->icount == replay_icount(env)) {
+        env->interrupt_request |= CPU_INTERRUPT_HARD;
+        env->kvm_irq = next->value;
+    }
+}
+
+void replay_interrupt(CPUArchState *env, int intno) {
+    const struct replay_entry *next;
+
+    if (g_replay_mode == CPU_REPLAY_RECORD) {
+        struct replay_entry e = {.kind = REPLAY_EVENT_INTERRUPT, .value = intno, .icount = replay_icount(env)};
+        replay_write(s_log, &e);
+        return;
+    }
+
+    if (g_replay_mode != CPU_REPLAY_PLAY) {
+        return;
+    }
+
+    next = replay_next_async();
+    if (next->kind != REPLAY_EVENT_INTERRUPT || (int) next->value != intno || next->icount != replay_icount(env)) {
+        cpu_abort(env, "replay: execution diverged at interrupt %u\n", s_next_async);
+    }
+
+    ++s_next_async;
+    s_stalled = false;
+
+    next = replay_next_async();
+    replay_set_slice(env, next->icount - replay_icount(env));
+}
+
+bool replay_budget_spent(CPUArchState *env) {
+    const struct replay_entry *next;
+    uint64_t icount = replay_icount(env);
+
+    if (g_replay_mode == CPU_REPLAY_RECORD) {
+        replay_set_slice(env, REPLAY_SLICE);
+        return true;
+    }
+
+    next = replay_next_async();
+    if (next->icount > icount) {
+        /* the slice was capped */
+        replay_set_slice(env, next->icount - icount);
+        return true;
+    }
+
+    if (next->kind == REPLAY_EVENT_END) {
+        return false;
+    }
+
+    /* The interrupt is due, the execution loop delivers it */
+    if (s_stalled) {
+        cpu_abort(env, "replay: interrupt %u could not be delivered\n", s_next_async);
+    }
+    s_stalled = true;
+    return true;
+}
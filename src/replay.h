@@ -0,0 +1,60 @@
+/// Copyright (C) 2003  Fabrice Bellard
+/// Copyright (C) 2010  Dependable Systems Laboratory, EPFL
+/// Copyright (C) 2016-2019  Cyberhaven
+/// Copyrights of all contributions belong to their respective owners.
+///
+/// This library is free software; you can redistribute it and/or
+/// modify it under the terms of the GNU Library General Public
+/// License as published by the Free Software Foundation; either
+/// version 2 of the License, or (at your option) any later version.
+///
+/// This library is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+/// Library General Public License for more details.
+///
+/// You should have received a copy of the GNU Library General Public
+/// License along with this library; if not, see <http://www.gnu.org/licenses/>.
+
+#ifndef __REPLAY_H__
+
+#define __REPLAY_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include <cpu/exec.h>
+
+/* Inputs of the guest, in the order they appear in the log */
+enum replay_event {
+    REPLAY_EVENT_PIO,       /* port read: address, size, value */
+    REPLAY_EVENT_MMIO,      /* device memory read: address, size, value */
+    REPLAY_EVENT_TSC,       /* rdtsc: value */
+    REPLAY_EVENT_INTERRUPT, /* hardware interrupt: vector */
+    REPLAY_EVENT_END        /* end of the recording */
+};
+
+extern CPUReplayMode g_replay_mode;
+
+static inline bool replay_enabled(void) {
+    return g_replay_mode != CPU_REPLAY_OFF;
+}
+
+/* Returns true and the logged value when playing, the device must not be accessed then */
+bool replay_play_input(enum replay_event kind, uint64_t addr, unsigned size, uint64_t *value);
+
+/* Logs a value read from a device when recording */
+void replay_record_input(enum replay_event kind, uint64_t addr, unsigned size, uint64_t value);
+
+/* Called by the execution loop before looking at the interrupt requests. When playing,
+   the hardware interrupt request is only set when the log has an interrupt at this point. */
+void replay_sync_interrupts(CPUArchState *env);
+
+/* The hardware interrupt intno was delivered */
+void replay_interrupt(CPUArchState *env, int intno);
+
+/* Called when the instruction budget is spent. Returns false if cpu_exec must return
+   EXCP_BUDGET, true if the execution loop must process interrupts and go on. */
+bool replay_budget_spent(CPUArchState *env);
+
+#endif
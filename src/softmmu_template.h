@@ -95,6 +95,9 @@
     (*g_sqi.mode.fork_on_symbolic_address ? INSTR_FORK_AND_CONCRETIZE(val, max) : val)
 
 #define SE_RAM_OBJECT_DIFF (TARGET_PAGE_BITS - SE_RAM_OBJECT_BITS)
+
+/* The engine keeps its own state for each entry of the main TLB */
+#define VICTIM_TLB_HIT(ty, addr) false
 // clang-format on
 #else // CONFIG_SYMBEX
 
@@ -110,6 +113,9 @@
 
 #define SE_SET_MEM_IO_VADDR(env, addr, reset) env->mem_io_vaddr = addr;
 
+#define VICTIM_TLB_HIT(ty, addr) \
+    tlb_victim_hit(env, mmu_idx, index, offsetof(CPUTLBEntry, ty), (addr) & TARGET_PAGE_MASK)
+
 #endif // CONFIG_SYMBEX
 
 static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulong addr, int mmu_idx,
@@ -263,7 +269,7 @@ glue(glue(glue(HELPER_PREFIX, ld), SUFFIX), MMUSUFFIX)(CPUArchState *env, target
     object_index = INSTR_FORK_AND_CONCRETIZE(addr >> SE_RAM_OBJECT_BITS, ADDR_MAX >> SE_RAM_OBJECT_BITS);
     index = (object_index >> SE_RAM_OBJECT_DIFF) & (CPU_TLB_SIZE - 1);
 #else
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, addr);
     object_index = index;
 #endif
 
@@ -311,7 +317,9 @@ redo:
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, object_index << SE_RAM_OBJECT_BITS, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!VICTIM_TLB_HIT(ADDR_READ, addr)) {
+            tlb_fill(env, addr, object_index << SE_RAM_OBJECT_BITS, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
 
@@ -331,7 +339,11 @@ static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env, targe
     INSTR_BEFORE_MEMORY_ACCESS(addr, 0, 0);
     addr = INSTR_FORK_AND_CONCRETIZE_ADDR(addr, ADDR_MAX);
     object_index = INSTR_FORK_AND_CONCRETIZE(addr >> SE_RAM_OBJECT_BITS, ADDR_MAX >> SE_RAM_OBJECT_BITS);
+#ifdef CONFIG_SYMBEX
     index = (object_index >> SE_RAM_OBJECT_DIFF) & (CPU_TLB_SIZE - 1);
+#else
+    index = tlb_index(env, mmu_idx, addr);
+#endif
 redo:
     tlb_entry = &env->tlb_table[mmu_idx][index];
     tlb_addr = tlb_entry->ADDR_READ & ~TLB_MEM_TRACE;
@@ -375,7 +387,9 @@ redo:
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, object_index << SE_RAM_OBJECT_BITS, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!VICTIM_TLB_HIT(ADDR_READ, addr)) {
+            tlb_fill(env, addr, object_index << SE_RAM_OBJECT_BITS, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -508,7 +522,7 @@ void glue(glue(glue(HELPER_PREFIX, st), SUFFIX), MMUSUFFIX)(CPUArchState *env, t
     object_index = INSTR_FORK_AND_CONCRETIZE(addr >> SE_RAM_OBJECT_BITS, ADDR_MAX >> SE_RAM_OBJECT_BITS);
     index = (object_index >> SE_RAM_OBJECT_DIFF) & (CPU_TLB_SIZE - 1);
 #else
-    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, addr);
     object_index = index;
 #endif
 
@@ -560,7 +574,9 @@ redo:
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, object_index << SE_RAM_OBJECT_BITS, 1, mmu_idx, retaddr);
+        if (!VICTIM_TLB_HIT(addr_write, addr)) {
+            tlb_fill(env, addr, object_index << SE_RAM_OBJECT_BITS, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
@@ -578,7 +594,11 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulo
     INSTR_BEFORE_MEMORY_ACCESS(addr, val, 1);
     addr = INSTR_FORK_AND_CONCRETIZE_ADDR(addr, ADDR_MAX);
     object_index = INSTR_FORK_AND_CONCRETIZE(addr >> SE_RAM_OBJECT_BITS, ADDR_MAX >> SE_RAM_OBJECT_BITS);
+#ifdef CONFIG_SYMBEX
     index = (object_index >> SE_RAM_OBJECT_DIFF) & (CPU_TLB_SIZE - 1);
+#else
+    index = tlb_index(env, mmu_idx, addr);
+#endif
 redo:
     tlb_entry = &env->tlb_table[mmu_idx][index];
     tlb_addr = tlb_entry->addr_write & ~TLB_MEM_TRACE;
@@ -620,7 +640,9 @@ redo:
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, object_index << SE_RAM_OBJECT_BITS, 1, mmu_idx, retaddr);
+        if (!VICTIM_TLB_HIT(addr_write, addr)) {
+            tlb_fill(env, addr, object_index << SE_RAM_OBJECT_BITS, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
@@ -73,7 +73,7 @@
 #endif
 
 /* fwd decl to make compiler happy */
-extern struct CPUX86State *env;
+extern LIBCPU_VCPU_LOCAL struct CPUX86State *env;
 
 /* Macros to access registers */
 static inline target_ulong __RR_env_raw(CPUX86State *cpuState, unsigned offset, unsigned size) {
@@ -462,6 +462,9 @@ static inline void cpu_get_tb_cpu_state(CPUX86State *env, target_ulong *pc, targ
     *cs_base = env->segs[R_CS].base;
     *pc = *cs_base + env->eip;
     *flags = env->hflags | (env->mflags & (IOPL_MASK | TF_MASK | RF_MASK | VM_MASK));
+    if (unlikely(env->singlestep_enabled)) {
+        *flags |= HF_SSTEP_MASK;
+    }
 }
 
 /* op_helper.c */
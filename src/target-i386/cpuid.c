@@ -84,7 +84,7 @@ static const char *ext_feature_name[] = {
     "xtpr",
     "pdcm",
     "s2e",
-    NULL,
+    "pcid",
     "dca",
     "sse4.1|sse4_1",
     "sse4.2|sse4_2",
@@ -318,8 +318,8 @@ CPUID_MTRR, CPUID_MCA, CPUID_CLFLUSH (needed for Win64)
 CPUID_PSE36 (needed for Solaris) */
 /* missing:
 CPUID_VME, CPUID_DTS, CPUID_SS, CPUID_HT, CPUID_TM, CPUID_PBE */
-static const uint32_t TCG_EXT_FEATURES =
-    (CPUID_EXT_SSE3 | CPUID_EXT_MONITOR | CPUID_EXT_CX16 | CPUID_EXT_POPCNT | CPUID_EXT_HYPERVISOR | CPUID_EXT_S2E);
+static const uint32_t TCG_EXT_FEATURES = (CPUID_EXT_SSE3 | CPUID_EXT_MONITOR | CPUID_EXT_CX16 | CPUID_EXT_POPCNT |
+                                          CPUID_EXT_HYPERVISOR | CPUID_EXT_S2E | CPUID_EXT_PCID);
 
 /* missing:
 CPUID_EXT_DTES64, CPUID_EXT_DSCPL, CPUID_EXT_VMX, CPUID_EXT_EST,
@@ -366,7 +366,7 @@ static x86_def_t builtin_x86_defs[] = {
         .model = 2,
         .stepping = 3,
         .features = PPRO_FEATURES | CPUID_MTRR | CPUID_CLFLUSH | CPUID_MCA | CPUID_PSE36,
-        .ext_features = CPUID_EXT_SSE3 | CPUID_EXT_CX16 | CPUID_EXT_POPCNT,
+        .ext_features = CPUID_EXT_SSE3 | CPUID_EXT_CX16 | CPUID_EXT_POPCNT | CPUID_EXT_PCID,
         .ext2_features = (PPRO_FEATURES & EXT2_FEATURE_MASK) | CPUID_EXT2_LM | CPUID_EXT2_SYSCALL | CPUID_EXT2_NX,
         .ext3_features = CPUID_EXT3_LAHF_LM | CPUID_EXT3_SVM | CPUID_EXT3_ABM | CPUID_EXT3_SSE4A,
         .xlevel = 0x8000000A,
@@ -756,6 +756,12 @@ int cpu_x86_register(cpuid_t *cpuid, const char *cpu_model, int is64) {
     cpuid->cpuid_ext3_features &= TCG_EXT3_FEATURES;
     cpuid->cpuid_svm_features &= TCG_SVM_FEATURES;
 
+    /* INVPCID comes with PCID, on models that have leaf 7 */
+    cpuid->cpuid_7_0_ebx_features = 0;
+    if (cpuid->cpuid_level >= 7 && (cpuid->cpuid_ext_features & CPUID_EXT_PCID)) {
+        cpuid->cpuid_7_0_ebx_features |= CPUID_7_0_EBX_INVPCID;
+    }
+
     x86_cpuid_set_model_id(cpuid, def->model_id);
     return 0;
 }
@@ -878,8 +884,9 @@ void cpu_x86_cpuid(cpuid_t *cpuid, uint32_t index, uint32_t count, uint32_t *eax
             *edx = 0;
             break;
         case 7:
+            /* Structured Extended Feature Flags */
             *eax = 0;
-            *ebx = 0;
+            *ebx = count == 0 ? cpuid->cpuid_7_0_ebx_features : 0;
             *ecx = 0;
             *edx = 0;
             break;
@@ -465,6 +465,12 @@ void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0) {
         env->efer &= ~MSR_EFER_LMA;
         env->hflags &= ~(HF_LMA_MASK | HF_CS64_MASK);
         env->eip &= 0xffffffff;
+        /* helper_write_crN rejects this with PCIDs enabled, other
+           callers such as SMM entry load a state without them */
+        if (env->cr[4] & CR4_PCIDE_MASK) {
+            env->cr[4] &= ~CR4_PCIDE_MASK;
+            tlb_switch_asid(env, 0, 1);
+        }
     }
 #endif
     env->cr[0] = new_cr0 | CR0_ET_MASK;
@@ -479,9 +485,24 @@ void cpu_x86_update_cr0(CPUX86State *env, uint32_t new_cr0) {
                   ((new_cr0 << (HF_MP_SHIFT - 1)) & (HF_MP_MASK | HF_EM_MASK | HF_TS_MASK));
 }
 
+/* Address space of the TLB entries, the PCID when enabled */
+static unsigned x86_tlb_asid(CPUX86State *env) {
+    return (env->cr[4] & CR4_PCIDE_MASK) ? env->cr[3] & 0xfff : 0;
+}
+
 /* XXX: in legacy PAE mode, generate a GPF if reserved bits are set in
    the PDPT */
 void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3) {
+    int flush = 1;
+
+#ifdef TARGET_X86_64
+    /* bit 63 asks to keep the entries of the new PCID, it is not stored */
+    if (env->cr[4] & CR4_PCIDE_MASK) {
+        flush = !(new_cr3 & (1ULL << 63));
+        new_cr3 &= ~(1ULL << 63);
+    }
+#endif
+
 #ifdef CONFIG_SYMBEX
     if (unlikely(*g_sqi.events.on_page_directory_change_signals_count)) {
         g_sqi.events.on_page_directory_change(env->cr[3], new_cr3);
@@ -493,16 +514,22 @@ void cpu_x86_update_cr3(CPUX86State *env, target_ulong new_cr3) {
 #if defined(DEBUG_MMU)
         printf("CR3 update: CR3=" TARGET_FMT_lx "\n", new_cr3);
 #endif
-        tlb_flush(env, 0);
+        tlb_switch_asid(env, x86_tlb_asid(env), flush);
     }
 }
 
 void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4) {
+    int pcide_changed;
+
 #if defined(DEBUG_MMU)
     printf("CR4 update: CR4=%08x\n", (uint32_t) env->cr[4]);
 #endif
-    if ((new_cr4 & (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK)) !=
-        (env->cr[4] & (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK))) {
+    /* PCIDs are only available in long mode. helper_write_crN raises #GP
+       instead, this only catches the states loaded by SMM and SVM. */
+    if (!(env->cpuid.cpuid_ext_features & CPUID_EXT_PCID) || !(env->hflags & HF_LMA_MASK))
+        new_cr4 &= ~CR4_PCIDE_MASK;
+    if ((new_cr4 & (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK | CR4_PCIDE_MASK)) !=
+        (env->cr[4] & (CR4_PGE_MASK | CR4_PAE_MASK | CR4_PSE_MASK | CR4_PCIDE_MASK))) {
         tlb_flush(env, 1);
     }
     /* SSE handling */
@@ -513,7 +540,12 @@ void cpu_x86_update_cr4(CPUX86State *env, uint32_t new_cr4) {
     else
         env->hflags &= ~HF_OSFXSR_MASK;
 
+    pcide_changed = (new_cr4 ^ env->cr[4]) & CR4_PCIDE_MASK;
     env->cr[4] = new_cr4;
+
+    if (pcide_changed) {
+        tlb_switch_asid(env, x86_tlb_asid(env), 1);
+    }
 }
 
 /* XXX: This value should match the one returned by CPUID
@@ -771,6 +803,8 @@ int cpu_x86_handle_mmu_fault(CPUX86State *env, target_ulong addr, int is_write1,
                 prot |= PAGE_WRITE;
         }
     }
+    if ((pte & PG_GLOBAL_MASK) && (env->cr[4] & CR4_PGE_MASK))
+        prot |= PAGE_GLOBAL;
 do_mapping:
     pte = pte & env->a20_mask;
 
@@ -1048,7 +1082,7 @@ CPUX86State *cpu_x86_init(const cpuid_t *cpuid) {
 }
 
 void do_cpu_init(CPUX86State *env1) {
-    extern CPUX86State *env;
+    extern LIBCPU_VCPU_LOCAL CPUX86State *env;
     env = env1;
     int sipi = env->interrupt_request & CPU_INTERRUPT_SIPI;
     uint64_t pat = env->pat;
@@ -25,12 +25,14 @@
 #include <tcg/tcg-op.h>
 
 #include <tcg/utils/host-utils.h>
+#include "exec-tbspec.h"
 #include "libcpu-log.h"
+#include "replay.h"
 
 #include "softmmu_exec.h"
 
 // SYMBEX: Keep the environment in a variable
-struct CPUX86State *env = 0;
+LIBCPU_VCPU_LOCAL struct CPUX86State *env = 0;
 
 #if defined(CONFIG_SYMBEX) && !defined(SYMBEX_LLVM_LIB)
 #include <cpu/softmmu_defs.h>
@@ -236,26 +238,107 @@ extern const uint8_t rclb_table[32];
 #define floatx80_l2e make_floatx80(0x3fff, 0xb8aa3b295c17f0bcLL)
 #define floatx80_l2t make_floatx80(0x4000, 0xd49a784bcd1b8afeLL)
 
-/* broken thread support */
 #if !defined(SYMBEX_LLVM_LIB) || defined(STATIC_TRANSLATOR)
-// static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
+#if !defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+/* Other vCPUs may access memory while this one executes */
+static inline bool lock_is_parallel(void) {
+    return first_cpu->next_cpu && !env->lock_step;
+}
 
-/**
- * XXX: don't use any locking at all, it's broken.
- * Locked memory accesses can exit the cpu loop, so the
- * unlock will never get done.
- * We don't need locking on single cpu anyway.
+/* Host address of a naturally aligned write to plain RAM, NULL if the
+   write needs the slow path (MMIO, dirty tracking, code pages, tracing) */
+static void *lock_host_addr(target_ulong addr, int size, int mmu_idx, void *retaddr) {
+    unsigned index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *tlb_entry = &env->tlb_table[mmu_idx][index];
+
+    if (addr & (size - 1)) {
+        return NULL;
+    }
+
+    if ((addr & TARGET_PAGE_MASK) != (tlb_entry->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) &&
+        !tlb_victim_hit(env, mmu_idx, index, offsetof(CPUTLBEntry, addr_write), addr & TARGET_PAGE_MASK)) {
+        tlb_fill(env, addr, addr & TARGET_PAGE_MASK, 1, mmu_idx, retaddr);
+    }
+
+    if (tlb_entry->addr_write != (addr & TARGET_PAGE_MASK)) {
+        return NULL;
+    }
+
+    return (void *) (uintptr_t)(addr + tlb_entry->addend);
+}
+
+/* Executes the current instruction again with the other vCPUs stopped */
+static void LIBCPU_NORETURN lock_step_exclusive(uintptr_t retaddr) {
+    env->lock_step = 1;
+    cpu_loop_exit_restore(env, retaddr);
+}
+#endif
+
+/*
+ * Commits the store of a LOCK-prefixed read-modify-write instruction, see
+ * gen_op_st_rmw. The store only happens if the memory still holds the value
+ * that the instruction loaded. Otherwise, another vCPU wrote it in between
+ * and the instruction is executed again.
  */
 void helper_lock(void) {
-#ifndef STATIC_TRANSLATOR
-// spin_lock(&global_cpu_lock);
+#if !defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+    uintptr_t retaddr = GETPC();
+    target_ulong addr = env->lock_addr;
+    int size = env->lock_op & 3;
+    int mmu_idx = (env->lock_op >> 2) - 1;
+    void *host;
+    bool done;
+
+    host = lock_host_addr(addr, 1 << size, mmu_idx, (void *) retaddr);
+    if (host) {
+        switch (size) {
+            case 0:
+                done = atomic_cmpxchg((uint8_t *) host, (uint8_t) env->lock_old, (uint8_t) env->lock_val) ==
+                       (uint8_t) env->lock_old;
+                break;
+            case 1:
+                done = atomic_cmpxchg((uint16_t *) host, (uint16_t) env->lock_old, (uint16_t) env->lock_val) ==
+                       (uint16_t) env->lock_old;
+                break;
+            case 2:
+                done = atomic_cmpxchg((uint32_t *) host, (uint32_t) env->lock_old, (uint32_t) env->lock_val) ==
+                       (uint32_t) env->lock_old;
+                break;
+            default:
+                done = atomic_cmpxchg((uint64_t *) host, (uint64_t) env->lock_old, (uint64_t) env->lock_val) ==
+                       (uint64_t) env->lock_old;
+                break;
+        }
+
+        if (!done) {
+            cpu_loop_exit_restore(env, retaddr);
+        }
+        return;
+    }
+
+    if (lock_is_parallel()) {
+        lock_step_exclusive(retaddr);
+    }
+
+    switch (size) {
+        case 0:
+            helper_stb_mmu(env, addr, env->lock_val, mmu_idx, (void *) retaddr);
+            break;
+        case 1:
+            helper_stw_mmu(env, addr, env->lock_val, mmu_idx, (void *) retaddr);
+            break;
+        case 2:
+            helper_stl_mmu(env, addr, env->lock_val, mmu_idx, (void *) retaddr);
+            break;
+        default:
+            helper_stq_mmu(env, addr, env->lock_val, mmu_idx, (void *) retaddr);
+            break;
+    }
 #endif
 }
 
+/* Locked instructions are committed by helper_lock */
 void helper_unlock(void) {
-#ifndef STATIC_TRANSLATOR
-// spin_unlock(&global_cpu_lock);
-#endif
 }
 #endif /* SYMBEX_LLVM_LIB */
 
@@ -2145,6 +2228,29 @@ void helper_cmpxchg8b(target_ulong a0) {
     int eflags;
 
     eflags = helper_cc_compute_all(CC_OP);
+
+#if !defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+    if (lock_is_parallel()) {
+        uint64_t expected = ((uint64_t) EDX << 32) | (uint32_t) EAX;
+        uint64_t *host = lock_host_addr(a0, 8, cpu_mmu_index(env), (void *) GETPC());
+
+        if (!host) {
+            lock_step_exclusive(GETPC());
+        }
+
+        d = atomic_cmpxchg(host, expected, ((uint64_t) ECX << 32) | (uint32_t) EBX);
+        if (d == expected) {
+            eflags |= CC_Z;
+        } else {
+            EDX_W((uint32_t)(d >> 32));
+            EAX_W((uint32_t) d);
+            eflags &= ~CC_Z;
+        }
+        CC_SRC_W(eflags);
+        return;
+    }
+#endif
+
     d = ldq(a0);
     if (d == (((uint64_t) EDX << 32) | (uint32_t) EAX)) {
         stq(a0, ((uint64_t) ECX << 32) | (uint32_t) EBX);
@@ -2166,6 +2272,12 @@ void helper_cmpxchg16b(target_ulong a0) {
 
     if ((a0 & 0xf) != 0)
         raise_exception_ra(env, EXCP0D_GPF, GETPC());
+#if !defined(CONFIG_SYMBEX) && !defined(STATIC_TRANSLATOR)
+    /* no portable 16-byte compare-and-swap on the host */
+    if (lock_is_parallel()) {
+        lock_step_exclusive(GETPC());
+    }
+#endif
     eflags = helper_cc_compute_all(CC_OP);
     d0 = ldq(a0);
     d1 = ldq(a0 + 8);
@@ -3157,16 +3269,71 @@ target_ulong helper_read_crN(int reg) {
     return val;
 }
 
+/* Invalidates the TLB entries selected by the type and the descriptor at env->invpcid_desc */
+static void helper_invpcid(target_ulong type, uintptr_t retaddr) {
+    target_ulong desc = env->invpcid_desc;
+    uint64_t pcid = ldq(desc);
+    target_ulong la = ldq(desc + 8);
+
+    if (type > 3 || pcid > 0xfff) {
+        raise_exception_err_ra(env, EXCP0D_GPF, 0, retaddr);
+    }
+
+    switch (type) {
+        case 0: /* individual address */
+#ifdef TARGET_X86_64
+            if ((target_long) la != ((target_long) la << 16) >> 16) {
+                raise_exception_err_ra(env, EXCP0D_GPF, 0, retaddr);
+            }
+#endif
+            /* fall through */
+        case 1: /* single context */
+            if (!(env->cr[4] & CR4_PCIDE_MASK) && pcid != 0) {
+                raise_exception_err_ra(env, EXCP0D_GPF, 0, retaddr);
+            }
+            if (type == 0) {
+                tlb_flush_page_asid(env, pcid, la);
+            } else {
+                tlb_flush_asid(env, pcid);
+            }
+            break;
+        case 2: /* all contexts, including the global pages */
+            tlb_flush(env, 1);
+            break;
+        default: /* all contexts except the global pages */
+            tlb_flush(env, 0);
+            tlb_flush_other_asids(env);
+            break;
+    }
+}
+
 void helper_write_crN(int reg, target_ulong t0) {
+    uintptr_t retaddr = GETPC();
+
+    if (reg == CR_INVPCID) {
+        helper_invpcid(t0, retaddr);
+        return;
+    }
+
     helper_svm_check_intercept_param(SVM_EXIT_WRITE_CR0 + reg, 0);
     switch (reg) {
         case 0:
+            /* paging cannot be disabled with PCIDs enabled */
+            if ((env->cr[4] & CR4_PCIDE_MASK) && !(t0 & CR0_PG_MASK)) {
+                raise_exception_err_ra(env, EXCP0D_GPF, 0, retaddr);
+            }
             cpu_x86_update_cr0(env, t0);
             break;
         case 3:
             cpu_x86_update_cr3(env, t0);
             break;
         case 4:
+            /* PCIDs can only be enabled in long mode, with PCID 0 loaded */
+            if ((t0 & CR4_PCIDE_MASK) && !(env->cr[4] & CR4_PCIDE_MASK) &&
+                (!(env->cpuid.cpuid_ext_features & CPUID_EXT_PCID) || !(env->hflags & HF_LMA_MASK) ||
+                 (env->cr[3] & 0xfff))) {
+                raise_exception_err_ra(env, EXCP0D_GPF, 0, retaddr);
+            }
             cpu_x86_update_cr4(env, t0);
             break;
         case 8:
@@ -3226,7 +3393,12 @@ void helper_rdtsc(void) {
     }
     helper_svm_check_intercept_param(SVM_EXIT_RDTSC, 0);
 
-    val = cpu_get_tsc() + env->tsc_offset;
+    if (likely(!replay_enabled()) || !replay_play_input(REPLAY_EVENT_TSC, 0, 0, &val)) {
+        val = cpu_get_tsc() + env->tsc_offset;
+        if (unlikely(replay_enabled())) {
+            replay_record_input(REPLAY_EVENT_TSC, 0, 0, val);
+        }
+    }
     EAX_W((uint32_t)(val));
     EDX_W((uint32_t)(val >> 32));
 }
@@ -4976,6 +5148,13 @@ void tlb_fill(CPUX86State *env1, target_ulong addr, target_ulong page_addr, int
 void tlb_fill(CPUX86State *env1, target_ulong addr, target_ulong page_addr, int is_write, int mmu_idx, void *retaddr) {
     int ret;
 
+#if !defined(CONFIG_SYMBEX)
+    if (unlikely(tb_spec_in_worker())) {
+        /* A speculative translation reached code the worker has no mapping for */
+        tb_spec_abort();
+    }
+#endif
+
 #if defined(CONFIG_SYMBEX)
     if (unlikely(*g_sqi.events.on_tlb_miss_signals_count)) {
         g_sqi.events.on_tlb_miss(addr, is_write, retaddr);
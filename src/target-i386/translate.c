@@ -29,6 +29,8 @@
 // clang-format on
 
 #include <cpu/disas.h>
+#include "exec-tbspec.h"
+#include "exec-tbtier.h"
 
 #ifdef CONFIG_SYMBEX
 #include <cpu/se_libcpu.h>
@@ -104,6 +106,7 @@ typedef struct DisasContext {
     int tf;                 /* TF cpu flag */
     int singlestep_enabled; /* "hardware" single step enabled */
     int jmp_opt;            /* use direct block chaining for direct jumps */
+    int lock_atomic;        /* LOCK-prefixed stores go through helper_lock */
     int mem_index;          /* select memory access functions */
     uint64_t flags;         /* all execution flags */
     struct TranslationBlock *tb;
@@ -113,6 +116,7 @@ typedef struct DisasContext {
     int cpuid_ext_features;
     int cpuid_ext2_features;
     int cpuid_ext3_features;
+    int cpuid_7_0_ebx_features;
 
 #ifdef CONFIG_SYMBEX
     void *cpuState;
@@ -132,6 +136,13 @@ typedef struct DisasContext {
 #endif
     CPUX86State *env;
     // enum ETranslationBlockType tb_type;
+
+    /* trace formation, see exec-tbtier.c */
+    const struct tb_trace *trace;
+    int trace_block;        /* index of the block being translated */
+    int trace_follow;       /* the block jumps to the next block of the trace */
+    TCGLabel *trace_label;  /* target of that jump, NULL if it falls through */
+    int trace_slots;        /* goto_tb slots used by side exits */
 } DisasContext;
 
 #ifdef CONFIG_SYMBEX
@@ -660,6 +671,33 @@ static inline void gen_op_st_T1_A0(int idx) {
     gen_op_st_v(idx, cpu_T[1], cpu_A0);
 }
 
+/*
+ * Memory operand of a read-modify-write instruction. With a LOCK prefix, the
+ * store only happens if the memory still holds the loaded value, otherwise
+ * the instruction is executed again, see helper_lock. The instruction must
+ * not modify anything it reads before the store.
+ */
+static inline void gen_op_ld_rmw(DisasContext *s, int idx, TCGv t0) {
+    gen_op_ld_v(idx, t0, cpu_A0);
+    if (s->lock_atomic && (s->prefix & PREFIX_LOCK)) {
+        tcg_gen_st_tl(t0, cpu_env, offsetof(CPUX86State, lock_old));
+    }
+}
+
+static inline void gen_op_st_rmw(DisasContext *s, int idx, TCGv t0) {
+    if (s->lock_atomic && (s->prefix & PREFIX_LOCK)) {
+        TCGv_i32 op = tcg_const_i32(idx);
+
+        tcg_gen_st_tl(cpu_A0, cpu_env, offsetof(CPUX86State, lock_addr));
+        tcg_gen_st_tl(t0, cpu_env, offsetof(CPUX86State, lock_val));
+        tcg_gen_st_i32(op, cpu_env, offsetof(CPUX86State, lock_op));
+        tcg_temp_free_i32(op);
+        gen_helper_lock();
+    } else {
+        gen_op_st_v(idx, t0, cpu_A0);
+    }
+}
+
 static inline void gen_jmp_im(DisasContext *s, target_ulong pc) {
     tcg_gen_movi_tl(cpu_tmp0, pc);
     tcg_gen_st_tl(cpu_tmp0, cpu_env, offsetof(CPUX86State, eip));
@@ -1364,7 +1402,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d) {
     if (d != OR_TMP0) {
         gen_op_mov_TN_reg(ot, 0, d);
     } else {
-        gen_op_ld_T0_A0(ot + s1->mem_index);
+        gen_op_ld_rmw(s1, ot + s1->mem_index, cpu_T[0]);
     }
     switch (op) {
         case OP_ADCL:
@@ -1376,7 +1414,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d) {
             if (d != OR_TMP0)
                 gen_op_mov_reg_T0(ot, d);
             else
-                gen_op_st_T0_A0(ot + s1->mem_index);
+                gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0]);
             tcg_gen_mov_tl(cpu_cc_src, cpu_T[1]);
             tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
             tcg_gen_trunc_tl_i32(cpu_tmp2_i32, cpu_tmp4);
@@ -1393,7 +1431,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d) {
             if (d != OR_TMP0)
                 gen_op_mov_reg_T0(ot, d);
             else
-                gen_op_st_T0_A0(ot + s1->mem_index);
+                gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0]);
             tcg_gen_mov_tl(cpu_cc_src, cpu_T[1]);
             tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
             tcg_gen_trunc_tl_i32(cpu_tmp2_i32, cpu_tmp4);
@@ -1406,7 +1444,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d) {
             if (d != OR_TMP0)
                 gen_op_mov_reg_T0(ot, d);
             else
-                gen_op_st_T0_A0(ot + s1->mem_index);
+                gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0]);
             gen_op_update2_cc();
             s1->cc_op = CC_OP_ADDB + ot;
             break;
@@ -1415,7 +1453,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d) {
             if (d != OR_TMP0)
                 gen_op_mov_reg_T0(ot, d);
             else
-                gen_op_st_T0_A0(ot + s1->mem_index);
+                gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0]);
             gen_op_update2_cc();
             s1->cc_op = CC_OP_SUBB + ot;
             break;
@@ -1425,7 +1463,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d) {
             if (d != OR_TMP0)
                 gen_op_mov_reg_T0(ot, d);
             else
-                gen_op_st_T0_A0(ot + s1->mem_index);
+                gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0]);
             gen_op_update1_cc();
             s1->cc_op = CC_OP_LOGICB + ot;
             break;
@@ -1434,7 +1472,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d) {
             if (d != OR_TMP0)
                 gen_op_mov_reg_T0(ot, d);
             else
-                gen_op_st_T0_A0(ot + s1->mem_index);
+                gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0]);
             gen_op_update1_cc();
             s1->cc_op = CC_OP_LOGICB + ot;
             break;
@@ -1443,7 +1481,7 @@ static void gen_op(DisasContext *s1, int op, int ot, int d) {
             if (d != OR_TMP0)
                 gen_op_mov_reg_T0(ot, d);
             else
-                gen_op_st_T0_A0(ot + s1->mem_index);
+                gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0]);
             gen_op_update1_cc();
             s1->cc_op = CC_OP_LOGICB + ot;
             break;
@@ -1459,7 +1497,7 @@ static void gen_inc(DisasContext *s1, int ot, int d, int c) {
     if (d != OR_TMP0)
         gen_op_mov_TN_reg(ot, 0, d);
     else
-        gen_op_ld_T0_A0(ot + s1->mem_index);
+        gen_op_ld_rmw(s1, ot + s1->mem_index, cpu_T[0]);
     if (s1->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s1->cc_op);
     if (c > 0) {
@@ -1472,7 +1510,7 @@ static void gen_inc(DisasContext *s1, int ot, int d, int c) {
     if (d != OR_TMP0)
         gen_op_mov_reg_T0(ot, d);
     else
-        gen_op_st_T0_A0(ot + s1->mem_index);
+        gen_op_st_rmw(s1, ot + s1->mem_index, cpu_T[0]);
     gen_compute_eflags_c(cpu_cc_src);
     tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
 }
@@ -2352,6 +2390,36 @@ static inline int insn_const_size(unsigned int ot) {
         return 4;
 }
 
+/* Returns true if eip is the start of the next block of the trace being translated */
+static inline int trace_continues_at(DisasContext *s, target_ulong eip) {
+    return s->trace && !s->trace_follow && s->trace_block + 1 < s->trace->count &&
+           s->trace->pcs[s->trace_block + 1] == s->cs_base + eip;
+}
+
+/* Jump from a block of a trace, either to the next block or through a side exit */
+static void gen_trace_goto(DisasContext *s, target_ulong eip) {
+    target_ulong pc = s->cs_base + eip;
+    int slot;
+
+    if (trace_continues_at(s, eip)) {
+        s->trace_follow = 1;
+        s->trace_label = gen_new_label();
+        tcg_gen_br(s->trace_label);
+        return;
+    }
+
+    /* only two exits can be chained */
+    if (s->trace_slots < 2 && (pc & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK)) {
+        slot = s->trace_slots++;
+        tcg_gen_goto_tb(slot);
+        gen_jmp_im(s, eip);
+        tcg_gen_exit_tb(s->tb, slot);
+    } else {
+        gen_jmp_im(s, eip);
+        tcg_gen_exit_tb(NULL, 0);
+    }
+}
+
 static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip) {
     TranslationBlock *tb;
     target_ulong pc;
@@ -2363,9 +2431,15 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip) {
     gen_jmp_im(s, eip);
     tcg_gen_exit_tb(tb, eip);
 #else
+    if (s->trace) {
+        gen_trace_goto(s, eip);
+        return;
+    }
+
     /* NOTE: we handle the case where the TB spans two pages here */
     if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
         (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK)) {
+        tb_spec_note_successor(tb_num, pc);
 /* jump to same page: we can use a direct jump */
 #ifdef CONFIG_SYMBEX
         gen_jmp_im(s, eip);
@@ -2765,18 +2839,113 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip) {
     s->is_jmp = DISAS_TB_JUMP;
 }
 
-/* generate a generic end of block. Trace exception is also generated
-   if needed */
-static void gen_eob(DisasContext *s) {
-    /**
-     * Make sure to unlock before terminating the block.
-     * Do it before calling instrumentation events, to avoid deadlocks
-     * if one event tries to exit the cpu loop.
-     */
-    if (s->prefix & PREFIX_LOCK) {
-        gen_helper_unlock();
+static inline int gen_ras_enabled(DisasContext *s) {
+#ifdef CONFIG_SYMBEX
+    /* the engine must see every transition between TBs */
+    return 0;
+#else
+    return TCG_TARGET_HAS_goto_ptr && s->jmp_opt;
+#endif
+}
+
+/* Counters in env are private to the vCPU, unlike g_cpu_stats */
+static void gen_inc_env_stat(size_t offset) {
+    tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, offset);
+    tcg_gen_addi_i64(cpu_tmp1_i64, cpu_tmp1_i64, 1);
+    tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, offset);
+}
+
+/* Pushes the return address of a call on the return stack, along with
+   the slot that caches the TB at that address */
+static void gen_ras_push(DisasContext *s, target_ulong next_eip) {
+    TCGv_ptr entry;
+
+    if (!gen_ras_enabled(s)) {
+        return;
     }
 
+    entry = tcg_temp_new_ptr();
+    tcg_gen_ld_i32(cpu_tmp2_i32, cpu_env, offsetof(CPUArchState, ras_top));
+    tcg_gen_addi_i32(cpu_tmp2_i32, cpu_tmp2_i32, 1);
+    tcg_gen_andi_i32(cpu_tmp2_i32, cpu_tmp2_i32, TB_RAS_SIZE - 1);
+    tcg_gen_st_i32(cpu_tmp2_i32, cpu_env, offsetof(CPUArchState, ras_top));
+
+    tcg_gen_muli_i32(cpu_tmp2_i32, cpu_tmp2_i32, sizeof(struct tb_ras_entry));
+    tcg_gen_extu_i32_ptr(entry, cpu_tmp2_i32);
+    tcg_gen_add_ptr(entry, entry, cpu_env);
+
+    tcg_gen_movi_tl(cpu_tmp0, next_eip);
+    tcg_gen_st_tl(cpu_tmp0, entry, offsetof(CPUArchState, ras[0].eip));
+    tcg_gen_movi_i32(cpu_tmp2_i32, tb_ras_slot_hash(s->cs_base + next_eip));
+    tcg_gen_st_i32(cpu_tmp2_i32, entry, offsetof(CPUArchState, ras[0].slot));
+    tcg_temp_free_ptr(entry);
+}
+
+/* Pops the return stack and jumps to the cached TB if the prediction holds.
+   Falls through otherwise, asking the next lookup to fill the slot. The
+   return address must already be in eip. Like chained jumps, the target
+   TB checks for exit requests at its start. */
+static void gen_ras_lookup(DisasContext *s) {
+    TCGLabel *miss = gen_new_label();
+    TCGv eip = tcg_temp_local_new();
+    TCGv_ptr entry = tcg_temp_local_new_ptr();
+    TCGv_ptr slot = tcg_temp_local_new_ptr();
+    TCGv_ptr tc_ptr;
+
+    tcg_gen_ld_tl(eip, cpu_env, offsetof(CPUArchState, eip));
+
+    tcg_gen_ld_i32(cpu_tmp3_i32, cpu_env, offsetof(CPUArchState, ras_top));
+    tcg_gen_muli_i32(cpu_tmp2_i32, cpu_tmp3_i32, sizeof(struct tb_ras_entry));
+    tcg_gen_extu_i32_ptr(entry, cpu_tmp2_i32);
+    tcg_gen_add_ptr(entry, entry, cpu_env);
+    tcg_gen_subi_i32(cpu_tmp3_i32, cpu_tmp3_i32, 1);
+    tcg_gen_andi_i32(cpu_tmp3_i32, cpu_tmp3_i32, TB_RAS_SIZE - 1);
+    tcg_gen_st_i32(cpu_tmp3_i32, cpu_env, offsetof(CPUArchState, ras_top));
+
+    tcg_gen_ld_tl(cpu_tmp0, entry, offsetof(CPUArchState, ras[0].eip));
+    tcg_gen_brcond_tl(TCG_COND_NE, cpu_tmp0, eip, miss);
+
+    tcg_gen_ld_i32(cpu_tmp2_i32, entry, offsetof(CPUArchState, ras[0].slot));
+    tcg_gen_muli_i32(cpu_tmp2_i32, cpu_tmp2_i32, sizeof(struct tb_ras_slot));
+    tcg_gen_extu_i32_ptr(slot, cpu_tmp2_i32);
+    tcg_gen_add_ptr(slot, slot, cpu_env);
+
+    tcg_gen_ld_i32(cpu_tmp2_i32, slot, offsetof(CPUArchState, ras_slots[0].gen));
+    tcg_gen_ld_i32(cpu_tmp3_i32, cpu_env, offsetof(CPUArchState, ras_gen));
+    tcg_gen_brcond_i32(TCG_COND_NE, cpu_tmp2_i32, cpu_tmp3_i32, miss);
+
+    /* near returns change neither cs nor the TB flags, but the slot may
+       have been filled by a return from another code segment */
+    tcg_gen_ld_i32(cpu_tmp2_i32, slot, offsetof(CPUArchState, ras_slots[0].flags));
+    tcg_gen_brcondi_i32(TCG_COND_NE, cpu_tmp2_i32, s->flags, miss);
+    tcg_gen_ld_tl(cpu_tmp0, slot, offsetof(CPUArchState, ras_slots[0].cs_base));
+    tcg_gen_brcondi_tl(TCG_COND_NE, cpu_tmp0, s->cs_base, miss);
+
+    tcg_gen_addi_tl(eip, eip, s->cs_base);
+    tcg_gen_ld_tl(cpu_tmp0, slot, offsetof(CPUArchState, ras_slots[0].pc));
+    tcg_gen_brcond_tl(TCG_COND_NE, cpu_tmp0, eip, miss);
+
+    tc_ptr = tcg_temp_new_ptr();
+    tcg_gen_ld_ptr(tc_ptr, slot, offsetof(CPUArchState, ras_slots[0].tc_ptr));
+    gen_inc_env_stat(offsetof(CPUArchState, ras_hits));
+    tcg_gen_op1i(INDEX_op_goto_ptr, tcgv_ptr_arg(tc_ptr));
+    tcg_temp_free_ptr(tc_ptr);
+
+    /* counted by helper_lookup_tb_ptr */
+    gen_set_label(miss);
+    tcg_gen_movi_i32(cpu_tmp2_i32, 1);
+    tcg_gen_st_i32(cpu_tmp2_i32, cpu_env, offsetof(CPUArchState, ras_fill));
+
+    tcg_temp_free_ptr(slot);
+    tcg_temp_free_ptr(entry);
+    tcg_temp_free(eip);
+}
+
+/* generate a generic end of block. Trace exception is also generated
+   if needed. If jr is set, the block ends with a lookup of the next TB
+   in the jump cache instead of a return to the execution loop, preceded
+   by the return address prediction if ret is set. */
+static void gen_eob_worker(DisasContext *s, int jr, int ret) {
 #ifdef CONFIG_SYMBEX
     if (!s->done_instr_end) {
         // Catch all the remaining cases
@@ -2796,16 +2965,40 @@ static void gen_eob(DisasContext *s) {
         gen_helper_debug();
     } else if (s->tf) {
         gen_helper_single_step();
+    } else if (jr) {
+        if (ret) {
+            gen_ras_lookup(s);
+        }
+        tcg_gen_lookup_and_goto_ptr();
     } else {
         tcg_gen_exit_tb(NULL, 0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s) {
+    gen_eob_worker(s, 0, 0);
+}
+
+/* end of block after an indirect jump, call or return, eip already updated */
+static void gen_jr(DisasContext *s, int ret) {
+#ifdef CONFIG_SYMBEX
+    /* the engine must see every transition between TBs */
+    gen_eob_worker(s, 0, 0);
+#else
+    gen_eob_worker(s, s->jmp_opt, ret && gen_ras_enabled(s));
+#endif
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num) {
-    if (s->jmp_opt) {
+    if (s->jmp_opt && trace_continues_at(s, eip)) {
+        /* keep translating the next block of the trace, the flags state stays lazy */
+        s->trace_follow = 1;
+        s->trace_label = NULL;
+        s->is_jmp = DISAS_TB_JUMP;
+    } else if (s->jmp_opt) {
         gen_update_cc_op(s);
         gen_goto_tb(s, tb_num, eip);
         s->is_jmp = DISAS_TB_JUMP;
@@ -4147,10 +4340,6 @@ next_byte:
     s->aflag = aflag;
     s->dflag = dflag;
 
-    /* lock generation */
-    if (prefixes & PREFIX_LOCK)
-        gen_helper_lock();
-
 /* now check op code */
 reswitch:
     switch (b) {
@@ -4315,7 +4504,7 @@ reswitch:
                 if (op == 0)
                     s->rip_offset = insn_const_size(ot);
                 gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
-                gen_op_ld_T0_A0(ot + s->mem_index);
+                gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[0]);
             } else {
                 gen_op_mov_TN_reg(ot, 0, rm);
             }
@@ -4330,7 +4519,7 @@ reswitch:
                 case 2: /* not */
                     tcg_gen_not_tl(cpu_T[0], cpu_T[0]);
                     if (mod != 3) {
-                        gen_op_st_T0_A0(ot + s->mem_index);
+                        gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0]);
                     } else {
                         gen_op_mov_reg_T0(ot, rm);
                     }
@@ -4338,7 +4527,7 @@ reswitch:
                 case 3: /* neg */
                     tcg_gen_neg_tl(cpu_T[0], cpu_T[0]);
                     if (mod != 3) {
-                        gen_op_st_T0_A0(ot + s->mem_index);
+                        gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0]);
                     } else {
                         gen_op_mov_reg_T0(ot, rm);
                     }
@@ -4599,8 +4788,9 @@ reswitch:
 #endif
 
                     gen_push_T1(s);
+                    gen_ras_push(s, next_eip);
                     gen_op_jmp_T0(s);
-                    gen_eob(s);
+                    gen_jr(s, 0);
                     break;
                 case 3: /* lcall Ev */
                     SET_TB_TYPE(TB_CALL_IND);
@@ -4628,7 +4818,7 @@ reswitch:
                     if (s->dflag == 0)
                         gen_op_andl_T0_ffff();
                     gen_op_jmp_T0(s);
-                    gen_eob(s);
+                    gen_jr(s, 0);
                     break;
                 case 5: /* ljmp Ev */
                     SET_TB_TYPE(TB_JMP_IND);
@@ -4806,9 +4996,9 @@ reswitch:
             } else {
                 gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
                 gen_op_mov_TN_reg(ot, 0, reg);
-                gen_op_ld_T1_A0(ot + s->mem_index);
+                gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[1]);
                 gen_op_addl_T0_T1();
-                gen_op_st_T0_A0(ot + s->mem_index);
+                gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0]);
                 gen_op_mov_reg_T1(ot, reg);
             }
             gen_op_update2_cc();
@@ -4838,7 +5028,7 @@ reswitch:
             } else {
                 gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
                 tcg_gen_mov_tl(a0, cpu_A0);
-                gen_op_ld_v(ot + s->mem_index, t0, a0);
+                gen_op_ld_rmw(s, ot + s->mem_index, t0);
                 rm = 0; /* avoid warning */
             }
             label1 = gen_new_label();
@@ -4855,11 +5045,13 @@ reswitch:
                 /* perform no-op store cycle like physical cpu; must be
                    before changing accumulator to ensure idempotency if
                    the store faults and the instruction is restarted */
-                gen_op_st_v(ot + s->mem_index, t0, a0);
+                tcg_gen_mov_tl(cpu_A0, a0);
+                gen_op_st_rmw(s, ot + s->mem_index, t0);
                 gen_op_mov_reg_v(ot, R_EAX, t0);
                 tcg_gen_br(label2);
                 gen_set_label(label1);
-                gen_op_st_v(ot + s->mem_index, t1, a0);
+                tcg_gen_mov_tl(cpu_A0, a0);
+                gen_op_st_rmw(s, ot + s->mem_index, t1);
             }
             gen_set_label(label2);
             tcg_gen_mov_tl(cpu_cc_src, t0);
@@ -5292,12 +5484,9 @@ reswitch:
                 gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
                 gen_op_mov_TN_reg(ot, 0, reg);
                 /* for xchg, lock is implicit */
-                if (!(prefixes & PREFIX_LOCK))
-                    gen_helper_lock();
-                gen_op_ld_T1_A0(ot + s->mem_index);
-                gen_op_st_T0_A0(ot + s->mem_index);
-                if (!(prefixes & PREFIX_LOCK))
-                    gen_helper_unlock();
+                s->prefix |= PREFIX_LOCK;
+                gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[1]);
+                gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0]);
                 gen_op_mov_reg_T1(ot, reg);
             }
             break;
@@ -6136,7 +6325,7 @@ reswitch:
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0(s);
-            gen_eob(s);
+            gen_jr(s, 1);
             break;
         case 0xc3: /* ret */
             SET_TB_TYPE(TB_RET);
@@ -6150,7 +6339,7 @@ reswitch:
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0(s);
-            gen_eob(s);
+            gen_jr(s, 1);
             break;
         case 0xca: /* lret im */
             SET_TB_TYPE(TB_RET);
@@ -6237,6 +6426,7 @@ reswitch:
             tcg_gen_st_tl(cpu_T[0], cpu_env, offsetof(CPUArchState, return_address));
 #endif
             gen_push_T0(s);
+            gen_ras_push(s, next_eip);
             gen_jmp(s, tval);
         } break;
         case 0x9a: /* lcall im */
@@ -6468,7 +6658,7 @@ reswitch:
             if (mod != 3) {
                 s->rip_offset = 1;
                 gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
-                gen_op_ld_T0_A0(ot + s->mem_index);
+                gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[0]);
             } else {
                 gen_op_mov_TN_reg(ot, 0, rm);
             }
@@ -6504,7 +6694,7 @@ reswitch:
                 tcg_gen_sari_tl(cpu_tmp0, cpu_T[1], 3 + ot);
                 tcg_gen_shli_tl(cpu_tmp0, cpu_tmp0, ot);
                 tcg_gen_add_tl(cpu_A0, cpu_A0, cpu_tmp0);
-                gen_op_ld_T0_A0(ot + s->mem_index);
+                gen_op_ld_rmw(s, ot + s->mem_index, cpu_T[0]);
             } else {
                 gen_op_mov_TN_reg(ot, 0, rm);
             }
@@ -6539,7 +6729,7 @@ reswitch:
             s->cc_op = CC_OP_SARB + ot;
             if (op != 0) {
                 if (mod != 3)
-                    gen_op_st_T0_A0(ot + s->mem_index);
+                    gen_op_st_rmw(s, ot + s->mem_index, cpu_T[0]);
                 else
                     gen_op_mov_reg_T0(ot, rm);
                 tcg_gen_mov_tl(cpu_cc_src, cpu_tmp4);
@@ -6881,7 +7071,7 @@ reswitch:
         case 0x134: /* sysenter */
             SET_TB_TYPE(TB_SYSENTER);
             /* For Intel SYSENTER is valid on 64-bit */
-            if (CODE64(s) && cpu_single_env->cpuid.cpuid_vendor1 != CPUID_VENDOR_INTEL_1)
+            if (CODE64(s) && s->env->cpuid.cpuid_vendor1 != CPUID_VENDOR_INTEL_1)
                 goto illegal_op;
             if (!s->pe) {
                 gen_exception(s, EXCP0D_GPF, pc_start - s->cs_base);
@@ -6899,7 +7089,7 @@ reswitch:
             break;
         case 0x135: /* sysexit */
             /* For Intel SYSEXIT is valid on 64-bit */
-            if (CODE64(s) && cpu_single_env->cpuid.cpuid_vendor1 != CPUID_VENDOR_INTEL_1)
+            if (CODE64(s) && s->env->cpuid.cpuid_vendor1 != CPUID_VENDOR_INTEL_1)
                 goto illegal_op;
             if (!s->pe) {
                 gen_exception(s, EXCP0D_GPF, pc_start - s->cs_base);
@@ -7602,12 +7792,39 @@ reswitch:
 
             s->cc_op = CC_OP_EFLAGS;
             break;
+        case 0x138:
+            if ((prefixes & PREFIX_DATA) && !(prefixes & (PREFIX_REPZ | PREFIX_REPNZ)) &&
+                cpu_ldub_code(s->env, s->pc) == 0x82) {
+                /* invpcid */
+                s->pc++;
+                modrm = cpu_ldub_code(s->env, s->pc++);
+                mod = (modrm >> 6) & 3;
+                if (mod == 3 || !(s->cpuid_7_0_ebx_features & CPUID_7_0_EBX_INVPCID))
+                    goto illegal_op;
+                if (s->cpl != 0) {
+                    gen_exception(s, EXCP0D_GPF, pc_start - s->cs_base);
+                    break;
+                }
+                reg = ((modrm >> 3) & 7) | rex_r;
+                if (s->cc_op != CC_OP_DYNAMIC)
+                    gen_op_set_cc_op(s->cc_op);
+                gen_jmp_im(s, pc_start - s->cs_base);
+                gen_lea_modrm(s, modrm, &reg_addr, &offset_addr);
+                tcg_gen_st_tl(cpu_A0, cpu_env, offsetof(CPUX86State, invpcid_desc));
+                gen_op_mov_TN_reg(CODE64(s) ? OT_QUAD : OT_LONG, 0, reg);
+                gen_helper_write_crN(tcg_const_i32(CR_INVPCID), cpu_T[0]);
+                gen_jmp_im(s, s->pc - s->cs_base);
+                gen_eob(s);
+                break;
+            }
+            gen_sse(s, b, pc_start, rex_r);
+            break;
         case 0x10e ... 0x10f:
             /* 3DNow! instructions, ignore prefixes */
             s->prefix &= ~(PREFIX_REPZ | PREFIX_REPNZ | PREFIX_DATA);
         case 0x110 ... 0x117:
         case 0x128 ... 0x12f:
-        case 0x138 ... 0x13a:
+        case 0x139 ... 0x13a:
         case 0x150 ... 0x179:
         case 0x17c ... 0x17f:
         case 0x1c2:
@@ -7619,20 +7836,8 @@ reswitch:
             goto illegal_op;
     }
 
-    /**
-     * lock generation
-     * There must not be any more instructions after gen_eob is called,
-     * they would be dead code anyway, causing crashes in tcg-llvm.
-     */
-    if (!s->is_jmp) {
-        if (s->prefix & PREFIX_LOCK)
-            gen_helper_unlock();
-    }
     return s->pc;
 illegal_op:
-    if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
-    /* XXX: ensure that no lock was generated */
     gen_exception(s, EXCP06_ILLOP, pc_start - s->cs_base);
     return s->pc;
 }
@@ -7675,6 +7880,7 @@ void optimize_flags_init(void) {
 static inline void gen_tb_start(TranslationBlock *tb) {
     if (tb->cflags & CF_HAS_INTERRUPT_EXIT) {
         TCGv_i32 exit_request;
+        int32_t *counter;
 
         tcg_ctx->exitreq_label = gen_new_label();
         exit_request = tcg_temp_new_i32();
@@ -7682,6 +7888,35 @@ static inline void gen_tb_start(TranslationBlock *tb) {
 
         tcg_gen_brcondi_i32(TCG_COND_NE, exit_request, 0, tcg_ctx->exitreq_label);
 
+        /* The whole TB must fit in the instruction budget, see fetch_and_run_tb */
+        if (cpu_get_budget_mode() != CPU_BUDGET_OFF) {
+            TCGv_ptr icount = tcg_const_ptr(&tb->icount);
+            TCGv_i32 budget = tcg_temp_local_new_i32();
+
+            /* the instruction count is only known once the TB is translated */
+            tcg_gen_ld16u_i32(exit_request, icount, 0);
+            tcg_gen_ld_i32(budget, cpu_env, offsetof(CPUState, icount_budget));
+            tcg_gen_sub_i32(budget, budget, exit_request);
+            tcg_gen_brcondi_i32(TCG_COND_LT, budget, 0, tcg_ctx->exitreq_label);
+            tcg_gen_st_i32(budget, cpu_env, offsetof(CPUState, icount_budget));
+
+            tcg_temp_free_i32(budget);
+            tcg_temp_free_ptr(icount);
+        }
+
+        /* Hot TBs go back to the execution loop to be retranslated as traces */
+        counter = tb_tier_get_counter(tb);
+        if (counter) {
+            TCGv_ptr ptr = tcg_const_ptr(counter);
+
+            tcg_gen_ld_i32(exit_request, ptr, 0);
+            tcg_gen_subi_i32(exit_request, exit_request, 1);
+            tcg_gen_st_i32(exit_request, ptr, 0);
+            tcg_gen_brcondi_i32(TCG_COND_EQ, exit_request, 0, tcg_ctx->exitreq_label);
+
+            tcg_temp_free_ptr(ptr);
+        }
+
         tcg_temp_free_i32(exit_request);
     }
 }
@@ -7699,10 +7934,9 @@ static inline void gen_tb_end(TranslationBlock *tb) {
 static inline void gen_intermediate_code_internal(CPUX86State *env, TranslationBlock *tb) {
     DisasContext dc1, *dc = &dc1;
     target_ulong pc_ptr, new_pc_ptr;
-    CPUBreakpoint *bp;
     int lj, cflags;
     uint64_t flags;
-    target_ulong pc_start;
+    target_ulong pc_start, trace_end;
     target_ulong cs_base;
     int num_insns;
     int max_insns;
@@ -7716,6 +7950,10 @@ static inline void gen_intermediate_code_internal(CPUX86State *env, TranslationB
     memset(dc, 0, sizeof(*dc));
 
     dc->env = env;
+#ifndef STATIC_TRANSLATOR
+    dc->trace = tb_tier_current_trace();
+#endif
+    trace_end = pc_start;
     dc->pe = (flags >> HF_PE_SHIFT) & 1;
     dc->code32 = (flags >> HF_CS32_SHIFT) & 1;
     dc->ss32 = (flags >> HF_SS32_SHIFT) & 1;
@@ -7725,7 +7963,13 @@ static inline void gen_intermediate_code_internal(CPUX86State *env, TranslationB
     dc->cpl = (flags >> HF_CPL_SHIFT) & 3;
     dc->iopl = (flags >> IOPL_SHIFT) & 3;
     dc->tf = (flags >> TF_SHIFT) & 1;
-    dc->singlestep_enabled = env->singlestep_enabled;
+    dc->singlestep_enabled = !!(flags & HF_SSTEP_MASK);
+#if defined(CONFIG_SYMBEX) || defined(STATIC_TRANSLATOR)
+    /* the engine must see the accesses of locked instructions like any other */
+    dc->lock_atomic = 0;
+#else
+    dc->lock_atomic = !env->lock_step;
+#endif
     dc->cc_op = CC_OP_DYNAMIC;
     dc->cs_base = cs_base;
     dc->tb = tb;
@@ -7742,12 +7986,13 @@ static inline void gen_intermediate_code_internal(CPUX86State *env, TranslationB
     dc->cpuid_ext_features = env->cpuid.cpuid_ext_features;
     dc->cpuid_ext2_features = env->cpuid.cpuid_ext2_features;
     dc->cpuid_ext3_features = env->cpuid.cpuid_ext3_features;
+    dc->cpuid_7_0_ebx_features = env->cpuid.cpuid_7_0_ebx_features;
 #ifdef TARGET_X86_64
     dc->lma = (flags >> HF_LMA_SHIFT) & 1;
     dc->code64 = (flags >> HF_CS64_SHIFT) & 1;
 #endif
     dc->flags = flags;
-    dc->jmp_opt = !(dc->tf || env->singlestep_enabled || (flags & HF_INHIBIT_IRQ_MASK)
+    dc->jmp_opt = !(dc->tf || dc->singlestep_enabled || (flags & HF_INHIBIT_IRQ_MASK)
 #ifndef CONFIG_SOFTMMU
                     || (flags & HF_SOFTMMU_MASK)
 #endif
@@ -7801,11 +8046,8 @@ static inline void gen_intermediate_code_internal(CPUX86State *env, TranslationB
 
     for (;;) {
         if (unlikely(!QTAILQ_EMPTY(&env->breakpoints))) {
-            QTAILQ_FOREACH (bp, &env->breakpoints, entry) {
-                if (bp->pc == pc_ptr && !((bp->flags & BP_CPU) && (tb->flags & HF_RF_MASK))) {
-                    gen_debug(dc, pc_ptr - dc->cs_base);
-                    break;
-                }
+            if (cpu_breakpoint_check(env, pc_ptr, !!(tb->flags & HF_RF_MASK))) {
+                gen_debug(dc, pc_ptr - dc->cs_base);
             }
         }
 
@@ -7846,7 +8088,21 @@ static inline void gen_intermediate_code_internal(CPUX86State *env, TranslationB
         num_insns++;
         /* stop translation if indicated */
         if (dc->is_jmp) {
-            break;
+            if (!dc->trace_follow) {
+                break;
+            }
+
+            /* carry on with the next block of the trace */
+            if (dc->trace_label) {
+                gen_set_label(dc->trace_label);
+            }
+            dc->trace_follow = 0;
+            dc->trace_label = NULL;
+            dc->trace_block++;
+            dc->is_jmp = DISAS_NEXT;
+            trace_end = MAX(trace_end, pc_ptr);
+            pc_ptr = dc->trace->pcs[dc->trace_block];
+            continue;
         }
         /* if single step mode, we generate only one instruction and
            generate an exception */
@@ -7913,7 +8169,7 @@ static inline void gen_intermediate_code_internal(CPUX86State *env, TranslationB
     }
 #endif
 
-    tb->size = pc_ptr - pc_start;
+    tb->size = MAX(trace_end, pc_ptr) - pc_start;
     tb->icount = num_insns;
 
 #ifdef CONFIG_SYMBEX
@@ -193,6 +193,23 @@ void init_clocks(void) {
     host_clock = qemu_new_clock(QEMU_CLOCK_HOST);
 }
 
+/* Time left before the first timer of the clock expires, INT64_MAX if none */
+static int64_t libcpu_clock_deadline_ns(CPUClock *clock) {
+    if (!clock || !clock->enabled || !clock->active_timers) {
+        return INT64_MAX;
+    }
+
+    return clock->active_timers->expire_time - libcpu_get_clock_ns(clock);
+}
+
+int64_t libcpu_timers_deadline_ns(void) {
+    int64_t deadline = libcpu_clock_deadline_ns(vm_clock);
+
+    deadline = MIN(deadline, libcpu_clock_deadline_ns(rt_clock));
+    deadline = MIN(deadline, libcpu_clock_deadline_ns(host_clock));
+    return MAX(deadline, 0);
+}
+
 void libcpu_run_all_timers(void) {
     /* vm time timers */
     libcpu_run_timers(vm_clock);
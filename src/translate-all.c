@@ -45,6 +45,8 @@
 #endif
 
 #include "exec-tb.h"
+#include "exec-tbcache.h"
+#include "exec-tbhash.h"
 #include "exec.h"
 
 /* code generation context */
@@ -89,7 +91,9 @@ static inline size_t size_code_gen_buffer(size_t tb_size) {
 
 static inline void *alloc_code_gen_buffer(TCGContext *ctx) {
     size_t length = ctx->code_gen_buffer_size;
-    void *buf = mmap(NULL, length, PROT_WRITE | PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    /* Try to get the same address as the persistent translation cache, if any */
+    void *buf = mmap(tb_cache_code_gen_hint(), length, PROT_WRITE | PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
     void *end = buf + length;
     size_t size;
 
@@ -115,6 +119,12 @@ static inline void *alloc_code_gen_buffer(TCGContext *ctx) {
 }
 
 static inline void code_gen_alloc(TCGContext *tcg, size_t tb_size) {
+    /* Release the default buffer allocated by cpu_gen_init */
+    if (tcg->code_gen_buffer) {
+        munmap(tcg->code_gen_buffer, tcg->code_gen_buffer_size);
+        tcg->code_gen_buffer = NULL;
+    }
+
     tcg->code_gen_buffer_size = size_code_gen_buffer(tb_size);
     tcg->code_gen_buffer = alloc_code_gen_buffer(tcg);
     if (tcg->code_gen_buffer == NULL) {
@@ -168,7 +178,7 @@ static void cpu_gen_init(TCGContext *ctx, tcg_settings_t *settings) {
     ctx->qemu_st_trace_helpers[3] = g_sqi.mem.__stq_mmu_trace;
 #endif
 
-    extern CPUArchState *env;
+    extern LIBCPU_VCPU_LOCAL CPUArchState *env;
     ctx->tcg_struct_size = sizeof(*tcg_ctx);
     ctx->env_ptr = (uintptr_t) &env;
     ctx->env_offset_eip = offsetof(CPUArchState, eip);
@@ -211,6 +221,11 @@ void tcg_exec_init(unsigned long tb_size) {
     tcg_prologue_init(tcg_ctx);
 
     tcg_region_init();
+
+    tb_hash_init();
+
+    /* Restored code goes right after the prologue */
+    tb_cache_load();
 }
 
 int cpu_gen_code(CPUArchState *env, TranslationBlock *tb) {